@@ -3,6 +3,78 @@
 #include <memory>
 #include <vector>
 #include <map>
+#include <tuple>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+
+// externs are looked up with dlopen/dlsym
+#if defined(__unix__) || defined(__APPLE__)
+#define LAP_DLOPEN 1
+#include <dlfcn.h>
+#else
+#define LAP_DLOPEN 0
+#endif
+
+// the native code generator (--engine=jit) only knows x86-64 and needs mmap
+#if defined(__x86_64__) && defined(__unix__)
+#define LAP_NATIVE 1
+#include <csetjmp>
+#include <elf.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define LAP_NATIVE 0
+#endif
+
+// --batch maps its input files
+#if defined(__unix__) || defined(__APPLE__)
+#define LAP_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define LAP_MMAP 0
+#endif
+
+// --cache keeps compiled code in a directory
+#if defined(__unix__) || defined(__APPLE__)
+#define LAP_CACHE 1
+#include <cerrno>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define LAP_CACHE 0
+#endif
+
+// batch evaluation has AVX2 and SSE2 kernels on x86-64, picked at run time
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LAP_BATCH_X86 1
+#include <immintrin.h>
+#else
+#define LAP_BATCH_X86 0
+#endif
 
 // -----------------------------------=======
 //            Lexer
@@ -18,31 +90,61 @@ enum Token {
     // primary
     tok_identifier = -4,
     tok_number = -5,
+
+    // operators
+    tok_binary = -6,
+    tok_unary = -7,
+
+    // control
+    tok_if = -8,
+    tok_then = -9,
+    tok_else = -10,
 };
 
-static std::string IdentifierStr; // filled in if tok_identifier
-static double NumVal; // filled in if tok_number
+// thread_local so that the parallel parser (ParseItemsInParallel) can run one parser per thread
+static thread_local std::string IdentifierStr; // filled in if tok_identifier
+static thread_local double NumVal; // filled in if tok_number
+
+/// LexCur/LexEnd -- when LexCur is set the lexer reads from [LexCur, LexEnd) instead of standard input (see LexSource)
+static const char *LexCur = nullptr;
+static const char *LexEnd = nullptr;
+static int LastChar = ' '; // not sure why this is stored as an int and not a char? -- following LLVM guide will change later?
+
+static int ReadChar() {
+    if (!LexCur)
+        return getchar();
+    return LexCur == LexEnd ? EOF : (unsigned char)*LexCur++;
+}
 
 /// gettok - return the next token from standard input
 static int gettok() {
-    static int LastChar = ' '; // not sure why this is stored as an int and not a char? -- following LLVM guide will change later?
-
     // skip any whitespace
     while (isspace(LastChar))
-        LastChar = getchar();
+        LastChar = ReadChar();
 
     // needs to recognize any command tokens (e.g. def)
     if (isalpha(LastChar)) {
-        IdentifierStr = std::to_string(LastChar); // casting is implicit but it is good to specify probably
+        // std::to_string would give the decimal code of the char ("100" for 'd'), so append the char itself
+        IdentifierStr = (char)LastChar;
 
-        while (isalnum((LastChar = getchar())))
-            IdentifierStr += std::to_string(LastChar);
+        while (isalnum((LastChar = ReadChar())))
+            IdentifierStr += (char)LastChar;
 
         // Check that the token is one of our known identifiers, otherwise, return value for general identifier
         if (IdentifierStr == "def")
             return tok_def;
         if (IdentifierStr == "extern")
             return tok_extern;
+        if (IdentifierStr == "binary")
+            return tok_binary;
+        if (IdentifierStr == "unary")
+            return tok_unary;
+        if (IdentifierStr == "if")
+            return tok_if;
+        if (IdentifierStr == "then")
+            return tok_then;
+        if (IdentifierStr == "else")
+            return tok_else;
 
         return tok_identifier;
     }
@@ -51,8 +153,8 @@ static int gettok() {
         std::string NumStr;
 
         do {
-            NumStr += std::to_string(LastChar);
-            LastChar = getchar();
+            NumStr += (char)LastChar;
+            LastChar = ReadChar();
         } while (isdigit(LastChar) || LastChar == '.'); // why does LLVM guide use do while here and not in the above implementation; TODO: Fix later
 
         NumVal = strtod(NumStr.c_str(), nullptr); // not sure why clangtidy has a problem with this? not really even sure what it does
@@ -62,7 +164,7 @@ static int gettok() {
     if (LastChar == '#') {
         // Comment until end of line
         do
-            LastChar = getchar();
+            LastChar = ReadChar();
         while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
         if (LastChar != EOF)
@@ -75,10 +177,66 @@ static int gettok() {
 
     // char must be an operator (or something like it) return that and then move the buffer
     int ThisChar = LastChar;
-    LastChar = getchar();
+    LastChar = ReadChar();
     return ThisChar;
 }
 
+/// LexedToken -- a token as gettok returned it, together with the NumVal / IdentifierStr it left behind.
+/// Used when the whole input is lexed up front instead of being pulled a token at a time. Identifier
+/// text lives in the owning TokenBuffer's Names so that a token stays small and trivially copyable.
+struct LexedToken {
+    int Tok;
+    unsigned NameLen;
+    union {
+        double NumVal;   // tok_number
+        size_t NameBegin; // tok_identifier, offset into TokenBuffer::Names
+    };
+};
+
+struct TokenBuffer {
+    std::vector<LexedToken> Tokens;
+    std::string Names;
+};
+
+/// LexAll -- run gettok to the end of the input.
+static TokenBuffer LexAll() {
+    TokenBuffer Buf;
+    while (true) {
+        int Tok = gettok();
+        if (Tok == tok_eof)
+            return Buf;
+
+        LexedToken T;
+        T.Tok = Tok;
+        T.NameLen = 0;
+        T.NumVal = 0.0;
+        if (Tok == tok_identifier) {
+            T.NameBegin = Buf.Names.size();
+            T.NameLen = (unsigned)IdentifierStr.size();
+            Buf.Names += IdentifierStr;
+        } else if (Tok == tok_number) {
+            T.NumVal = NumVal;
+        }
+        Buf.Tokens.push_back(T);
+    }
+}
+
+/// LexSource -- LexAll over a string rather than standard input
+static TokenBuffer LexSource(const std::string &Source) {
+    const char *SavedCur = LexCur, *SavedEnd = LexEnd;
+    int SavedLastChar = LastChar;
+
+    LexCur = Source.data();
+    LexEnd = Source.data() + Source.size();
+    LastChar = ' ';
+    TokenBuffer Buf = LexAll();
+
+    LexCur = SavedCur;
+    LexEnd = SavedEnd;
+    LastChar = SavedLastChar;
+    return Buf;
+}
+
 // -----------------------------------=======
 //            End Lexer
 // -----------------------------------=======
@@ -86,11 +244,28 @@ static int gettok() {
 // -----------------------------------=======
 //            AST
 // -----------------------------------=======
+struct FunctionSlot; // see Function Table
+
 namespace { 
 
+/// ExprKind -- which subclass an ExprAST is, so passes over the tree can switch on it
+enum ExprKind {
+    EK_Number,
+    EK_Variable,
+    EK_Unary,
+    EK_Binary,
+    EK_Call,
+    EK_If,
+};
+
 class ExprAST {
+    ExprKind Kind;
+
 public:
+    ExprAST(ExprKind Kind) : Kind(Kind) {}
     virtual ~ExprAST() = default;
+
+    ExprKind getKind() const { return Kind; }
 };
 
 /// NumberExprAST -- Class for numeric literals (1.0)
@@ -98,52 +273,153 @@ class NumberExprAST : public ExprAST {
     double Val;
 
 public:
-    NumberExprAST(double Val) : Val(Val) {}
+    NumberExprAST(double Val) : ExprAST(EK_Number), Val(Val) {}
+
+    double getValue() const { return Val; }
 };
 
 /// VariableExprAST -- Class for referencing a variable, like "a"
 class VariableExprAST : public ExprAST {
     std::string Name;
+    mutable int Slot = -1; // parameter index, filled in by the evaluator the first time it looks the name up
+
+public:
+    VariableExprAST(const std::string &Name) : ExprAST(EK_Variable), Name(Name) {}
+
+    const std::string &getName() const { return Name; }
+
+    int getSlot() const { return Slot; }
+    void setSlot(int NewSlot) const { Slot = NewSlot; }
+};
+
+/// UnaryExprAST -- Expression class for a user defined unary operator.
+class UnaryExprAST : public ExprAST {
+    char Opcode;
+    std::unique_ptr<ExprAST> Operand;
+    mutable FunctionSlot *Slot = nullptr; // "unary" + Opcode's, bound by the evaluator on the first call
 
 public:
-    VariableExprAST(const std::string &Name) : Name(Name) {}
+    UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand) : ExprAST(EK_Unary), Opcode(Opcode), Operand(std::move(Operand)) {}
+
+    char getOpcode() const { return Opcode; }
+    ExprAST &getOperand() const { return *Operand; }
+
+    FunctionSlot *getSlot() const { return Slot; }
+    void setSlot(FunctionSlot *NewSlot) const { Slot = NewSlot; }
 };
 
 /// BinaryExprAST -- Expression class for a binary operator .
 class BinaryExprAST : public ExprAST {
     char Op;
     std::unique_ptr<ExprAST> LHS, RHS;
+    mutable FunctionSlot *Slot = nullptr; // "binary" + Op's for user defined operators, bound by the evaluator on the first call
 
 public:
-    BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS) : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {} // what TODO: review
+    BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS) : ExprAST(EK_Binary), Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {} // what TODO: review
+
+    char getOp() const { return Op; }
+    ExprAST &getLHS() const { return *LHS; }
+    ExprAST &getRHS() const { return *RHS; }
+
+    FunctionSlot *getSlot() const { return Slot; }
+    void setSlot(FunctionSlot *NewSlot) const { Slot = NewSlot; }
+
+    std::unique_ptr<ExprAST> releaseLHS() { return std::move(LHS); }
 };
 
 /// CallExprAST -- Expression class for function calls
 class CallExprAST : public ExprAST {
     std::string Callee;
     std::vector<std::unique_ptr<ExprAST>> Args;
+    mutable FunctionSlot *Slot = nullptr; // Callee's, bound by the evaluator on the first call
+
+public:
+    CallExprAST(const std::string &Callee, std::vector<std::unique_ptr<ExprAST>> Args) : ExprAST(EK_Call), Callee(Callee), Args(std::move(Args)) {};
+
+    const std::string &getCallee() const { return Callee; }
+    const std::vector<std::unique_ptr<ExprAST>> &getArgs() const { return Args; }
+
+    FunctionSlot *getSlot() const { return Slot; }
+    void setSlot(FunctionSlot *NewSlot) const { Slot = NewSlot; }
+};
+
+/// IfExprAST -- Expression class for if/then/else. The condition is true when it is neither 0.0 nor a NaN.
+class IfExprAST : public ExprAST {
+    std::unique_ptr<ExprAST> Cond, Then, Else;
 
 public:
-    CallExprAST(const std::string &Callee, std::vector<std::unique_ptr<ExprAST>> Args) : Callee(Callee), Args(std::move(Args)) {};
+    IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then, std::unique_ptr<ExprAST> Else)
+        : ExprAST(EK_If), Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+
+    ExprAST &getCond() const { return *Cond; }
+    ExprAST &getThen() const { return *Then; }
+    ExprAST &getElse() const { return *Else; }
 };
 
 /// Prototype AST -- This class represents the prototype for a function,
 /// which captures its name, and its argument names (thus implicitly the number of arguments the function takes)
+/// Operator definitions ("def binary| 5 (a b)") are prototypes too, named "binary|" / "unary!",
+/// with IsOperator set and the precedence the operator should be installed with.
 class PrototypeAST {
     std::string Name;
     std::vector<std::string> Args;
+    bool IsOperator;
+    unsigned Precedence; // precedence if a binary op
 
 public:
-    PrototypeAST(const std::string &Name, std::vector<std::string> Args) : Name(Name), Args(std::move(Args)) {};
+    PrototypeAST(const std::string &Name, std::vector<std::string> Args, bool IsOperator = false, unsigned Prec = 0)
+        : Name(Name), Args(std::move(Args)), IsOperator(IsOperator), Precedence(Prec) {};
+
+    const std::string &getName() const { return Name; }
+    const std::vector<std::string> &getArgs() const { return Args; }
+
+    bool isUnaryOp() const { return IsOperator && Args.size() == 1; }
+    bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
+
+    char getOperatorName() const {
+        assert(isUnaryOp() || isBinaryOp());
+        return Name[Name.size() - 1];
+    }
+
+    unsigned getBinaryPrecedence() const { return Precedence; }
+};
+
+/// LazyBody -- where the still unparsed body of a definition read with --lazy sits in the token buffer.
+struct LazyBody {
+    const TokenBuffer *Buf = nullptr;
+    size_t Begin = 0, End = 0;
 };
 
 /// FunctionAST -- This class represents a function definition itself.
+/// With --lazy the body starts out as a token range (see GetFunctionBody), Body is null until it is parsed.
 class FunctionAST {
     std::unique_ptr<PrototypeAST> Proto;
     std::unique_ptr<ExprAST> Body;
+    LazyBody Lazy;
+    std::vector<std::string> BodyDiags; // errors from parsing a lazy body, until they're reported
+    bool CalleesLoaded = false;
 
 public:
     FunctionAST(std::unique_ptr<PrototypeAST> Proto, std::unique_ptr<ExprAST> Body) : Proto(std::move(Proto)), Body(std::move(Body)) {};
+    FunctionAST(std::unique_ptr<PrototypeAST> Proto, LazyBody Lazy) : Proto(std::move(Proto)), Lazy(Lazy) {};
+
+    const PrototypeAST &getProto() const { return *Proto; }
+
+    /// getBody -- null while a lazy body is pending, or if it failed to parse
+    ExprAST *getBody() const { return Body.get(); }
+
+    bool isBodyPending() const { return Lazy.Buf != nullptr; }
+    const LazyBody &getLazyBody() const { return Lazy; }
+
+    void resolveLazyBody(std::unique_ptr<ExprAST> NewBody, std::vector<std::string> Diags) {
+        Body = std::move(NewBody);
+        BodyDiags = std::move(Diags);
+        Lazy = LazyBody();
+    }
+
+    std::vector<std::string> &getBodyDiags() { return BodyDiags; }
+
+    bool markCalleesLoaded() { return std::exchange(CalleesLoaded, true); }
 };
 
 } // end anonymous namespace
@@ -156,17 +432,59 @@ public:
 //            Parser
 // -----------------------------------=======
 
+/// TokenRange -- a run of pre-lexed tokens for the parser to read instead of calling gettok.
+/// Reading past End gives tok_eof.
+struct TokenRange {
+    const LexedToken *Cur;
+    const LexedToken *End;
+    const char *Names;
+};
+
 /// CurTok/getNextToken - Provide a simple token buffer.  CurTok is the current
 /// token the parser is looking at.  getNextToken reads another token from the
-/// lexer and updates CurTok with its results.
-static int CurTok;
+/// lexer (or from CurRange when one is set) and updates CurTok with its results.
+static thread_local int CurTok;
+static thread_local TokenRange *CurRange = nullptr;
 static int getNextToken() {
-    return CurTok = gettok();
+    if (!CurRange)
+        return CurTok = gettok();
+
+    if (CurRange->Cur == CurRange->End)
+        return CurTok = tok_eof;
+
+    const LexedToken &T = *CurRange->Cur++;
+    if (T.Tok == tok_identifier)
+        IdentifierStr.assign(CurRange->Names + T.NameBegin, T.NameLen);
+    else if (T.Tok == tok_number)
+        NumVal = T.NumVal;
+    return CurTok = T.Tok;
+}
+
+/// Diagnostics -- errors are not printed as they happen. The parser buffers them in PendingDiags (one
+/// buffer per thread), they are attached to the top-level item being parsed and ReportDiagnostics writes
+/// them out once that item has been dealt with, in source order. NumErrors keeps counting past MaxErrors
+/// (set with --max-errors=N, 0 means no limit) but nothing more is printed, and MainLoop gives up on the
+/// input once the limit is reached.
+static unsigned MaxErrors = 20;
+static unsigned NumErrors = 0;
+static thread_local std::vector<std::string> PendingDiags;
+
+static bool TooManyErrors() {
+    return MaxErrors != 0 && NumErrors >= MaxErrors;
+}
+
+static void ReportDiagnostics(std::vector<std::string> &Diags) {
+    for (const auto &D : Diags) {
+        ++NumErrors;
+        if (MaxErrors == 0 || NumErrors <= MaxErrors)
+            fprintf(stderr, "%s\n", D.c_str());
+    }
+    Diags.clear();
 }
 
 /// LogError* - These are little helper functions for error handling.
 std::unique_ptr<ExprAST> LogError(const char *Str){
-    fprintf(stderr, "Error: %s\n", Str);
+    PendingDiags.push_back(std::string("Error: ") + Str);
     return nullptr;
 }
 
@@ -243,10 +561,38 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
     return std::make_unique<CallExprAST>(IdName, std::move(Args));
 }
 
+/// ifexpr ::= 'if' expression 'then' expression 'else' expression
+static std::unique_ptr<ExprAST> ParseIfExpr() {
+    getNextToken(); // eat the if.
+
+    auto Cond = ParseExpression();
+    if (!Cond)
+        return nullptr;
+
+    if (CurTok != tok_then)
+        return LogError("expected then");
+    getNextToken(); // eat the then
+
+    auto Then = ParseExpression();
+    if (!Then)
+        return nullptr;
+
+    if (CurTok != tok_else)
+        return LogError("expected else");
+    getNextToken(); // eat the else
+
+    auto Else = ParseExpression();
+    if (!Else)
+        return nullptr;
+
+    return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then), std::move(Else));
+}
+
 /// primary
 ///   ::= identifierexpr
 ///   ::= numberexpr
 ///   ::= parenexpr
+///   ::= ifexpr
 static std::unique_ptr<ExprAST> ParsePrimary() {
     switch (CurTok) {
         default:
@@ -257,11 +603,18 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
             return ParseNumberExpr();
         case '(':
             return ParseParenExpr();
+        case tok_if:
+            return ParseIfExpr();
     }
 }
 
-/// BinOpPrecedence -- This holds the precedence for every operator that is defined. Values given in main()
-static std::map<char, int> BinOpPrecedence;
+/// BinOpPrecedence -- This holds the precedence for every operator that is defined, indexed by the operator char.
+/// Zero means "not a binary operator". Builtin values given in InstallBuiltinOperators, user defined ones are installed by
+/// InstallOperator when a "def binary" is parsed.
+static int BinOpPrecedence[256];
+
+/// UnaryOperators -- set for every char a "def unary" has defined, same indexing as BinOpPrecedence.
+static bool UnaryOperators[256];
 
 /*
  * With the helper above defined, we can now start parsing binary expressions.
@@ -277,15 +630,98 @@ static std::map<char, int> BinOpPrecedence;
 
 /// GetTokPrecedence -- Get the precedence of a binary operator token
 static int GetTokPrecedence() {
-    if (!isascii(CurTok)) { // catch any value of CurTok that would not work as a key to BinOpPrecedence
+    // the token kinds (tok_eof, tok_def, ...) are negative, so a single unsigned compare
+    // keeps them (and anything else that is not a char) out of the table
+    if ((unsigned)CurTok >= 256)
         return -1;
-    }
 
-    int TokPrec = BinOpPrecedence[CurTok]; // int --> char is implicit
+    int TokPrec = BinOpPrecedence[CurTok];
     if (TokPrec <= 0) return -1;
     return TokPrec;
 }
 
+/// unary
+///   ::= primary
+///   ::= '!' unary
+static std::unique_ptr<ExprAST> ParseUnary() {
+    // If the current token is not a defined unary operator, it must be a primary expr. Taking any stray
+    // char as an operator would recurse once per char of garbage like ")))))" before failing.
+    if ((unsigned)CurTok >= 256 || !UnaryOperators[CurTok])
+        return ParsePrimary();
+
+    // If this is a unary operator, read it.
+    int Opc = CurTok;
+    getNextToken();
+    if (auto Operand = ParseUnary())
+        return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
+    return nullptr;
+}
+
+/// FoldConstants / FastMath -- set by --fold and --fast-math (which implies --fold). With FoldConstants,
+/// ParseBinOpRHS folds builtin operators on constants and drops operations that are an exact identity.
+/// FastMath also allows rewrites that are only right when signed zeros don't matter and rounding may
+/// change: x + 0 and reassociating constants, (x + 1) + 2 => x + 3.
+static bool FoldConstants = false;
+static bool FastMath = false;
+
+/// IsBuiltinBinOp / ApplyBuiltinBinOp -- the operators the language has without any "def binary".
+/// These can't be redefined, and '<' gives 1.0 or 0.0 (0.0 if either side is a NaN).
+static bool IsBuiltinBinOp(char Op) {
+    return Op == '<' || Op == '+' || Op == '-' || Op == '*';
+}
+
+static double ApplyBuiltinBinOp(char Op, double L, double R) {
+    switch (Op) {
+        case '<': return L < R ? 1.0 : 0.0;
+        case '+': return L + R;
+        case '-': return L - R;
+        default:  return L * R;
+    }
+}
+
+static const NumberExprAST *AsNumber(const std::unique_ptr<ExprAST> &E) {
+    return E->getKind() == EK_Number ? static_cast<const NumberExprAST *>(E.get()) : nullptr;
+}
+
+/// FoldBinary -- build LHS Op RHS, folded as far as FoldConstants / FastMath allow.
+static std::unique_ptr<ExprAST> FoldBinary(char Op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS) {
+    if (!FoldConstants || !IsBuiltinBinOp(Op))
+        return std::make_unique<BinaryExprAST>(Op, std::move(LHS), std::move(RHS));
+
+    const NumberExprAST *LNum = AsNumber(LHS), *RNum = AsNumber(RHS);
+    if (LNum && RNum)
+        return std::make_unique<NumberExprAST>(ApplyBuiltinBinOp(Op, LNum->getValue(), RNum->getValue()));
+
+    // Put constants on the right, all exact: x - c is by definition x + -c, and + and * commute.
+    if (Op == '-' && RNum) {
+        Op = '+';
+        RHS = std::make_unique<NumberExprAST>(-RNum->getValue());
+        RNum = AsNumber(RHS);
+    } else if ((Op == '+' || Op == '*') && LNum) {
+        std::swap(LHS, RHS);
+        std::swap(LNum, RNum);
+    }
+
+    if (RNum) {
+        double C = RNum->getValue();
+        if (Op == '*' && C == 1.0)
+            return LHS;
+        // x + -0 is x for every x, x + +0 turns a -0 into +0
+        if (Op == '+' && C == 0.0 && (std::signbit(C) || FastMath))
+            return LHS;
+
+        if (FastMath && (Op == '+' || Op == '*') && LHS->getKind() == EK_Binary) {
+            auto &Inner = static_cast<BinaryExprAST &>(*LHS);
+            if (Inner.getOp() == Op && Inner.getRHS().getKind() == EK_Number) {
+                double C1 = static_cast<const NumberExprAST &>(Inner.getRHS()).getValue();
+                return FoldBinary(Op, Inner.releaseLHS(), std::make_unique<NumberExprAST>(ApplyBuiltinBinOp(Op, C1, C)));
+            }
+        }
+    }
+
+    return std::make_unique<BinaryExprAST>(Op, std::move(LHS), std::move(RHS));
+}
+
 // The precedence value passed into ParseBinOpRHS indicates the minimal operator precedence that the function is allowed to eat.
 // For example, if the current pair stream is [+, x] and ParseBinOpRHS is passed in a precedence of 40,
 // it will not consume any tokens (because the precedence of ‘+’ is only 20).
@@ -307,7 +743,7 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<Expr
         int BinOp = CurTok;
         getNextToken(); // eat binop
 
-        auto RHS = ParsePrimary();
+        auto RHS = ParseUnary();
         if (!RHS)
             return nullptr;
 
@@ -318,15 +754,15 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<Expr
                 return nullptr;
         }
 
-        LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+        LHS = FoldBinary((char)BinOp, std::move(LHS), std::move(RHS));
     }
 }
 
 /// expression
-///   ::= primary binoprhs
+///   ::= unary binoprhs
 ///
 static std::unique_ptr<ExprAST> ParseExpression() {
-    auto LHS = ParsePrimary();
+    auto LHS = ParseUnary();
 
     if (!LHS)
         return nullptr; // parse primary can return nullptr if it does then there is no LHS expr therefore no RHS
@@ -334,16 +770,61 @@ static std::unique_ptr<ExprAST> ParseExpression() {
     return ParseBinOpRHS(0, std::move(LHS));
 }
 
+/// IsOperatorChar -- whether Tok can name a user defined operator: not a letter or digit, and not
+/// punctuation that calls and prototypes need
+static bool IsOperatorChar(int Tok) {
+    return isascii(Tok) && !isalnum(Tok) && Tok != '(' && Tok != ')' && Tok != ',' && Tok != ';';
+}
+
 /// prototype
 ///   ::= id '(' id* ')'
+///   ::= binary LETTER number? (id, id)
+///   ::= unary LETTER (id)
 static std::unique_ptr<PrototypeAST> ParsePrototype() {
     // when this is called extern has just been eaten
 
-    if (CurTok != tok_identifier)
-        return LogErrorP("Expected function name in prototype");
+    std::string FnName;
 
-    std::string FnName = IdentifierStr;
-    getNextToken();
+    unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary.
+    unsigned BinaryPrecedence = 30;
+
+    switch (CurTok) {
+        default:
+            return LogErrorP("Expected function name in prototype");
+        case tok_identifier:
+            FnName = IdentifierStr;
+            Kind = 0;
+            getNextToken();
+            break;
+        case tok_unary:
+            getNextToken();
+            if (!IsOperatorChar(CurTok))
+                return LogErrorP("Expected unary operator");
+            FnName = "unary";
+            FnName += (char)CurTok;
+            Kind = 1;
+            getNextToken();
+            break;
+        case tok_binary:
+            getNextToken();
+            if (!IsOperatorChar(CurTok))
+                return LogErrorP("Expected binary operator");
+            if (IsBuiltinBinOp((char)CurTok))
+                return LogErrorP("Builtin binary operators can't be redefined");
+            FnName = "binary";
+            FnName += (char)CurTok;
+            Kind = 2;
+            getNextToken();
+
+            // Read the precedence if present.
+            if (CurTok == tok_number) {
+                if (NumVal < 1 || NumVal > 100)
+                    return LogErrorP("Invalid precedence: must be 1..100");
+                BinaryPrecedence = (unsigned)NumVal;
+                getNextToken();
+            }
+            break;
+    }
 
     if (CurTok != '(')
         return LogErrorP("Expected '(' in prototype");
@@ -359,9 +840,116 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     // success.
     getNextToken(); // eat ).
 
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
+    // Verify right number of names for operator.
+    if (Kind && ArgNames.size() != Kind)
+        return LogErrorP("Invalid number of operands for operator");
+
+    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), Kind != 0, BinaryPrecedence);
+}
+
+/// LazyBodies -- set by --lazy. ParseDefinition then only finds where a body ends and leaves parsing
+/// it to GetFunctionBody, the first time something needs it, or the end of the run for bodies nothing
+/// needed. Only possible when reading from a token buffer.
+static bool LazyBodies = false;
+
+/*
+ * Finding the end of a body without parsing it: an expression is a run of unary operators, a primary,
+ * then any number of (binop, unary operators, primary). A primary is a number, an identifier, an
+ * identifier followed by a parenthesised group or a parenthesised group, and the groups are skipped by
+ * counting parens. That is enough to stop on the same token ParseExpression would stop on, without
+ * building anything or even copying identifiers out of the token buffer.
+ */
+
+/// SkipParenGroup -- P is at a '(', move it past the matching ')'. Fails on a token that can't be in an expression.
+static bool SkipParenGroup(const LexedToken *&P, const LexedToken *End) {
+    int Depth = 0;
+    do {
+        if (P == End)
+            return false;
+        switch (P->Tok) {
+            case '(': ++Depth; break;
+            case ')': --Depth; break;
+            case ';': case tok_def: case tok_extern:
+                return false;
+        }
+        ++P;
+    } while (Depth > 0);
+    return true;
+}
+
+static bool SkipExpressionTokens(const LexedToken *&P, const LexedToken *End);
+
+static bool SkipUnaryTokens(const LexedToken *&P, const LexedToken *End) {
+    while (P != End && (unsigned)P->Tok < 256 && UnaryOperators[P->Tok])
+        ++P;
+    if (P == End)
+        return false;
+
+    switch (P->Tok) {
+        case tok_number:
+            ++P;
+            return true;
+        case tok_identifier:
+            ++P;
+            if (P != End && P->Tok == '(')
+                return SkipParenGroup(P, End);
+            return true;
+        case '(':
+            return SkipParenGroup(P, End);
+        case tok_if:
+            ++P;
+            if (!SkipExpressionTokens(P, End) || P == End || P->Tok != tok_then)
+                return false;
+            ++P;
+            if (!SkipExpressionTokens(P, End) || P == End || P->Tok != tok_else)
+                return false;
+            ++P;
+            return SkipExpressionTokens(P, End);
+        default:
+            return false;
+    }
+}
+
+static bool SkipExpressionTokens(const LexedToken *&P, const LexedToken *End) {
+    if (!SkipUnaryTokens(P, End))
+        return false;
+    while (P != End && (unsigned)P->Tok < 256 && BinOpPrecedence[P->Tok] > 0) {
+        ++P;
+        if (!SkipUnaryTokens(P, End))
+            return false;
+    }
+    return true;
+}
+
+/// ParseLazyDefinitionBody -- the --lazy half of ParseDefinition. A body is only left unparsed if it is
+/// well-formed as far as the skip can tell and followed by something that ends the item; anything else
+/// ("def f(x) x 4", or a body the skip trips over) is rewound and parsed right away, so that what follows
+/// the body and any error the skip ran into come out exactly as without --lazy.
+static std::unique_ptr<FunctionAST> ParseLazyDefinitionBody(std::unique_ptr<PrototypeAST> Proto, const TokenBuffer &Buf) {
+    const LexedToken *Start = CurRange->Cur - 1; // CurTok, the first token of the body
+    const LexedToken *P = Start;
+    if (SkipExpressionTokens(P, CurRange->End)) {
+        if (P == CurRange->End || P->Tok == ';' || P->Tok == tok_def || P->Tok == tok_extern) {
+            LazyBody Lazy;
+            Lazy.Buf = &Buf;
+            Lazy.Begin = Start - Buf.Tokens.data();
+            Lazy.End = P - Buf.Tokens.data();
+            CurRange->Cur = P;
+            getNextToken();
+            return std::make_unique<FunctionAST>(std::move(Proto), Lazy);
+        }
+    }
+
+    CurRange->Cur = Start;
+    getNextToken();
+    if (auto E = ParseExpression())
+        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    return nullptr;
 }
 
+/// InputTokens -- the buffer lazy bodies point into, it has to outlive every FunctionAST parsed from it
+static TokenBuffer InputTokens;
+
 /// definition ::= 'def' prototype extension
 static std::unique_ptr<FunctionAST> ParseDefinition() {
     getNextToken(); // eat def.
@@ -369,6 +957,9 @@ static std::unique_ptr<FunctionAST> ParseDefinition() {
     auto Proto = ParsePrototype();
     if (!Proto) return nullptr;
 
+    if (LazyBodies && CurRange)
+        return ParseLazyDefinitionBody(std::move(Proto), InputTokens);
+
     if (auto E = ParseExpression())
         return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
 
@@ -392,77 +983,7488 @@ static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
     return nullptr;
 }
 
+/// ParseLazyBody -- parse the pending body of F with the parser state of the calling thread, which is
+/// saved and put back so this can be called from anywhere. Errors are kept on F until GetFunctionBody
+/// reports them.
+static void ParseLazyBody(FunctionAST &F) {
+    const LazyBody &L = F.getLazyBody();
+    TokenRange Range{L.Buf->Tokens.data() + L.Begin, L.Buf->Tokens.data() + L.End, L.Buf->Names.data()};
+
+    TokenRange *SavedRange = CurRange;
+    int SavedTok = CurTok;
+    std::string SavedIdentifierStr = std::move(IdentifierStr);
+    double SavedNumVal = NumVal;
+    std::vector<std::string> SavedDiags = std::move(PendingDiags);
+    PendingDiags.clear();
+
+    CurRange = &Range;
+    getNextToken();
+    auto Body = ParseExpression();
+    // the skip already made sure a successful parse ends exactly at L.End
+    F.resolveLazyBody(std::move(Body), std::move(PendingDiags));
+
+    PendingDiags = std::move(SavedDiags);
+    NumVal = SavedNumVal;
+    IdentifierStr = std::move(SavedIdentifierStr);
+    CurTok = SavedTok;
+    CurRange = SavedRange;
+}
+
+/// GetFunctionBody -- the body of F, parsing it first if it is still pending. Errors in a lazy body are
+/// reported here, by the first caller that needs the body, and null is returned from then on.
+static ExprAST *GetFunctionBody(FunctionAST &F) {
+    if (F.isBodyPending())
+        ParseLazyBody(F);
+    ReportDiagnostics(F.getBodyDiags());
+    return F.getBody();
+}
+
 // -----------------------------------=======
 //            End Parser
 // -----------------------------------=======
 
 // -----------------------------------=======
-//            Top Level Parsing
+//            Bytecode
 // -----------------------------------=======
 
-static void HandleDefinition() {
-    if(ParseDefinition()) {
-        fprintf(stderr, "Parsed a function definition.\n");
-    } else {
-        // Skip token for error recovery.
-        getNextToken();
-    }
+/// Opcode -- the bytecode is for a register machine. A function has NumRegs double registers with its
+/// parameters in the first NumParams of them, instructions are 3-address over registers (A = B op C) and
+/// constants come from the function's constant pool through LOADK.
+enum Opcode : uint8_t {
+    OP_LOADK, // A = Consts[B]
+    OP_MOV,   // A = B
+    OP_ADD,   // A = B + C
+    OP_SUB,   // A = B - C
+    OP_MUL,   // A = B * C
+    OP_LT,    // A = B < C ? 1.0 : 0.0
+    OP_CALL,  // A = Callees[B](C, ..., C + N - 1)
+    OP_RET,   // return A
+    OP_JMP,   // goto Target
+    OP_JMPF,  // if A is not true (see IsTrue) goto Target
+    OP_TCALL, // return Callees[B](C, ..., C + N - 1), A as for CALL (see MarkTailCalls)
+    OP_JNLT,  // if not A < B goto Target: an LT and the JMPF testing it, fused (see PeepholeBytecode)
+};
+
+/// Instr -- 8 bytes. Jumps keep their 32 bit Target in B (low half) and C (high half), except JNLT,
+/// which needs B for an operand and keeps a 24 bit Target in C and N.
+struct Instr {
+    Opcode Op;
+    uint8_t N;
+    uint16_t A, B, C;
+};
+
+/// MaxFusedTarget -- the furthest a JNLT can jump
+static const uint32_t MaxFusedTarget = (1u << 24) - 1;
+
+static bool IsJump(Opcode Op) {
+    return Op == OP_JMP || Op == OP_JMPF || Op == OP_JNLT;
 }
 
-static void HandleExtern() {
-    if (ParseExtern()) {
-        fprintf(stderr, "Parsed an extern.\n");
-    } else {
-        // Skip token for error recovery.
-        getNextToken();
-    }
+static uint32_t JumpTarget(const Instr &I) {
+    if (I.Op == OP_JNLT)
+        return (uint32_t)I.C | ((uint32_t)I.N << 16);
+    return (uint32_t)I.B | ((uint32_t)I.C << 16);
 }
 
-static void HandleTopLevelExpression() {
-    // Evaluate a top-level expression into an anonymous function.
-    if (ParseTopLevelExpr()) {
-        fprintf(stderr, "Parsed a top-level expr\n");
-    } else {
-        // Skip token for error recovery.
-        getNextToken();
+static void SetJumpTarget(Instr &I, uint32_t Target) {
+    if (I.Op == OP_JNLT) {
+        I.C = (uint16_t)Target;
+        I.N = (uint8_t)(Target >> 16);
+        return;
     }
+    I.B = (uint16_t)Target;
+    I.C = (uint16_t)(Target >> 16);
 }
 
-/// top ::= definition | external | expression | ';'
-static void MainLoop() {
-    while (true) {
-        fprintf(stderr, "ready> ");
-        switch(CurTok) {
-            case tok_eof:
-                return;
-            case ';': // ignore top-level semicolons
-                getNextToken();
-                break;
-            case tok_def:
-                HandleDefinition();
-                break;
-            case tok_extern:
-                HandleExtern();
+/// IsTrue -- the truth of an if condition: not 0.0 and not a NaN
+static bool IsTrue(double V) {
+    return V < 0.0 || V > 0.0;
+}
+
+/// BytecodeFunction -- one compiled definition, or a top-level expression compiled as "__anon_expr".
+struct BytecodeFunction {
+    std::string Name;
+    unsigned NumParams = 0;
+    unsigned NumRegs = 0;
+    std::vector<Instr> Code;
+    std::vector<double> Consts;
+    std::vector<std::string> Callees;
+    std::vector<FunctionSlot *> CalleeSlots; // Callees bound to the function table, see BindCallees
+    std::vector<std::string> Inlined;        // functions whose bodies are in this one, see RecompileInliners
+
+    // --engine=tiered: calls so far, and the machine code to run instead once this has been promoted
+    uint64_t Calls = 0;
+    mutable std::atomic<void *> NativeEntry{nullptr};
+};
+
+/// TailCalls -- a call whose value is returned straight away reuses its caller's frame, so tail
+/// recursion runs in constant stack in every engine. --no-tail-calls turns that off.
+static bool TailCalls = true;
+
+/// MarkTailCalls -- turn every CALL whose result only moves through MOVs and JMPs to a RET of it into a
+/// TCALL. Those are the calls in tail position whichever frontend emitted them, an if's branches
+/// included (the branch result MOV and the JMP over the else). The code after a TCALL is left alone,
+/// so an engine can always run it as a plain CALL instead.
+static void MarkTailCalls(BytecodeFunction &F) {
+    std::vector<Instr> &Code = F.Code;
+    for (Instr &Call : Code) {
+        if (Call.Op != OP_CALL)
+            continue;
+        unsigned V = Call.A;
+        size_t PC = &Call - Code.data() + 1;
+        for (unsigned Steps = 0; Steps < 16 && PC < Code.size(); ++Steps) {
+            const Instr &I = Code[PC];
+            if (I.Op == OP_RET) {
+                if (I.A == V)
+                    Call.Op = OP_TCALL;
                 break;
-            default:
-                HandleTopLevelExpression();
+            }
+            if (I.Op == OP_JMP) {
+                PC = JumpTarget(I);
+            } else if (I.Op == OP_MOV && I.B == V) {
+                V = I.A;
+                ++PC;
+            } else {
                 break;
+            }
         }
     }
 }
 
-int main() {
-    BinOpPrecedence['<'] = 10;
-    BinOpPrecedence['+'] = 20;
-    BinOpPrecedence['-'] = 30;
-    BinOpPrecedence['*'] = 40;
+/// ForEachSuccessor -- where control can go after the instruction at PC, F.Code.size() for falling off
+/// the end. A TCALL falls through, as an engine may run it as a CALL.
+template <typename Fn>
+static void ForEachSuccessor(const BytecodeFunction &F, size_t PC, Fn &&Visit) {
+    const Instr &I = F.Code[PC];
+    if (I.Op == OP_RET)
+        return;
+    if (I.Op != OP_JMP)
+        Visit(PC + 1);
+    if (IsJump(I.Op))
+        Visit((size_t)JumpTarget(I));
+}
 
-    // Prime the first token
-    fprintf(stderr, "ready> ");
-    getNextToken();
+/*
+ * Peephole rules on finished bytecode, whichever frontend emitted it. Both emit code an expression node
+ * at a time, which leaves a result computed into a temporary just to be moved to an if's result
+ * register, a constant loaded into a register that still has it, jumps to jumps and to the next
+ * instruction, and every if condition computed into a register by an LT only for a JMPF to test it.
+ *
+ * A rule looks at one instruction and, at most, the one after it. A sweep tries the rules in table
+ * order at every instruction, the first that fires wins, then the instructions rules took out are
+ * deleted and jump targets fixed up; sweeps go on until one changes nothing. Rules that need a
+ * register to be dead go by liveness from the start of the sweep. Bytecode only jumps forward, so that
+ * is one backward pass, and a rewrite only changes liveness at and before its own instructions, which
+ * the sweep has already left behind.
+ */
+
+/// Peephole / PeepholeReport -- --no-peephole turns the rules off, for the bytecode and for the machine
+/// code (see X86Rules) alike; --peephole-stats reports how often each one fired at exit
+static bool Peephole = true;
+static bool PeepholeReport = false;
+
+/// PeepholeMaxLiveBits -- instructions times registers, a bigger function is left as it is
+static const uint64_t PeepholeMaxLiveBits = 1ull << 26;
+
+/// PeepholeSweep -- what a bytecode rule sees: the code, the instructions taken out so far this sweep,
+/// the jump targets and a live set per instruction
+struct PeepholeSweep {
+    BytecodeFunction &F;
+    std::vector<uint8_t> Deleted, Target;
+    unsigned Words;
+    std::vector<uint64_t> LiveIn;
+
+    explicit PeepholeSweep(BytecodeFunction &F)
+        : F(F), Deleted(F.Code.size(), 0), Target(F.Code.size() + 1, 0), Words(F.NumRegs / 64 + 1),
+          LiveIn(F.Code.size() * Words, 0) {
+        for (const Instr &I : F.Code)
+            if (IsJump(I.Op))
+                Target[JumpTarget(I)] = 1;
+        computeLiveness();
+    }
+
+    void computeLiveness() {
+        size_t N = F.Code.size();
+        for (size_t PC = N; PC-- > 0;) {
+            const Instr &I = F.Code[PC];
+            uint64_t *Live = &LiveIn[PC * Words];
+            ForEachSuccessor(F, PC, [&](size_t Succ) {
+                for (unsigned w = 0; Succ < N && w < Words; ++w)
+                    Live[w] |= LiveIn[Succ * Words + w];
+            });
+            auto Set = [&](unsigned R, bool On) {
+                if (On)
+                    Live[R / 64] |= 1ull << (R % 64);
+                else
+                    Live[R / 64] &= ~(1ull << (R % 64));
+            };
+            switch (I.Op) {
+                case OP_CALL:
+                case OP_TCALL:
+                    Set(I.A, false);
+                    for (unsigned k = 0; k < I.N; ++k)
+                        Set(I.C + k, true);
+                    break;
+                case OP_LOADK:
+                    Set(I.A, false);
+                    break;
+                case OP_MOV:
+                    Set(I.A, false);
+                    Set(I.B, true);
+                    break;
+                case OP_ADD:
+                case OP_SUB:
+                case OP_MUL:
+                case OP_LT:
+                    Set(I.A, false);
+                    Set(I.B, true);
+                    Set(I.C, true);
+                    break;
+                case OP_RET:
+                case OP_JMPF:
+                    Set(I.A, true);
+                    break;
+                case OP_JNLT:
+                    Set(I.A, true);
+                    Set(I.B, true);
+                    break;
+                case OP_JMP:
+                    break;
+            }
+        }
+    }
+
+    /// liveAfter -- whether R is live on some edge out of PC
+    bool liveAfter(size_t PC, unsigned R) const {
+        bool Live = false;
+        ForEachSuccessor(F, PC, [&](size_t Succ) {
+            Live |= Succ < F.Code.size() && (LiveIn[Succ * Words + R / 64] >> (R % 64) & 1);
+        });
+        return Live;
+    }
+
+    /// onlyFrom -- whether the instruction after PC is still there and can only be reached from PC
+    bool onlyFrom(size_t PC) const {
+        return PC + 1 < F.Code.size() && !Deleted[PC + 1] && !Target[PC + 1];
+    }
+
+    /// compact -- delete what was taken out, and fix up the jumps over it
+    void compact() {
+        std::vector<uint32_t> NewIndex(F.Code.size() + 1);
+        uint32_t Kept = 0;
+        for (size_t PC = 0; PC < F.Code.size(); ++PC) {
+            NewIndex[PC] = Kept;
+            Kept += !Deleted[PC];
+        }
+        NewIndex[F.Code.size()] = Kept;
+        size_t Out = 0;
+        for (size_t PC = 0; PC < F.Code.size(); ++PC) {
+            if (Deleted[PC])
+                continue;
+            Instr I = F.Code[PC];
+            if (IsJump(I.Op))
+                SetJumpTarget(I, NewIndex[JumpTarget(I)]);
+            F.Code[Out++] = I;
+        }
+        F.Code.resize(Out);
+    }
+};
+
+/// Unreachable -- after a RET or JMP, and no jump goes there
+static bool Unreachable(PeepholeSweep &S, size_t PC) {
+    if (PC == 0 || S.Target[PC] || S.Deleted[PC - 1])
+        return false;
+    Opcode Before = S.F.Code[PC - 1].Op;
+    if (Before != OP_RET && Before != OP_JMP)
+        return false;
+    S.Deleted[PC] = 1;
+    return true;
+}
+
+/// SelfMove -- MOV r, r
+static bool SelfMove(PeepholeSweep &S, size_t PC) {
+    const Instr &I = S.F.Code[PC];
+    if (I.Op != OP_MOV || I.A != I.B)
+        return false;
+    S.Deleted[PC] = 1;
+    return true;
+}
+
+/// DeadResult -- an instruction without side effects whose result is never read
+static bool DeadResult(PeepholeSweep &S, size_t PC) {
+    const Instr &I = S.F.Code[PC];
+    if (I.Op > OP_LT || S.liveAfter(PC, I.A))
+        return false;
+    S.Deleted[PC] = 1;
+    return true;
+}
+
+/// ReloadedConstant -- LOADK r, k while r still has k from an earlier LOADK in the same straight line
+/// of code, looking back a few instructions
+static bool ReloadedConstant(PeepholeSweep &S, size_t PC) {
+    const Instr &I = S.F.Code[PC];
+    if (I.Op != OP_LOADK)
+        return false;
+    for (size_t Back = PC, Seen = 0; Back-- > 0 && Seen < 8;) {
+        if (S.Target[Back + 1])
+            return false;
+        if (S.Deleted[Back])
+            continue;
+        const Instr &P = S.F.Code[Back];
+        ++Seen;
+        if (P.Op == OP_LOADK && P.A == I.A) {
+            if (memcmp(&S.F.Consts[P.B], &S.F.Consts[I.B], sizeof(double)) != 0)
+                return false;
+            S.Deleted[PC] = 1;
+            return true;
+        }
+        // anything but straight line code, or something else put in r
+        if (P.Op > OP_LT || P.A == I.A)
+            return false;
+    }
+    return false;
+}
+
+/// CoalescedMove -- a result computed into t and moved on to r, when nothing else reads t: compute it
+/// into r straight away
+static bool CoalescedMove(PeepholeSweep &S, size_t PC) {
+    Instr &I = S.F.Code[PC];
+    if (!(I.Op <= OP_LT || I.Op == OP_CALL || I.Op == OP_TCALL) || !S.onlyFrom(PC))
+        return false;
+    const Instr &Move = S.F.Code[PC + 1];
+    if (Move.Op != OP_MOV || Move.B != I.A || Move.A == I.A || S.liveAfter(PC + 1, I.A))
+        return false;
+    I.A = Move.A;
+    S.Deleted[PC + 1] = 1;
+    return true;
+}
+
+/// ReturnedMove -- MOV r, s then RET r: return s, and leave the RET to whatever else jumps to it
+static bool ReturnedMove(PeepholeSweep &S, size_t PC) {
+    Instr &I = S.F.Code[PC];
+    if (I.Op != OP_MOV || PC + 1 >= S.F.Code.size() || S.Deleted[PC + 1])
+        return false;
+    const Instr &Ret = S.F.Code[PC + 1];
+    if (Ret.Op != OP_RET || Ret.A != I.A)
+        return false;
+    I = {OP_RET, 0, I.B, 0, 0};
+    return true;
+}
+
+/// FusedCompare -- LT t, a, b then JMPF t, when that's all t is for: JNLT a, b
+static bool FusedCompare(PeepholeSweep &S, size_t PC) {
+    Instr &I = S.F.Code[PC];
+    if (I.Op != OP_LT || !S.onlyFrom(PC))
+        return false;
+    const Instr &Branch = S.F.Code[PC + 1];
+    if (Branch.Op != OP_JMPF || Branch.A != I.A || JumpTarget(Branch) > MaxFusedTarget || S.liveAfter(PC + 1, I.A))
+        return false;
+    uint32_t Target = JumpTarget(Branch);
+    I = {OP_JNLT, 0, I.B, I.C, 0};
+    SetJumpTarget(I, Target);
+    S.Deleted[PC + 1] = 1;
+    return true;
+}
+
+/// ThreadedJump -- a jump to a JMP goes where that one goes
+static bool ThreadedJump(PeepholeSweep &S, size_t PC) {
+    Instr &I = S.F.Code[PC];
+    if (!IsJump(I.Op) || JumpTarget(I) >= S.F.Code.size())
+        return false;
+    const Instr &To = S.F.Code[JumpTarget(I)];
+    if (To.Op != OP_JMP || (I.Op == OP_JNLT && JumpTarget(To) > MaxFusedTarget))
+        return false;
+    SetJumpTarget(I, JumpTarget(To));
+    return true;
+}
+
+/// JumpToReturn -- JMP to a RET returns right away
+static bool JumpToReturn(PeepholeSweep &S, size_t PC) {
+    Instr &I = S.F.Code[PC];
+    if (I.Op != OP_JMP || JumpTarget(I) >= S.F.Code.size() || S.F.Code[JumpTarget(I)].Op != OP_RET)
+        return false;
+    I = S.F.Code[JumpTarget(I)];
+    return true;
+}
+
+/// JumpToNext -- a jump to where it would fall through to anyway, over nothing but deleted instructions
+static bool JumpToNext(PeepholeSweep &S, size_t PC) {
+    const Instr &I = S.F.Code[PC];
+    if (!IsJump(I.Op))
+        return false;
+    size_t Next = PC + 1;
+    while (Next < JumpTarget(I) && S.Deleted[Next])
+        ++Next;
+    if (Next != JumpTarget(I))
+        return false;
+    S.Deleted[PC] = 1;
+    return true;
+}
+
+/// BytecodeRule -- one rule and how often it has fired. A function can be finished on a parser thread
+/// (--single-pass with --parallel), hence the atomic.
+struct BytecodeRule {
+    const char *Name;
+    bool (*Apply)(PeepholeSweep &S, size_t PC);
+    std::atomic<uint64_t> Fired{0};
+};
+
+static BytecodeRule BytecodeRules[] = {
+    {"unreachable", Unreachable},
+    {"self-move", SelfMove},
+    {"dead-result", DeadResult},
+    {"reload-const", ReloadedConstant},
+    {"coalesce-move", CoalescedMove},
+    {"return-move", ReturnedMove},
+    {"fuse-compare", FusedCompare},
+    {"thread-jump", ThreadedJump},
+    {"jump-to-ret", JumpToReturn},
+    {"jump-to-next", JumpToNext},
+};
+
+/// PeepholeBytecode -- run BytecodeRules over F until they change nothing. The round limit is only a
+/// backstop: the rules that don't make the code shorter move jumps further forward or turn them into
+/// RETs, which can't go on for long either.
+static void PeepholeBytecode(BytecodeFunction &F) {
+    if (!Peephole || (uint64_t)F.Code.size() * F.NumRegs > PeepholeMaxLiveBits)
+        return;
+    for (unsigned Round = 0; Round < 8; ++Round) {
+        PeepholeSweep S(F);
+        bool Changed = false;
+        for (size_t PC = 0; PC < F.Code.size(); ++PC) {
+            if (S.Deleted[PC])
+                continue;
+            for (BytecodeRule &Rule : BytecodeRules) {
+                if (Rule.Apply(S, PC)) {
+                    Rule.Fired.fetch_add(1, std::memory_order_relaxed);
+                    Changed = true;
+                    break;
+                }
+            }
+        }
+        if (!Changed)
+            return;
+        S.compact();
+    }
+}
+
+/// MaxRegs / MaxCallArgs -- what fits in an Instr's register and argument count fields
+static const unsigned MaxRegs = 65535;
+static const unsigned MaxCallArgs = 255;
 
-    // Run the main "interpreter loop" now.
-    MainLoop();
+/*
+ * BytecodeEmitter builds one BytecodeFunction from calls made in evaluation order, one per expression
+ * node. Both the AST compiler (CompileFunction) and the single-pass parser (--single-pass) drive it, so
+ * the two produce the same code by construction.
+ *
+ * Registers above the parameters are handed out as a stack: an operation releases the temporaries its
+ * operands were in and takes the lowest free register for its result. Results are Values that don't
+ * have to be in a register yet, so constants only cost a LOADK when something needs them in one, and
+ * with --fold the emitter applies the same rewrites FoldBinary applies to the AST.
+ */
+class BytecodeEmitter {
+public:
+    /// Value -- the result of an expression. RegOpConst (R Op K) only appears with --fast-math, it is
+    /// kept symbolic so that a following constant can be reassociated into K.
+    struct Value {
+        enum ValueKind : uint8_t { Const, Reg, RegOpConst } Kind;
+        char Op;
+        unsigned R;
+        double K;
+    };
+
+    static Value constant(double K) { return {Value::Const, 0, 0, K}; }
+    static Value reg(unsigned R) { return {Value::Reg, 0, R, 0.0}; }
+
+private:
+    std::unique_ptr<BytecodeFunction> F;
+    std::vector<std::string> Params;
+    unsigned Top;
+    std::map<uint64_t, unsigned> ConstIndex; // by bit pattern, 0.0 and -0.0 are different constants
+    std::map<std::string, unsigned> CalleeIndex;
+    bool Failed = false;
+
+    void fail(const char *Str) {
+        if (!Failed)
+            LogError(Str);
+        Failed = true;
+    }
+
+    unsigned alloc() {
+        if (Top >= MaxRegs) {
+            fail("expression needs too many registers");
+            return Top - 1;
+        }
+        unsigned R = Top++;
+        F->NumRegs = std::max(F->NumRegs, Top);
+        return R;
+    }
+
+    void release(unsigned R) {
+        if (R >= F->NumParams && R < Top)
+            Top = R;
+    }
+
+    void emit(Opcode Op, unsigned A, unsigned B = 0, unsigned C = 0, unsigned N = 0) {
+        F->Code.push_back({Op, (uint8_t)N, (uint16_t)A, (uint16_t)B, (uint16_t)C});
+    }
+
+    unsigned constIndex(double K) {
+        uint64_t Bits;
+        memcpy(&Bits, &K, sizeof(Bits));
+        auto It = ConstIndex.find(Bits);
+        if (It != ConstIndex.end())
+            return It->second;
+        if (F->Consts.size() >= 65536)
+            fail("too many constants in one function");
+        F->Consts.push_back(K);
+        return ConstIndex[Bits] = (unsigned)F->Consts.size() - 1;
+    }
+
+    static Opcode opcodeFor(char Op) {
+        switch (Op) {
+            case '<': return OP_LT;
+            case '+': return OP_ADD;
+            case '-': return OP_SUB;
+            default:  return OP_MUL;
+        }
+    }
+
+    unsigned emitOp(char Op, unsigned B, unsigned C) {
+        release(B);
+        release(C);
+        unsigned A = alloc();
+        emit(opcodeFor(Op), A, B, C);
+        return A;
+    }
+
+public:
+    BytecodeEmitter(const std::string &Name, const std::vector<std::string> &Params)
+        : F(std::make_unique<BytecodeFunction>()), Params(Params), Top((unsigned)Params.size()) {
+        F->Name = Name.empty() ? "__anon_expr" : Name;
+        F->NumParams = F->NumRegs = (unsigned)Params.size();
+        if (Params.size() > MaxCallArgs)
+            fail("too many parameters");
+    }
+
+    unsigned top() const { return Top; }
+
+    /// variable -- a parameter, or a failure (reported once) that still gives a Value so parsing can go on
+    Value variable(const std::string &Name) {
+        for (unsigned i = Params.size(); i-- > 0;) // the last of two parameters with one name wins
+            if (Params[i] == Name)
+                return reg(i);
+        fail("Unknown variable name");
+        return constant(0.0);
+    }
+
+    /// materialize -- put V in a register, releasing whatever temporaries V itself used
+    unsigned materialize(const Value &V) {
+        switch (V.Kind) {
+            case Value::Reg:
+                return V.R;
+            case Value::Const: {
+                unsigned A = alloc();
+                emit(OP_LOADK, A, constIndex(V.K));
+                return A;
+            }
+            case Value::RegOpConst: {
+                unsigned KR = alloc();
+                emit(OP_LOADK, KR, constIndex(V.K));
+                return emitOp(V.Op, V.R, KR);
+            }
+        }
+        return 0;
+    }
+
+    /// binary -- L Op R for a builtin Op. The operand evaluated last has its temporaries on top, so R is
+    /// put in a register before L.
+    Value binary(char Op, Value L, Value R) {
+        if (FoldConstants) {
+            if (L.Kind == Value::Const && R.Kind == Value::Const)
+                return constant(ApplyBuiltinBinOp(Op, L.K, R.K));
+
+            if (Op == '-' && R.Kind == Value::Const) {
+                Op = '+';
+                R.K = -R.K;
+            } else if ((Op == '+' || Op == '*') && L.Kind == Value::Const) {
+                std::swap(L, R);
+            }
+
+            if (R.Kind == Value::Const) {
+                if (Op == '*' && R.K == 1.0)
+                    return L;
+                if (Op == '+' && R.K == 0.0 && (std::signbit(R.K) || FastMath))
+                    return L;
+
+                if (FastMath && (Op == '+' || Op == '*')) {
+                    if (L.Kind == Value::RegOpConst && L.Op == Op)
+                        return binary(Op, reg(L.R), constant(ApplyBuiltinBinOp(Op, L.K, R.K)));
+                    return {Value::RegOpConst, Op, materialize(L), R.K};
+                }
+            }
+        }
+
+        unsigned RR = materialize(R);
+        unsigned LR = materialize(L);
+        return reg(emitOp(Op, LR, RR));
+    }
+
+    /// argument -- put V in the next call argument slot and return the slot. A call's arguments are
+    /// passed one after another, each as soon as it is known, so they end up in consecutive registers.
+    unsigned argument(const Value &V) {
+        unsigned R = materialize(V);
+        if (R >= F->NumParams && R + 1 == Top)
+            return R;
+        unsigned A = alloc();
+        emit(OP_MOV, A, R);
+        return A;
+    }
+
+    /// call -- Callee applied to the N arguments starting at register Base (top() if N is 0)
+    Value call(const std::string &Callee, unsigned Base, unsigned N) {
+        if (N > MaxCallArgs)
+            fail("too many arguments in call");
+
+        unsigned Idx;
+        auto It = CalleeIndex.find(Callee);
+        if (It != CalleeIndex.end()) {
+            Idx = It->second;
+        } else {
+            Idx = CalleeIndex[Callee] = (unsigned)F->Callees.size();
+            F->Callees.push_back(Callee);
+        }
+
+        if (N)
+            release(Base);
+        unsigned A = alloc();
+        emit(OP_CALL, A, Idx, Base, N);
+        return reg(A);
+    }
+
+    /// IfState -- an if/then/else being emitted: both branches leave their value in Dst
+    struct IfState {
+        unsigned Dst;
+        size_t Branch; // the JMPF over the then branch, then the JMP over the else branch
+    };
+
+    /// beginIf / elseBranch / endIf -- called after the condition, the then and the else expression
+    IfState beginIf(const Value &Cond) {
+        unsigned CR = materialize(Cond);
+        release(CR);
+        IfState S;
+        S.Dst = alloc();
+        S.Branch = F->Code.size();
+        emit(OP_JMPF, CR);
+        return S;
+    }
+
+    void elseBranch(IfState &S, const Value &Then) {
+        branchResult(S, Then);
+        size_t Jump = F->Code.size();
+        emit(OP_JMP, 0);
+        SetJumpTarget(F->Code[S.Branch], (uint32_t)F->Code.size());
+        S.Branch = Jump;
+    }
+
+    Value endIf(IfState &S, const Value &Else) {
+        branchResult(S, Else);
+        SetJumpTarget(F->Code[S.Branch], (uint32_t)F->Code.size());
+        return reg(S.Dst);
+    }
+
+private:
+    void branchResult(const IfState &S, const Value &V) {
+        if (V.Kind == Value::Const) {
+            emit(OP_LOADK, S.Dst, constIndex(V.K));
+        } else {
+            unsigned R = materialize(V);
+            if (R != S.Dst)
+                emit(OP_MOV, S.Dst, R);
+        }
+        release(S.Dst + 1);
+    }
+
+public:
+    /// finish -- return Result and hand over the function, or null if anything failed to compile
+    std::unique_ptr<BytecodeFunction> finish(const Value &Result) {
+        unsigned R = materialize(Result);
+        emit(OP_RET, R);
+        if (Failed)
+            return nullptr;
+        PeepholeBytecode(*F);
+        if (TailCalls)
+            MarkTailCalls(*F);
+        return std::move(F);
+    }
+};
+
+/// CompileExpr / CompileFunction -- compile an AST into bytecode, see BytecodeEmitter
+static BytecodeEmitter::Value CompileExpr(BytecodeEmitter &E, const ExprAST &Expr) {
+    switch (Expr.getKind()) {
+        case EK_Number:
+            return BytecodeEmitter::constant(static_cast<const NumberExprAST &>(Expr).getValue());
+        case EK_Variable:
+            return E.variable(static_cast<const VariableExprAST &>(Expr).getName());
+        case EK_Unary: {
+            auto &U = static_cast<const UnaryExprAST &>(Expr);
+            unsigned Base = E.argument(CompileExpr(E, U.getOperand()));
+            return E.call(std::string("unary") + U.getOpcode(), Base, 1);
+        }
+        case EK_Binary: {
+            auto &B = static_cast<const BinaryExprAST &>(Expr);
+            if (!IsBuiltinBinOp(B.getOp())) {
+                unsigned Base = E.argument(CompileExpr(E, B.getLHS()));
+                E.argument(CompileExpr(E, B.getRHS()));
+                return E.call(std::string("binary") + B.getOp(), Base, 2);
+            }
+            auto L = CompileExpr(E, B.getLHS());
+            auto R = CompileExpr(E, B.getRHS());
+            return E.binary(B.getOp(), L, R);
+        }
+        case EK_Call: {
+            auto &C = static_cast<const CallExprAST &>(Expr);
+            unsigned Base = E.top();
+            for (size_t i = 0; i < C.getArgs().size(); ++i) {
+                unsigned Slot = E.argument(CompileExpr(E, *C.getArgs()[i]));
+                if (i == 0)
+                    Base = Slot;
+            }
+            return E.call(C.getCallee(), Base, (unsigned)C.getArgs().size());
+        }
+        case EK_If: {
+            auto &I = static_cast<const IfExprAST &>(Expr);
+            auto S = E.beginIf(CompileExpr(E, I.getCond()));
+            E.elseBranch(S, CompileExpr(E, I.getThen()));
+            return E.endIf(S, CompileExpr(E, I.getElse()));
+        }
+    }
+    return BytecodeEmitter::constant(0.0);
+}
+
+static std::unique_ptr<BytecodeFunction> CompileFunction(const PrototypeAST &Proto, const ExprAST &Body) {
+    BytecodeEmitter E(Proto.getName(), Proto.getArgs());
+    return E.finish(CompileExpr(E, Body));
+}
+
+static const char *OpcodeName(Opcode Op) {
+    switch (Op) {
+        case OP_LOADK: return "LOADK";
+        case OP_MOV:   return "MOV";
+        case OP_ADD:   return "ADD";
+        case OP_SUB:   return "SUB";
+        case OP_MUL:   return "MUL";
+        case OP_LT:    return "LT";
+        case OP_CALL:  return "CALL";
+        case OP_RET:   return "RET";
+        case OP_JMP:   return "JMP";
+        case OP_JMPF:  return "JMPF";
+        case OP_TCALL: return "TCALL";
+        case OP_JNLT:  return "JNLT";
+    }
+    return "?";
+}
+
+/// DumpBytecode -- disassembly for --emit-bytecode
+static void DumpBytecode(const BytecodeFunction &F, FILE *Out) {
+    fprintf(Out, "function %s: %u params, %u regs, %zu consts\n", F.Name.c_str(), F.NumParams, F.NumRegs, F.Consts.size());
+    for (size_t i = 0; i < F.Code.size(); ++i) {
+        const Instr &I = F.Code[i];
+        fprintf(Out, "  %4zu  %-6s", i, OpcodeName(I.Op));
+        switch (I.Op) {
+            case OP_LOADK: fprintf(Out, "r%u, k%u  ; %g\n", I.A, I.B, F.Consts[I.B]); break;
+            case OP_MOV:   fprintf(Out, "r%u, r%u\n", I.A, I.B); break;
+            case OP_CALL:
+            case OP_TCALL: fprintf(Out, "r%u, %s(r%u..+%u)\n", I.A, F.Callees[I.B].c_str(), I.C, I.N); break;
+            case OP_RET:   fprintf(Out, "r%u\n", I.A); break;
+            case OP_JMP:   fprintf(Out, "%u\n", JumpTarget(I)); break;
+            case OP_JMPF:  fprintf(Out, "r%u, %u\n", I.A, JumpTarget(I)); break;
+            case OP_JNLT:  fprintf(Out, "r%u, r%u, %u\n", I.A, I.B, JumpTarget(I)); break;
+            default:       fprintf(Out, "r%u, r%u, r%u\n", I.A, I.B, I.C); break;
+        }
+    }
+}
+
+// -----------------------------------=======
+//            End Bytecode
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            Single-pass Bytecode Parser
+// -----------------------------------=======
+
+/*
+ * --single-pass: the same grammar as the Parser section, but every production hands its result straight
+ * to a BytecodeEmitter instead of building an ExprAST, in the same order CompileExpr would walk the tree.
+ * Errors are the parser's own. A semantic error (unknown variable) doesn't stop the parse, like with
+ * the AST where it only comes up once the tree is compiled.
+ */
+
+using BCValue = BytecodeEmitter::Value;
+
+static bool EmitExpression(BytecodeEmitter &E, BCValue &Out);
+static bool EmitUnary(BytecodeEmitter &E, BCValue &Out);
+
+/// identifierexpr, see ParseIdentifierExpr
+static bool EmitIdentifierExpr(BytecodeEmitter &E, BCValue &Out) {
+    std::string IdName = IdentifierStr;
+
+    getNextToken(); // eat identifier
+
+    if (CurTok != '(') {
+        Out = E.variable(IdName);
+        return true;
+    }
+
+    getNextToken();
+    unsigned Base = E.top();
+    unsigned NumArgs = 0;
+    if (CurTok != ')') {
+        while (true) {
+            BCValue Arg;
+            if (!EmitExpression(E, Arg))
+                return false;
+            unsigned Slot = E.argument(Arg);
+            if (NumArgs++ == 0)
+                Base = Slot;
+
+            if (CurTok == ')')
+                break;
+
+            if (CurTok != ',') {
+                LogError("Expected ')' or ',' in argument list");
+                return false;
+            }
+
+            getNextToken();
+        }
+    }
+
+    getNextToken(); // eat ).
+
+    Out = E.call(IdName, Base, NumArgs);
+    return true;
+}
+
+/// ifexpr, see ParseIfExpr
+static bool EmitIfExpr(BytecodeEmitter &E, BCValue &Out) {
+    getNextToken(); // eat the if.
+
+    BCValue Cond;
+    if (!EmitExpression(E, Cond))
+        return false;
+    auto S = E.beginIf(Cond);
+
+    if (CurTok != tok_then) {
+        LogError("expected then");
+        return false;
+    }
+    getNextToken(); // eat the then
+
+    BCValue Then;
+    if (!EmitExpression(E, Then))
+        return false;
+    E.elseBranch(S, Then);
+
+    if (CurTok != tok_else) {
+        LogError("expected else");
+        return false;
+    }
+    getNextToken(); // eat the else
+
+    BCValue Else;
+    if (!EmitExpression(E, Else))
+        return false;
+    Out = E.endIf(S, Else);
+    return true;
+}
+
+/// primary, see ParsePrimary
+static bool EmitPrimary(BytecodeEmitter &E, BCValue &Out) {
+    switch (CurTok) {
+        default:
+            LogError("unknown token when expecting an expression");
+            return false;
+        case tok_identifier:
+            return EmitIdentifierExpr(E, Out);
+        case tok_if:
+            return EmitIfExpr(E, Out);
+        case tok_number:
+            Out = BytecodeEmitter::constant(NumVal);
+            getNextToken(); // consume the number
+            return true;
+        case '(':
+            getNextToken(); // eat (.
+            if (!EmitExpression(E, Out))
+                return false;
+            if (CurTok != ')') {
+                LogError("expected ')'");
+                return false;
+            }
+            getNextToken(); // eat ).
+            return true;
+    }
+}
+
+/// unary, see ParseUnary
+static bool EmitUnary(BytecodeEmitter &E, BCValue &Out) {
+    if ((unsigned)CurTok >= 256 || !UnaryOperators[CurTok])
+        return EmitPrimary(E, Out);
+
+    int Opc = CurTok;
+    getNextToken();
+    BCValue Operand;
+    if (!EmitUnary(E, Operand))
+        return false;
+    unsigned Base = E.argument(Operand);
+    Out = E.call(std::string("unary") + (char)Opc, Base, 1);
+    return true;
+}
+
+/// binoprhs, see ParseBinOpRHS. The left operand of a user defined operator is passed as an argument
+/// before its right operand is parsed, which is the order CompileExpr passes them in.
+static bool EmitBinOpRHS(BytecodeEmitter &E, int ExprPrec, BCValue &LHS) {
+    while (true) {
+        int TokPrec = GetTokPrecedence();
+        if (TokPrec < ExprPrec)
+            return true;
+
+        char BinOp = (char)CurTok;
+        getNextToken(); // eat binop
+
+        bool Builtin = IsBuiltinBinOp(BinOp);
+        unsigned Base = Builtin ? 0 : E.argument(LHS);
+
+        BCValue RHS;
+        if (!EmitUnary(E, RHS))
+            return false;
+
+        int NextPrec = GetTokPrecedence();
+        if (TokPrec < NextPrec) {
+            if (!EmitBinOpRHS(E, TokPrec + 1, RHS))
+                return false;
+        }
+
+        if (Builtin) {
+            LHS = E.binary(BinOp, LHS, RHS);
+        } else {
+            E.argument(RHS);
+            LHS = E.call(std::string("binary") + BinOp, Base, 2);
+        }
+    }
+}
+
+/// expression, see ParseExpression
+static bool EmitExpression(BytecodeEmitter &E, BCValue &Out) {
+    if (!EmitUnary(E, Out))
+        return false;
+    return EmitBinOpRHS(E, 0, Out);
+}
+
+/// EmitFunctionBody -- the body of Proto straight into bytecode. Returns false on a syntax error; a
+/// compile error gives true with a null BC.
+static bool EmitFunctionBody(const PrototypeAST &Proto, std::unique_ptr<BytecodeFunction> &BC) {
+    BytecodeEmitter E(Proto.getName(), Proto.getArgs());
+    BCValue Result;
+    if (!EmitExpression(E, Result))
+        return false;
+    BC = E.finish(Result);
+    return true;
+}
+
+/// definition ::= 'def' prototype expression, see ParseDefinition
+static std::unique_ptr<PrototypeAST> EmitDefinition(std::unique_ptr<BytecodeFunction> &BC) {
+    getNextToken(); // eat def.
+
+    auto Proto = ParsePrototype();
+    if (!Proto || !EmitFunctionBody(*Proto, BC))
+        return nullptr;
+    return Proto;
+}
+
+/// toplevelexpr ::= expression, see ParseTopLevelExpr
+static bool EmitTopLevelExpr(std::unique_ptr<BytecodeFunction> &BC) {
+    PrototypeAST Proto("", std::vector<std::string>());
+    return EmitFunctionBody(Proto, BC);
+}
+
+// -----------------------------------=======
+//            End Single-pass Bytecode Parser
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            SSA IR
+// -----------------------------------=======
+
+/*
+ * With --opt a definition goes from the AST through a small SSA IR on its way to bytecode, instead of
+ * straight through the BytecodeEmitter. Every value is defined once, by one instruction in one basic
+ * block, and an if's value is a phi in the block its branches meet in. Blocks end in a Ret, a Jmp or a
+ * Br, and the language has no loops, so the control flow graph is always acyclic.
+ *
+ * Values are typed: F64 is every number the language has, Bool is a comparison before it's turned
+ * back into 1.0 / 0.0 and a branch condition. Keeping the two apart is what lets an if on a "<" branch
+ * on the comparison itself.
+ *
+ * The passes (constfold, copyprop, cse, dce) are run by OptimizeIR until none of them changes anything,
+ * --time-passes reports what each cost. LowerIR then allocates registers and produces a
+ * BytecodeFunction, so the VM, the JIT and tiered execution all run the optimized code.
+ */
+
+/// Optimize / EmitIR / TimePasses -- --opt compiles through the IR, --emit-ir prints the optimized IR of
+/// every item and --time-passes prints how long each pass took in total at exit.
+static bool Optimize = false;
+static bool EmitIR = false;
+static bool TimePasses = false;
+
+enum IRType : uint8_t { IRT_F64, IRT_Bool };
+
+enum IROpcode : uint8_t {
+    IR_Const,  // K
+    IR_Param,  // parameter Index
+    IR_Add,    // Ops[0] + Ops[1]
+    IR_Sub,    // Ops[0] - Ops[1]
+    IR_Mul,    // Ops[0] * Ops[1]
+    IR_Lt,     // Ops[0] < Ops[1], a Bool
+    IR_ToF64,  // the Bool Ops[0] as 1.0 or 0.0
+    IR_IsTrue, // Ops[0] as a branch condition, see IsTrue
+    IR_Call,   // Callees[Index](Ops...)
+    IR_Phi,    // Ops[i] when control came from the block's Preds[i]
+    IR_Copy,   // Ops[0]; what the passes leave behind when they replace a value, copyprop removes them
+};
+
+struct IRValue {
+    IROpcode Op;
+    IRType Type = IRT_F64;
+    bool Dead = false; // removed from its block by dce
+    unsigned Index = 0;
+    double K = 0.0;
+    unsigned Block = 0;
+    std::vector<unsigned> Ops;
+};
+
+enum IRTerminator : uint8_t { IR_Ret, IR_Jmp, IR_Br };
+
+/// IRBlock -- Values in order, phis first. Ret returns Arg, Jmp goes to Succ[0] and Br goes to Succ[0]
+/// if the Bool Arg is true and to Succ[1] if it isn't.
+struct IRBlock {
+    std::vector<unsigned> Values;
+    std::vector<unsigned> Preds;
+    IRTerminator Term = IR_Ret;
+    unsigned Arg = 0;
+    unsigned Succ[2] = {0, 0};
+    bool Dead = false; // unreachable, removed by dce
+};
+
+/// IRFunction -- block 0 is the entry, values 0 .. NumParams - 1 are the parameters
+struct IRFunction {
+    std::string Name;
+    unsigned NumParams = 0;
+    std::vector<IRValue> Values;
+    std::vector<IRBlock> Blocks;
+    std::vector<std::string> Callees;
+};
+
+/// InlineSite -- a call the IRBuilder could inline, for ShouldInline (see Inliner) to decide on
+struct InlineSite {
+    const std::string &Caller; // the function being compiled
+    const std::string &Callee;
+    unsigned NumArgs, ConstArgs;
+    unsigned Depth; // how many inlined bodies the call is in
+    bool Recursive; // Callee is being built already, as Caller or further out
+    unsigned &Growth; // the size inlined into Caller so far, ShouldInline adds to it
+};
+
+static const FunctionAST *ShouldInline(const InlineSite &Site);
+
+/// ConstSignature -- the parameters a specialized clone has bound to constants (see Specialization)
+struct ConstSignature {
+    std::string Clone; // the clone's name
+    std::vector<uint8_t> Bound;
+    std::vector<double> K;
+};
+
+/// IRBuilder -- lowers a FunctionAST's body to an IRFunction. The errors are the ones the
+/// BytecodeEmitter reports, so --opt doesn't change what a broken definition says.
+///
+/// A call the inliner accepts (see ShouldInline) becomes the callee's body instead, built with the
+/// callee's parameter names bound to the argument values. Inlining is the same whether the body came
+/// from a definition or another inlined body, Stack holds what's being built to stop at recursion.
+class IRBuilder {
+    IRFunction &F;
+    const std::vector<std::string> *Names; // the variables in scope and their values
+    std::vector<unsigned> Bindings;
+    std::vector<std::string> Stack; // the function being compiled, then the bodies inlined into it
+    unsigned Growth = 0;            // inlined size so far, see InlineSite
+    unsigned Cur = 0;               // the block being filled
+    unsigned NumEntryConsts = 0;
+    std::map<uint64_t, unsigned> Consts; // by bit pattern, like the emitter's constant pool
+    std::map<std::string, unsigned> CalleeIndex;
+    bool Failed = false;
+
+    void fail(const char *Str) {
+        if (!Failed)
+            LogError(Str);
+        Failed = true;
+    }
+
+    unsigned add(IROpcode Op, IRType Type, std::vector<unsigned> Ops, unsigned Index = 0) {
+        IRValue V;
+        V.Op = Op;
+        V.Type = Type;
+        V.Index = Index;
+        V.Block = Cur;
+        V.Ops = std::move(Ops);
+        F.Values.push_back(std::move(V));
+        F.Blocks[Cur].Values.push_back((unsigned)F.Values.size() - 1);
+        return (unsigned)F.Values.size() - 1;
+    }
+
+    unsigned newBlock() {
+        F.Blocks.emplace_back();
+        return (unsigned)F.Blocks.size() - 1;
+    }
+
+    void jump(unsigned To) {
+        F.Blocks[Cur].Term = IR_Jmp;
+        F.Blocks[Cur].Succ[0] = To;
+        F.Blocks[To].Preds.push_back(Cur);
+    }
+
+    /// constant -- one value per constant, at the top of the entry block so that it dominates every use
+    unsigned constant(double K) {
+        uint64_t Bits;
+        memcpy(&Bits, &K, sizeof(Bits));
+        auto It = Consts.find(Bits);
+        if (It != Consts.end())
+            return It->second;
+        IRValue V;
+        V.Op = IR_Const;
+        V.K = K;
+        F.Values.push_back(std::move(V));
+        unsigned Id = (unsigned)F.Values.size() - 1;
+        auto &Entry = F.Blocks[0].Values;
+        Entry.insert(Entry.begin() + F.NumParams + NumEntryConsts++, Id);
+        return Consts[Bits] = Id;
+    }
+
+    /// call -- Callee applied to Args, or Callee's body if the inliner says so
+    unsigned call(const std::string &Callee, std::vector<unsigned> Args) {
+        if (Args.size() > MaxCallArgs)
+            fail("too many arguments in call");
+
+        if (!Failed)
+            if (unsigned Result = inlineCall(Callee, Args))
+                return Result - 1;
+        return add(IR_Call, IRT_F64, std::move(Args), calleeIndex(Callee));
+    }
+
+    unsigned calleeIndex(const std::string &Callee) {
+        auto It = CalleeIndex.find(Callee);
+        if (It != CalleeIndex.end())
+            return It->second;
+        F.Callees.push_back(Callee);
+        return CalleeIndex[Callee] = (unsigned)F.Callees.size() - 1;
+    }
+
+    unsigned expr(const ExprAST &E) {
+        switch (E.getKind()) {
+            case EK_Number:
+                return constant(static_cast<const NumberExprAST &>(E).getValue());
+            case EK_Variable: {
+                auto &Name = static_cast<const VariableExprAST &>(E).getName();
+                for (unsigned i = Names->size(); i-- > 0;) // the last of two parameters with one name wins
+                    if ((*Names)[i] == Name)
+                        return Bindings[i];
+                fail("Unknown variable name");
+                return constant(0.0);
+            }
+            case EK_Unary: {
+                auto &U = static_cast<const UnaryExprAST &>(E);
+                return call(std::string("unary") + U.getOpcode(), {expr(U.getOperand())});
+            }
+            case EK_Binary: {
+                auto &B = static_cast<const BinaryExprAST &>(E);
+                unsigned L = expr(B.getLHS());
+                unsigned R = expr(B.getRHS());
+                switch (B.getOp()) {
+                    case '+': return add(IR_Add, IRT_F64, {L, R});
+                    case '-': return add(IR_Sub, IRT_F64, {L, R});
+                    case '*': return add(IR_Mul, IRT_F64, {L, R});
+                    case '<': return add(IR_ToF64, IRT_F64, {add(IR_Lt, IRT_Bool, {L, R})});
+                    default:  return call(std::string("binary") + B.getOp(), {L, R});
+                }
+            }
+            case EK_Call: {
+                auto &C = static_cast<const CallExprAST &>(E);
+                std::vector<unsigned> Args;
+                for (auto &Arg : C.getArgs())
+                    Args.push_back(expr(*Arg));
+                return call(C.getCallee(), std::move(Args));
+            }
+            case EK_If: {
+                auto &I = static_cast<const IfExprAST &>(E);
+                unsigned Cond = add(IR_IsTrue, IRT_Bool, {expr(I.getCond())});
+                unsigned Then = newBlock(), Else = newBlock(), Merge = newBlock();
+                IRBlock &Head = F.Blocks[Cur];
+                Head.Term = IR_Br;
+                Head.Arg = Cond;
+                Head.Succ[0] = Then;
+                Head.Succ[1] = Else;
+                F.Blocks[Then].Preds.push_back(Cur);
+                F.Blocks[Else].Preds.push_back(Cur);
+
+                Cur = Then;
+                unsigned ThenV = expr(I.getThen());
+                jump(Merge);
+                Cur = Else;
+                unsigned ElseV = expr(I.getElse());
+                jump(Merge);
+                Cur = Merge;
+                return add(IR_Phi, IRT_F64, {ThenV, ElseV});
+            }
+        }
+        return constant(0.0);
+    }
+
+    /// inlineCall -- 1 + the value of Callee's body on Args if it was inlined, 0 if it wasn't
+    unsigned inlineCall(const std::string &Callee, const std::vector<unsigned> &Args) {
+        unsigned ConstArgs = 0;
+        for (unsigned A : Args)
+            ConstArgs += F.Values[A].Op == IR_Const;
+        bool Recursive = std::find(Stack.begin(), Stack.end(), Callee) != Stack.end();
+        const FunctionAST *Def =
+            ShouldInline({Stack[0], Callee, (unsigned)Args.size(), ConstArgs, (unsigned)Stack.size() - 1, Recursive, Growth});
+        if (!Def)
+            return 0;
+
+        const std::vector<std::string> *OuterNames = Names;
+        std::vector<unsigned> OuterBindings = std::move(Bindings);
+        Names = &Def->getProto().getArgs();
+        Bindings = Args;
+        Stack.push_back(Callee);
+        unsigned Result = expr(*Def->getBody());
+        Stack.pop_back();
+        Names = OuterNames;
+        Bindings = std::move(OuterBindings);
+        if (std::find(Inlined.begin(), Inlined.end(), Callee) == Inlined.end())
+            Inlined.push_back(Callee);
+        return Result + 1;
+    }
+
+public:
+    std::vector<std::string> Inlined; // every function whose body went in, for RecompileInliners
+
+    /// With Sig this builds Sig's clone of Proto's function: the parameters Sig binds are constants and
+    /// the clone's parameters are the others, in order.
+    IRBuilder(IRFunction &F, const PrototypeAST &Proto, const ConstSignature *Sig = nullptr)
+        : F(F), Names(&Proto.getArgs()) {
+        F.Name = Proto.getName().empty() ? "__anon_expr" : Proto.getName();
+        Stack.push_back(F.Name);
+        if (Sig)
+            F.Name = Sig->Clone;
+        if (Names->size() > MaxCallArgs)
+            fail("too many parameters");
+        newBlock();
+        Bindings.resize(Names->size());
+        for (unsigned i = 0; i < Names->size(); ++i)
+            if (!Sig || !Sig->Bound[i])
+                Bindings[i] = add(IR_Param, IRT_F64, {}, F.NumParams++);
+        for (unsigned i = 0; Sig && i < Names->size(); ++i)
+            if (Sig->Bound[i])
+                Bindings[i] = constant(Sig->K[i]);
+    }
+
+    /// build -- false if the body failed to compile, the error is in PendingDiags
+    bool build(const ExprAST &Body) {
+        unsigned Result = expr(Body);
+        F.Blocks[Cur].Term = IR_Ret;
+        F.Blocks[Cur].Arg = Result;
+        return !Failed;
+    }
+
+    /// forward -- for a clone whose function can't be specialized like that any more: the body is a
+    /// plain call to it with the constants back in their places
+    void forward(const std::string &Callee) {
+        F.Blocks[Cur].Term = IR_Ret;
+        F.Blocks[Cur].Arg = add(IR_Call, IRT_F64, Bindings, calleeIndex(Callee));
+    }
+};
+
+/// ResolveIR -- the value V stands for once its copies are looked through
+static unsigned ResolveIR(const IRFunction &F, unsigned V) {
+    while (F.Values[V].Op == IR_Copy)
+        V = F.Values[V].Ops[0];
+    return V;
+}
+
+static bool IsConstIR(const IRFunction &F, unsigned V, double &K) {
+    const IRValue &Val = F.Values[ResolveIR(F, V)];
+    K = Val.K;
+    return Val.Op == IR_Const;
+}
+
+static void ReplaceWithCopy(IRValue &V, unsigned Src, IRType Type) {
+    V.Op = IR_Copy;
+    V.Type = Type;
+    V.Ops.assign(1, Src);
+}
+
+static void ReplaceWithConst(IRValue &V, double K) {
+    V.Op = IR_Const;
+    V.K = K;
+    V.Ops.clear();
+}
+
+/// RemovePred -- drop the edge Pred -> Block, with the operand each phi in Block had for it
+static void RemovePred(IRFunction &F, unsigned Block, unsigned Pred) {
+    IRBlock &B = F.Blocks[Block];
+    auto It = std::find(B.Preds.begin(), B.Preds.end(), Pred);
+    if (It == B.Preds.end())
+        return;
+    size_t i = It - B.Preds.begin();
+    B.Preds.erase(It);
+    for (unsigned V : B.Values)
+        if (F.Values[V].Op == IR_Phi)
+            F.Values[V].Ops.erase(F.Values[V].Ops.begin() + i);
+}
+
+/// FoldIR -- constfold: operations on constants, the identities that hold for every double (x * 1,
+/// x + -0.0, x - 0.0; x + 0.0 only with --fast-math) and branches on a constant, which lose the edge
+/// they can't take.
+static bool FoldIR(IRFunction &F) {
+    bool Changed = false;
+    for (unsigned b = 0; b < F.Blocks.size(); ++b) {
+        IRBlock &B = F.Blocks[b];
+        if (B.Dead)
+            continue;
+        double L, R;
+        for (unsigned Id : B.Values) {
+            IRValue &V = F.Values[Id];
+            switch (V.Op) {
+                case IR_Add:
+                case IR_Sub:
+                case IR_Mul:
+                case IR_Lt: {
+                    bool LK = IsConstIR(F, V.Ops[0], L), RK = IsConstIR(F, V.Ops[1], R);
+                    static const char OpChar[] = {0, 0, '+', '-', '*', '<'};
+                    if (LK && RK) {
+                        ReplaceWithConst(V, ApplyBuiltinBinOp(OpChar[V.Op], L, R));
+                    } else if (V.Op == IR_Mul && RK && R == 1.0) {
+                        ReplaceWithCopy(V, V.Ops[0], IRT_F64);
+                    } else if (V.Op == IR_Mul && LK && L == 1.0) {
+                        ReplaceWithCopy(V, V.Ops[1], IRT_F64);
+                    } else if (V.Op == IR_Add && RK && R == 0.0 && (std::signbit(R) || FastMath)) {
+                        ReplaceWithCopy(V, V.Ops[0], IRT_F64);
+                    } else if (V.Op == IR_Add && LK && L == 0.0 && (std::signbit(L) || FastMath)) {
+                        ReplaceWithCopy(V, V.Ops[1], IRT_F64);
+                    } else if (V.Op == IR_Sub && RK && R == 0.0 && (!std::signbit(R) || FastMath)) {
+                        ReplaceWithCopy(V, V.Ops[0], IRT_F64);
+                    } else {
+                        continue;
+                    }
+                    break;
+                }
+                case IR_ToF64:
+                    if (!IsConstIR(F, V.Ops[0], L))
+                        continue;
+                    ReplaceWithConst(V, L);
+                    break;
+                case IR_IsTrue: {
+                    unsigned Src = ResolveIR(F, V.Ops[0]);
+                    if (IsConstIR(F, Src, L))
+                        ReplaceWithConst(V, IsTrue(L) ? 1.0 : 0.0);
+                    else if (F.Values[Src].Op == IR_ToF64)
+                        ReplaceWithCopy(V, F.Values[Src].Ops[0], IRT_Bool);
+                    else
+                        continue;
+                    break;
+                }
+                default:
+                    continue;
+            }
+            Changed = true;
+        }
+
+        if (B.Term == IR_Br && IsConstIR(F, B.Arg, L)) {
+            unsigned Taken = B.Succ[IsTrue(L) ? 0 : 1], NotTaken = B.Succ[IsTrue(L) ? 1 : 0];
+            B.Term = IR_Jmp;
+            B.Succ[0] = Taken;
+            if (NotTaken != Taken)
+                RemovePred(F, NotTaken, b);
+            Changed = true;
+        }
+    }
+    return Changed;
+}
+
+/// PropagateCopies -- copyprop: every use of a copy becomes a use of what it copies, and a phi that
+/// only ever gets one value becomes a copy of it
+static bool PropagateCopies(IRFunction &F) {
+    bool Changed = false;
+    for (IRBlock &B : F.Blocks) {
+        if (B.Dead)
+            continue;
+        for (unsigned Id : B.Values) {
+            IRValue &V = F.Values[Id];
+            for (unsigned &Op : V.Ops) {
+                unsigned R = ResolveIR(F, Op);
+                Changed |= R != Op;
+                Op = R;
+            }
+            if (V.Op == IR_Phi && !V.Ops.empty() &&
+                std::all_of(V.Ops.begin(), V.Ops.end(), [&](unsigned Op) { return Op == V.Ops[0]; })) {
+                ReplaceWithCopy(V, V.Ops[0], F.Values[V.Ops[0]].Type);
+                Changed = true;
+            }
+        }
+        if (B.Term != IR_Jmp) {
+            unsigned R = ResolveIR(F, B.Arg);
+            Changed |= R != B.Arg;
+            B.Arg = R;
+        }
+    }
+    return Changed;
+}
+
+/// ReversePostOrderIR -- the live blocks, each after all of its predecessors. Succ[1] is visited
+/// first, so an if comes out as its condition, the then branch, the else branch and where they meet.
+static std::vector<unsigned> ReversePostOrderIR(const IRFunction &F) {
+    std::vector<unsigned> Order;
+    std::vector<uint8_t> Seen(F.Blocks.size(), 0);
+    std::vector<std::pair<unsigned, unsigned>> Stack{{0, 0}}; // block, successors visited
+    Seen[0] = 1;
+    while (!Stack.empty()) {
+        auto &Top = Stack.back();
+        const IRBlock &B = F.Blocks[Top.first];
+        unsigned NumSucc = B.Term == IR_Br ? 2 : B.Term == IR_Jmp ? 1 : 0;
+        if (Top.second < NumSucc) {
+            unsigned S = B.Succ[NumSucc - 1 - Top.second++];
+            if (!Seen[S]) {
+                Seen[S] = 1;
+                Stack.push_back({S, 0});
+            }
+            continue;
+        }
+        Order.push_back(Top.first);
+        Stack.pop_back();
+    }
+    std::reverse(Order.begin(), Order.end());
+    return Order;
+}
+
+/// IRValueKey -- what makes two pure values the same: the operation, its constant and its operands
+struct IRValueKey {
+    uint64_t Bits;
+    unsigned A, B;
+    uint8_t Op, Type;
+
+    bool operator==(const IRValueKey &O) const {
+        return Bits == O.Bits && A == O.A && B == O.B && Op == O.Op && Type == O.Type;
+    }
+};
+
+struct IRValueKeyHash {
+    size_t operator()(const IRValueKey &K) const {
+        uint64_t H = K.Bits * 0x9E3779B97F4A7C15ull;
+        H ^= ((uint64_t)K.A << 32 | K.B) + 0x7F4A7C159E3779B9ull + (H << 6) + (H >> 2);
+        return (size_t)(H ^ (H >> 29) ^ ((uint64_t)K.Op << 8 | K.Type));
+    }
+};
+
+/// EliminateCommonSubexprs -- cse: a pure value computed again where an identical one dominates it
+/// becomes a copy of that one. Dominators come from the Cooper-Harvey-Kennedy iteration, which on an
+/// acyclic graph is done after one round, and the walk down the dominator tree keeps a scoped table
+/// of the values available at each block. Calls are never merged, an extern may have side effects.
+static bool EliminateCommonSubexprs(IRFunction &F) {
+    std::vector<unsigned> Order = ReversePostOrderIR(F);
+    std::vector<unsigned> RPONum(F.Blocks.size(), UINT32_MAX);
+    for (unsigned i = 0; i < Order.size(); ++i)
+        RPONum[Order[i]] = i;
+
+    std::vector<unsigned> IDom(F.Blocks.size(), UINT32_MAX);
+    IDom[0] = 0;
+    for (unsigned i = 1; i < Order.size(); ++i) {
+        unsigned New = UINT32_MAX;
+        for (unsigned P : F.Blocks[Order[i]].Preds) {
+            if (IDom[P] == UINT32_MAX)
+                continue;
+            if (New == UINT32_MAX) {
+                New = P;
+                continue;
+            }
+            unsigned A = P, B = New;
+            while (A != B) {
+                while (RPONum[A] > RPONum[B])
+                    A = IDom[A];
+                while (RPONum[B] > RPONum[A])
+                    B = IDom[B];
+            }
+            New = A;
+        }
+        IDom[Order[i]] = New;
+    }
+
+    // the dominator tree as first child / next sibling lists
+    std::vector<unsigned> Child(F.Blocks.size(), UINT32_MAX), Sibling(F.Blocks.size(), UINT32_MAX);
+    for (unsigned i = Order.size(); i-- > 1;) {
+        Sibling[Order[i]] = Child[IDom[Order[i]]];
+        Child[IDom[Order[i]]] = Order[i];
+    }
+
+    // open addressing with linear probing; entries leave in the reverse order they came in, so
+    // emptying a slot never cuts another entry's probe sequence short
+    size_t Mask = 15;
+    while (Mask < 2 * F.Values.size())
+        Mask = Mask * 2 + 1;
+    std::vector<std::pair<IRValueKey, unsigned>> Available(Mask + 1, {IRValueKey(), UINT32_MAX});
+    std::vector<size_t> Scope; // the slots in use, in the order they were filled
+    bool Changed = false;
+
+    // the dominator tree, depth first: a block's values are available to all of its children and go
+    // out of scope once the last of them is done
+    struct Visit {
+        unsigned Block, Next; // Next: the child to visit next, if any
+        size_t Mark;          // Scope's size before this block's values
+        bool Entered;
+    };
+    std::vector<Visit> Stack{{0, 0, 0, false}};
+    while (!Stack.empty()) {
+        Visit &Top = Stack.back();
+        if (!Top.Entered) {
+            Top.Entered = true;
+            Top.Mark = Scope.size();
+            Top.Next = Child[Top.Block];
+            for (unsigned Id : F.Blocks[Top.Block].Values) {
+                IRValue &V = F.Values[Id];
+                if (V.Op == IR_Param || V.Op == IR_Call || V.Op == IR_Copy || V.Ops.size() > 2)
+                    continue;
+                IRValueKey Key{0, 0, 0, V.Op, V.Type};
+                if (V.Op == IR_Const)
+                    memcpy(&Key.Bits, &V.K, sizeof(Key.Bits));
+                else if (V.Op == IR_Phi)
+                    Key.Bits = Top.Block; // phis only match in their own block
+                Key.A = V.Ops.size() > 0 ? ResolveIR(F, V.Ops[0]) : 0;
+                Key.B = V.Ops.size() > 1 ? ResolveIR(F, V.Ops[1]) : 0;
+                if ((V.Op == IR_Add || V.Op == IR_Mul) && Key.A > Key.B)
+                    std::swap(Key.A, Key.B);
+                size_t Slot = IRValueKeyHash()(Key) & Mask;
+                while (Available[Slot].second != UINT32_MAX && !(Available[Slot].first == Key))
+                    Slot = (Slot + 1) & Mask;
+                if (Available[Slot].second == UINT32_MAX) {
+                    Available[Slot] = {Key, Id};
+                    Scope.push_back(Slot);
+                } else {
+                    ReplaceWithCopy(V, Available[Slot].second, V.Type);
+                    Changed = true;
+                }
+            }
+        }
+        if (Top.Next != UINT32_MAX) {
+            unsigned Next = Top.Next;
+            Top.Next = Sibling[Next];
+            Stack.push_back({Next, 0, 0, false});
+            continue;
+        }
+        while (Scope.size() > Top.Mark) {
+            Available[Scope.back()].second = UINT32_MAX;
+            Scope.pop_back();
+        }
+        Stack.pop_back();
+    }
+    return Changed;
+}
+
+/// EliminateDeadCode -- dce: blocks nothing jumps to any more, and values that neither a call, a
+/// branch nor the result needs. The parameters stay, they define the function's signature.
+static bool EliminateDeadCode(IRFunction &F) {
+    bool Changed = false;
+    std::vector<uint8_t> Reachable(F.Blocks.size(), 0);
+    for (unsigned b : ReversePostOrderIR(F))
+        Reachable[b] = 1;
+    for (unsigned b = 0; b < F.Blocks.size(); ++b) {
+        IRBlock &B = F.Blocks[b];
+        if (B.Dead || Reachable[b])
+            continue;
+        B.Dead = true;
+        for (unsigned Id : B.Values)
+            F.Values[Id].Dead = true;
+        B.Values.clear();
+        unsigned NumSucc = B.Term == IR_Br ? 2 : B.Term == IR_Jmp ? 1 : 0;
+        for (unsigned s = 0; s < NumSucc; ++s)
+            RemovePred(F, B.Succ[s], b);
+        Changed = true;
+    }
+
+    std::vector<uint8_t> Live(F.Values.size(), 0);
+    std::vector<unsigned> Work;
+    auto MarkLive = [&](unsigned Id) {
+        if (!Live[Id]) {
+            Live[Id] = 1;
+            Work.push_back(Id);
+        }
+    };
+    for (unsigned i = 0; i < F.NumParams; ++i)
+        MarkLive(i);
+    for (IRBlock &B : F.Blocks) {
+        if (B.Dead)
+            continue;
+        for (unsigned Id : B.Values)
+            if (F.Values[Id].Op == IR_Call)
+                MarkLive(Id);
+        if (B.Term != IR_Jmp)
+            MarkLive(B.Arg);
+    }
+    while (!Work.empty()) {
+        unsigned Id = Work.back();
+        Work.pop_back();
+        for (unsigned Op : F.Values[Id].Ops)
+            MarkLive(Op);
+    }
+
+    for (IRBlock &B : F.Blocks) {
+        auto End = std::remove_if(B.Values.begin(), B.Values.end(), [&](unsigned Id) { return !Live[Id]; });
+        for (auto It = End; It != B.Values.end(); ++It)
+            F.Values[*It].Dead = true;
+        Changed |= End != B.Values.end();
+        B.Values.erase(End, B.Values.end());
+    }
+    return Changed;
+}
+
+/// IRPass -- one pass in the pipeline, with what it has cost so far for --time-passes
+struct IRPass {
+    const char *Name;
+    bool (*Run)(IRFunction &F);
+    uint64_t Runs = 0, Changes = 0;
+    double Seconds = 0.0;
+};
+
+static IRPass IRPasses[] = {
+    {"constfold", FoldIR},
+    {"cse", EliminateCommonSubexprs},
+    {"copyprop", PropagateCopies},
+    {"dce", EliminateDeadCode},
+};
+
+/// OptimizeIR -- run the pipeline until a round changes nothing. Each pass makes the function smaller
+/// or leaves it alone, so that happens quickly; the round limit is only a backstop.
+static void OptimizeIR(IRFunction &F) {
+    for (unsigned Round = 0; Round < 8; ++Round) {
+        bool Changed = false;
+        for (IRPass &P : IRPasses) {
+            auto Start = std::chrono::steady_clock::now();
+            bool PassChanged = P.Run(F);
+            P.Seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+            ++P.Runs;
+            P.Changes += PassChanged;
+            Changed |= PassChanged;
+        }
+        if (!Changed)
+            return;
+    }
+}
+
+static void PrintPassTimes() {
+    double Total = 0.0;
+    for (const IRPass &P : IRPasses)
+        Total += P.Seconds;
+    for (const IRPass &P : IRPasses)
+        fprintf(stderr, "pass: %-10s %8.3f ms %5.1f%%  %llu runs, %llu changed\n", P.Name, P.Seconds * 1e3,
+                Total > 0.0 ? 100.0 * P.Seconds / Total : 0.0, (unsigned long long)P.Runs,
+                (unsigned long long)P.Changes);
+    fprintf(stderr, "pass: %-10s %8.3f ms\n", "total", Total * 1e3);
+}
+
+/*
+ * LowerIR turns the optimized IR into a BytecodeFunction. Blocks are laid out in reverse post order,
+ * so a Jmp or the Br's true edge falls through whenever it can, and every instruction and every block
+ * end gets a position in that order. A value then needs its register from its definition to its last
+ * use; on an acyclic graph in that order those positions cover every point where it's live.
+ *
+ * Copies, ToF64 and IsTrue need no code: a Lt already leaves 1.0 / 0.0 in its register and JMPF tests
+ * the truth of whatever it's given, so each of them shares the register of its operand. Constants
+ * have no register of their own, a LOADK puts them where they're needed. Registers are handed out
+ * lowest first and never below NumParams, parameters are never written (see the memo tables). A phi's
+ * register is taken at the end of the first block that moves into it and kept until its last use, so
+ * the moves at the end of every predecessor never clobber one another's sources.
+ *
+ * A call's arguments start above every register that's still needed after it: the callee's frame
+ * starts at its first argument in the VM.
+ */
+class IRLowering {
+    const IRFunction &F;
+    std::unique_ptr<BytecodeFunction> BC;
+    std::vector<unsigned> Order;
+    std::vector<unsigned> Rep;       // the value whose register a value uses
+    std::vector<unsigned> Reg;       // by representative
+    std::vector<size_t> Pos, EndPos; // by value, by block
+    std::vector<size_t> LastUse;     // by representative
+    std::vector<unsigned> PhiUse;    // by representative: a phi it flows into from its own block
+    std::vector<std::pair<unsigned, unsigned>> ArgUse; // by representative: the call and argument that's its last use
+    std::vector<unsigned> CallBase;  // by call: where its arguments were put as they were computed
+    std::vector<size_t> BusyUntil;   // by register: the last use of the value in it
+    std::map<uint64_t, unsigned> ConstIndex;
+    std::map<std::string, unsigned> CalleeIndex;
+    std::vector<std::pair<size_t, unsigned>> JumpFixups; // instruction, block
+
+    static constexpr unsigned NoReg = UINT32_MAX;
+
+    void emit(Opcode Op, unsigned A, unsigned B = 0, unsigned C = 0, unsigned N = 0) {
+        BC->Code.push_back({Op, (uint8_t)N, (uint16_t)A, (uint16_t)B, (uint16_t)C});
+    }
+
+    void emitJump(Opcode Op, unsigned A, unsigned Block) {
+        JumpFixups.push_back({BC->Code.size(), Block});
+        emit(Op, A);
+    }
+
+    unsigned constIndex(double K) {
+        uint64_t Bits;
+        memcpy(&Bits, &K, sizeof(Bits));
+        auto It = ConstIndex.find(Bits);
+        if (It != ConstIndex.end())
+            return It->second;
+        BC->Consts.push_back(K);
+        return ConstIndex[Bits] = (unsigned)BC->Consts.size() - 1;
+    }
+
+    /// alloc -- the lowest register that's free at P (or only read at P, with Strict unset) for a value
+    /// that's needed until Until
+    unsigned alloc(size_t P, size_t Until, bool Strict) {
+        unsigned R = F.NumParams;
+        while (R < BusyUntil.size() && (Strict ? BusyUntil[R] >= P : BusyUntil[R] > P))
+            ++R;
+        if (R == BusyUntil.size())
+            BusyUntil.push_back(0);
+        BusyUntil[R] = Until;
+        BC->NumRegs = std::max(BC->NumRegs, R + 1);
+        return R;
+    }
+
+    /// result -- the register for the result of Id, defined at P. A value that ends its life moving
+    /// into a phi goes straight into the phi's register instead: no other value is ever given that
+    /// register while the phi has it, and on the path Id is on the phi hasn't got a value yet.
+    unsigned result(unsigned Id, size_t P) {
+        unsigned Call = ArgUse[Id].first;
+        if (Call != NoReg) {
+            if (CallBase[Call] == NoReg) {
+                unsigned Base = F.NumParams;
+                for (unsigned R = F.NumParams; R < BusyUntil.size(); ++R)
+                    if (BusyUntil[R] > P)
+                        Base = R + 1;
+                unsigned N = (unsigned)F.Values[Call].Ops.size();
+                if (BusyUntil.size() < Base + N)
+                    BusyUntil.resize(Base + N, 0);
+                std::fill(BusyUntil.begin() + Base, BusyUntil.begin() + Base + N, Pos[Call]);
+                BC->NumRegs = std::max(BC->NumRegs, Base + N);
+                CallBase[Call] = Base;
+            }
+            return CallBase[Call] + ArgUse[Id].second;
+        }
+
+        unsigned Phi = PhiUse[Id];
+        if (Phi == NoReg || LastUse[Id] != EndPos[F.Values[Id].Block])
+            return alloc(P, LastUse[Id], false);
+        if (Reg[Phi] == NoReg)
+            Reg[Phi] = alloc(P, LastUse[Phi], false);
+        return Reg[Phi];
+    }
+
+    bool isConst(unsigned V) const { return F.Values[Rep[V]].Op == IR_Const; }
+
+    /// use -- the register V is in when it's read at P, after a LOADK if it's a constant
+    unsigned use(unsigned V, size_t P) {
+        if (!isConst(V))
+            return Reg[Rep[V]];
+        unsigned R = alloc(P, P, true);
+        emit(OP_LOADK, R, constIndex(F.Values[Rep[V]].K));
+        return R;
+    }
+
+    /// moveTo -- put V in register R
+    void moveTo(unsigned R, unsigned V) {
+        if (isConst(V))
+            emit(OP_LOADK, R, constIndex(F.Values[Rep[V]].K));
+        else if (Reg[Rep[V]] != R)
+            emit(OP_MOV, R, Reg[Rep[V]]);
+    }
+
+    void numberAndFindUses() {
+        size_t P = 0;
+        for (unsigned b : Order) {
+            for (unsigned Id : F.Blocks[b].Values)
+                Pos[Id] = P++;
+            EndPos[b] = P++;
+        }
+        auto Use = [&](unsigned V, size_t At) { LastUse[Rep[V]] = std::max(LastUse[Rep[V]], At); };
+        for (unsigned b : Order) {
+            const IRBlock &B = F.Blocks[b];
+            for (unsigned Id : B.Values) {
+                const IRValue &V = F.Values[Id];
+                LastUse[Rep[Id]] = std::max(LastUse[Rep[Id]], Pos[Id]);
+                if (V.Op == IR_Phi) {
+                    for (size_t i = 0; i < V.Ops.size(); ++i) {
+                        Use(V.Ops[i], EndPos[B.Preds[i]]);
+                        if (F.Values[Rep[V.Ops[i]]].Block == B.Preds[i])
+                            PhiUse[Rep[V.Ops[i]]] = Id;
+                    }
+                } else if (Rep[Id] == Id) {
+                    for (unsigned Op : V.Ops)
+                        Use(Op, Pos[Id]);
+                }
+            }
+            if (B.Term != IR_Jmp)
+                Use(B.Arg, EndPos[b]);
+        }
+
+        for (unsigned b : Order) {
+            for (unsigned Id : F.Blocks[b].Values) {
+                const IRValue &V = F.Values[Id];
+                if (V.Op != IR_Call)
+                    continue;
+                for (unsigned i = 0; i < V.Ops.size(); ++i) {
+                    unsigned R = Rep[V.Ops[i]];
+                    IROpcode Op = F.Values[R].Op;
+                    bool Computed = Op == IR_Add || Op == IR_Sub || Op == IR_Mul || Op == IR_Lt || Op == IR_Call;
+                    if (Computed && LastUse[R] == Pos[Id] && ArgUse[R].first == NoReg)
+                        ArgUse[R] = {Id, i};
+                }
+            }
+        }
+    }
+
+    /// argumentsInPlace -- whether the call Id can be made with the arguments where result put them:
+    /// nothing at or above CallBase may be needed after the call, its frame goes there
+    bool argumentsInPlace(unsigned Id, size_t P) const {
+        unsigned Base = CallBase[Id];
+        if (Base == NoReg)
+            return false;
+        for (unsigned R = Base; R < BusyUntil.size(); ++R)
+            if (BusyUntil[R] > P)
+                return false;
+        const IRValue &V = F.Values[Id];
+        for (unsigned i = 0; i < V.Ops.size(); ++i)
+            if (!isConst(V.Ops[i]) && Reg[Rep[V.Ops[i]]] >= Base && Reg[Rep[V.Ops[i]]] != Base + i)
+                return false;
+        return true;
+    }
+
+    void lowerValue(unsigned Id) {
+        const IRValue &V = F.Values[Id];
+        size_t P = Pos[Id];
+        switch (V.Op) {
+            case IR_Const:
+            case IR_Param:
+            case IR_Phi:
+            case IR_Copy:
+            case IR_ToF64:
+            case IR_IsTrue:
+                return;
+            case IR_Add:
+            case IR_Sub:
+            case IR_Mul:
+            case IR_Lt: {
+                static const Opcode Ops[] = {OP_ADD, OP_ADD, OP_ADD, OP_SUB, OP_MUL, OP_LT};
+                unsigned B = use(V.Ops[0], P), C = use(V.Ops[1], P);
+                Reg[Id] = result(Id, P);
+                emit(Ops[V.Op], Reg[Id], B, C);
+                return;
+            }
+            case IR_Call: {
+                unsigned Base = F.NumParams;
+                if (argumentsInPlace(Id, P)) {
+                    Base = CallBase[Id];
+                } else {
+                    for (unsigned R = F.NumParams; R < BusyUntil.size(); ++R)
+                        if (BusyUntil[R] >= P)
+                            Base = R + 1;
+                }
+                unsigned N = (unsigned)V.Ops.size();
+                BC->NumRegs = std::max(BC->NumRegs, Base + N);
+                for (unsigned i = 0; i < N; ++i)
+                    moveTo(Base + i, V.Ops[i]);
+
+                const std::string &Callee = F.Callees[V.Index];
+                auto It = CalleeIndex.find(Callee);
+                unsigned Idx;
+                if (It != CalleeIndex.end()) {
+                    Idx = It->second;
+                } else {
+                    Idx = CalleeIndex[Callee] = (unsigned)BC->Callees.size();
+                    BC->Callees.push_back(Callee);
+                }
+                Reg[Id] = result(Id, P);
+                emit(OP_CALL, Reg[Id], Idx, Base, N);
+                return;
+            }
+        }
+    }
+
+    void lowerEnd(size_t i) {
+        unsigned b = Order[i];
+        const IRBlock &B = F.Blocks[b];
+        size_t P = EndPos[b];
+        unsigned Next = i + 1 < Order.size() ? Order[i + 1] : NoReg;
+        switch (B.Term) {
+            case IR_Ret:
+                emit(OP_RET, use(B.Arg, P));
+                return;
+            case IR_Br:
+                emitJump(OP_JMPF, use(B.Arg, P), B.Succ[1]);
+                if (B.Succ[0] != Next)
+                    emitJump(OP_JMP, 0, B.Succ[0]);
+                return;
+            case IR_Jmp: {
+                const IRBlock &To = F.Blocks[B.Succ[0]];
+                size_t Edge = std::find(To.Preds.begin(), To.Preds.end(), b) - To.Preds.begin();
+                for (unsigned Id : To.Values) {
+                    const IRValue &Phi = F.Values[Id];
+                    if (Phi.Op != IR_Phi)
+                        continue;
+                    if (Reg[Id] == NoReg)
+                        Reg[Id] = alloc(P, LastUse[Id], true);
+                    moveTo(Reg[Id], Phi.Ops[Edge]);
+                }
+                if (B.Succ[0] != Next)
+                    emitJump(OP_JMP, 0, B.Succ[0]);
+                return;
+            }
+        }
+    }
+
+public:
+    IRLowering(const IRFunction &F)
+        : F(F), BC(std::make_unique<BytecodeFunction>()), Rep(F.Values.size()), Reg(F.Values.size(), NoReg),
+          Pos(F.Values.size(), 0), EndPos(F.Blocks.size(), 0), LastUse(F.Values.size(), 0),
+          PhiUse(F.Values.size(), NoReg), ArgUse(F.Values.size(), {NoReg, 0}), CallBase(F.Values.size(), NoReg) {}
+
+    std::unique_ptr<BytecodeFunction> lower() {
+        BC->Name = F.Name;
+        BC->NumParams = BC->NumRegs = F.NumParams;
+        BusyUntil.assign(F.NumParams, SIZE_MAX);
+        Order = ReversePostOrderIR(F);
+
+        // operands come before their users in Order, so their representatives are known
+        for (unsigned b : Order) {
+            for (unsigned Id : F.Blocks[b].Values) {
+                IROpcode Op = F.Values[Id].Op;
+                Rep[Id] = Op == IR_Copy || Op == IR_ToF64 || Op == IR_IsTrue ? Rep[F.Values[Id].Ops[0]] : Id;
+            }
+        }
+        for (unsigned i = 0; i < F.NumParams; ++i)
+            Reg[i] = i;
+        numberAndFindUses();
+
+        std::vector<uint32_t> BlockStart(F.Blocks.size(), 0);
+        for (size_t i = 0; i < Order.size(); ++i) {
+            BlockStart[Order[i]] = (uint32_t)BC->Code.size();
+            for (unsigned Id : F.Blocks[Order[i]].Values)
+                lowerValue(Id);
+            lowerEnd(i);
+        }
+        for (auto &Fixup : JumpFixups)
+            SetJumpTarget(BC->Code[Fixup.first], BlockStart[Fixup.second]);
+
+        if (BC->NumRegs > MaxRegs) {
+            LogError("expression needs too many registers");
+            return nullptr;
+        }
+        if (BC->Consts.size() > 65536) {
+            LogError("too many constants in one function");
+            return nullptr;
+        }
+        PeepholeBytecode(*BC);
+        if (TailCalls)
+            MarkTailCalls(*BC);
+        return std::move(BC);
+    }
+};
+
+static const char *IROpcodeName(IROpcode Op) {
+    switch (Op) {
+        case IR_Const:  return "const";
+        case IR_Param:  return "param";
+        case IR_Add:    return "add";
+        case IR_Sub:    return "sub";
+        case IR_Mul:    return "mul";
+        case IR_Lt:     return "lt";
+        case IR_ToF64:  return "tof64";
+        case IR_IsTrue: return "istrue";
+        case IR_Call:   return "call";
+        case IR_Phi:    return "phi";
+        case IR_Copy:   return "copy";
+    }
+    return "?";
+}
+
+/// DumpIR -- the IR for --emit-ir
+static void DumpIR(const IRFunction &F, FILE *Out) {
+    fprintf(Out, "function %s: %u params\n", F.Name.c_str(), F.NumParams);
+    for (unsigned b : ReversePostOrderIR(F)) {
+        const IRBlock &B = F.Blocks[b];
+        fprintf(Out, "bb%u:", b);
+        for (size_t i = 0; i < B.Preds.size(); ++i)
+            fprintf(Out, "%s bb%u", i ? "," : "  ; preds", B.Preds[i]);
+        fprintf(Out, "\n");
+        for (unsigned Id : B.Values) {
+            const IRValue &V = F.Values[Id];
+            fprintf(Out, "  %%%u = %s", Id, IROpcodeName(V.Op));
+            if (V.Op == IR_Const)
+                fprintf(Out, " %g", V.K);
+            else if (V.Op == IR_Param)
+                fprintf(Out, " %u", V.Index);
+            else if (V.Op == IR_Call)
+                fprintf(Out, " %s", F.Callees[V.Index].c_str());
+            for (size_t i = 0; i < V.Ops.size(); ++i) {
+                if (V.Op == IR_Phi)
+                    fprintf(Out, "%s [%%%u, bb%u]", i ? "," : "", V.Ops[i], B.Preds[i]);
+                else
+                    fprintf(Out, "%s %%%u", i || V.Op == IR_Call ? "," : "", V.Ops[i]);
+            }
+            fprintf(Out, " : %s\n", V.Type == IRT_Bool ? "bool" : "f64");
+        }
+        switch (B.Term) {
+            case IR_Ret: fprintf(Out, "  ret %%%u\n", B.Arg); break;
+            case IR_Jmp: fprintf(Out, "  jmp bb%u\n", B.Succ[0]); break;
+            case IR_Br:  fprintf(Out, "  br %%%u, bb%u, bb%u\n", B.Arg, B.Succ[0], B.Succ[1]); break;
+        }
+    }
+}
+
+static bool SpecializeCalls(IRFunction &F);
+
+/// CompileThroughIR -- what CompileFunction does, with the optimizations in between. With Sig it
+/// compiles a specialized clone instead, and with no Body that clone just calls the function.
+static std::unique_ptr<BytecodeFunction> CompileThroughIR(const PrototypeAST &Proto, const ExprAST *Body,
+                                                          const ConstSignature *Sig = nullptr) {
+    IRFunction F;
+    IRBuilder Builder(F, Proto, Sig);
+    if (!Body)
+        Builder.forward(Proto.getName());
+    else if (!Builder.build(*Body))
+        return nullptr;
+    OptimizeIR(F);
+    if (Body && SpecializeCalls(F)) // a forwarding clone's call would come back to the clone
+        OptimizeIR(F);
+    if (EmitIR)
+        DumpIR(F, stdout);
+    auto BC = IRLowering(F).lower();
+    if (BC)
+        BC->Inlined = std::move(Builder.Inlined);
+    return BC;
+}
+
+// -----------------------------------=======
+//            End SSA IR
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            Function Table
+// -----------------------------------=======
+
+/*
+ * Every name that is defined or called gets a FunctionSlot at a fixed index in the dense FunctionTable
+ * the first time it's seen, and slots are never removed: a redefinition just changes what's in its
+ * slot. So a call site is bound to its slot once (BindCallees for bytecode, the evaluator on a node's
+ * first call) and every call after that is a load through the slot, not a name lookup. A call to a
+ * function that isn't defined yet is bound the same way and sees the definition when it arrives.
+ */
+
+class MemoTable; // see Memoization
+
+/// NativeEntryPoint -- what native callers of a slot call through: the slot's machine code, or the
+/// resolve stub until it has some (see NativeResolve). The stub reads SlotIndex at offset 8.
+struct NativeEntryPoint {
+    std::atomic<void *> Code{nullptr};
+    uint32_t SlotIndex = 0;
+};
+
+struct FunctionSlot {
+    std::string Name;
+    FunctionAST *AST = nullptr;           // FunctionDefs[Name], for the evaluator
+    std::unique_ptr<BytecodeFunction> BC; // for the VM and the native code generator
+
+    // see the Native Code section
+    NativeEntryPoint Entry;
+    void *Code = nullptr;
+    size_t CodeSize = 0;
+    int BoundArity = -1; // the argument count compiled callers assume this has, -2 if they don't agree
+
+    // the C function an extern is bound to (see BindExtern), used when there's no definition
+    void *Extern = nullptr;
+    unsigned ExternArity = 0;
+
+    MemoTable *Memo = nullptr; // with --memoize, made the first time the function is found pure
+
+    std::vector<FunctionSlot *> InlinedInto; // with --opt, see RecompileInliners (entries may be stale)
+
+    FunctionSlot(const std::string &Name, uint32_t Index) : Name(Name) { Entry.SlotIndex = Index; }
+};
+
+static std::vector<std::unique_ptr<FunctionSlot>> FunctionTable;
+static std::unordered_map<std::string, uint32_t> FunctionIndex;
+
+/// NativeResolveStub -- where a new slot's Entry points, set up by InitNativeCode
+static void *NativeResolveStub = nullptr;
+
+/// DefinitionsLock -- only the main thread changes definitions and ExternProtos, and it holds this while
+/// it does, so the tier-up compiler (see TierUpCompiler) can read them while holding it too.
+static std::mutex DefinitionsLock;
+
+/// FunctionSlotFor -- the slot for Name, created the first time. Main thread only.
+static FunctionSlot &FunctionSlotFor(const std::string &Name) {
+    auto Ins = FunctionIndex.emplace(Name, (uint32_t)FunctionTable.size());
+    if (Ins.second) {
+        FunctionTable.push_back(std::make_unique<FunctionSlot>(Name, Ins.first->second));
+        FunctionTable.back()->Entry.Code.store(NativeResolveStub, std::memory_order_relaxed);
+    }
+    return *FunctionTable[Ins.first->second];
+}
+
+/// BindCallees -- the resolution pass for bytecode: bind each of F's callees to its slot
+static void BindCallees(BytecodeFunction &F) {
+    F.CalleeSlots.clear();
+    for (auto &Name : F.Callees)
+        F.CalleeSlots.push_back(&FunctionSlotFor(Name));
+}
+
+static void RetireNativeCode(FunctionSlot &Slot, unsigned NewArity);
+
+// -----------------------------------=======
+//            End Function Table
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            Externs
+// -----------------------------------=======
+
+/*
+ * "extern sin(x)" binds sin to the C function of that name, looked up with dlsym in the libraries
+ * given with --load=lib.so (in order), then libm, then the program itself. The function must take and
+ * return doubles, at most 8 of them, so that the call passes everything in xmm registers. Native code
+ * uses the same convention, so it calls the C function straight through the slot's entry point, as
+ * it would call a compiled definition; the interpreters go through CallNative. A definition with the
+ * same name takes precedence over an extern.
+ */
+
+/// MaxExternArgs -- what fits in xmm0-xmm7
+static const unsigned MaxExternArgs = 8;
+
+/// CallNative -- call a double(double, ...) function with N (at most 8) arguments from an array
+static double CallNative(void *Code, const double *A, unsigned N) {
+    typedef double D;
+    switch (N) {
+        case 0: return ((D(*)())Code)();
+        case 1: return ((D(*)(D))Code)(A[0]);
+        case 2: return ((D(*)(D, D))Code)(A[0], A[1]);
+        case 3: return ((D(*)(D, D, D))Code)(A[0], A[1], A[2]);
+        case 4: return ((D(*)(D, D, D, D))Code)(A[0], A[1], A[2], A[3]);
+        case 5: return ((D(*)(D, D, D, D, D))Code)(A[0], A[1], A[2], A[3], A[4]);
+        case 6: return ((D(*)(D, D, D, D, D, D))Code)(A[0], A[1], A[2], A[3], A[4], A[5]);
+        case 7: return ((D(*)(D, D, D, D, D, D, D))Code)(A[0], A[1], A[2], A[3], A[4], A[5], A[6]);
+        default: return ((D(*)(D, D, D, D, D, D, D, D))Code)(A[0], A[1], A[2], A[3], A[4], A[5], A[6], A[7]);
+    }
+}
+
+/// LibmArity -- how many arguments the libm functions people are likely to declare take, to catch
+/// "extern sin(x y)" before it is called with garbage in xmm1. -1 for anything else.
+static int LibmArity(const std::string &Name) {
+    static const std::unordered_map<std::string, int> Arities = {
+        {"sin", 1},   {"cos", 1},   {"tan", 1},   {"asin", 1},  {"acos", 1},  {"atan", 1},  {"sinh", 1},
+        {"cosh", 1},  {"tanh", 1},  {"exp", 1},   {"exp2", 1},  {"expm1", 1}, {"log", 1},   {"log2", 1},
+        {"log10", 1}, {"log1p", 1}, {"sqrt", 1},  {"cbrt", 1},  {"fabs", 1},  {"floor", 1}, {"ceil", 1},
+        {"round", 1}, {"trunc", 1}, {"erf", 1},   {"erfc", 1},  {"atan2", 2}, {"pow", 2},   {"fmod", 2},
+        {"hypot", 2}, {"fmin", 2},  {"fmax", 2},  {"copysign", 2}, {"fdim", 2}, {"fma", 3},
+    };
+    auto It = Arities.find(Name);
+    return It == Arities.end() ? -1 : It->second;
+}
+
+#if LAP_DLOPEN
+
+/// ExternLibraries -- the --load=lib.so libraries, searched before libm
+static std::vector<void *> ExternLibraries;
+
+static bool LoadExternLibrary(const std::string &Path) {
+    void *Handle = dlopen(Path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!Handle) {
+        fprintf(stderr, "Error: %s\n", dlerror());
+        return false;
+    }
+    ExternLibraries.push_back(Handle);
+    return true;
+}
+
+static void *FindExternSymbol(const std::string &Name) {
+    static void *Libm = [] {
+        void *Handle = dlopen("libm.so.6", RTLD_NOW | RTLD_LOCAL);
+        return Handle ? Handle : dlopen("libm.so", RTLD_NOW | RTLD_LOCAL);
+    }();
+
+    for (void *Lib : ExternLibraries)
+        if (void *Sym = dlsym(Lib, Name.c_str()))
+            return Sym;
+    if (Libm)
+        if (void *Sym = dlsym(Libm, Name.c_str()))
+            return Sym;
+    return dlsym(RTLD_DEFAULT, Name.c_str());
+}
+
+#else
+
+static void *FindExternSymbol(const std::string &) {
+    return nullptr;
+}
+
+#endif // LAP_DLOPEN
+
+/// BindExtern -- bind Proto's slot to the C function of that name. An extern with no such function
+/// still declares the name, calls to it fail with "extern function has no implementation".
+static void BindExtern(const PrototypeAST &Proto) {
+    const std::string &Name = Proto.getName();
+    unsigned Arity = (unsigned)Proto.getArgs().size();
+    void *Sym = FindExternSymbol(Name);
+    if (!Sym)
+        return;
+
+    int Expected = LibmArity(Name);
+    if (Expected >= 0 && (unsigned)Expected != Arity) {
+        LogError(("extern " + Name + " takes " + std::to_string(Expected) + " arguments").c_str());
+        return;
+    }
+    if (Arity > MaxExternArgs) {
+        LogError("externs can take at most 8 arguments");
+        return;
+    }
+
+    FunctionSlot &Slot = FunctionSlotFor(Name);
+    std::lock_guard<std::mutex> Lock(DefinitionsLock);
+    RetireNativeCode(Slot, Arity);
+    Slot.Extern = Sym;
+    Slot.ExternArity = Arity;
+}
+
+// -----------------------------------=======
+//            End Externs
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            Memoization
+// -----------------------------------=======
+
+/*
+ * Nothing in the language has side effects except what an extern might do, so a definition that only
+ * calls other such definitions and known libm functions is pure: its result depends on its arguments
+ * alone. With --memoize (every pure definition) or --memoize=f,g (just those, if pure) each engine
+ * looks the arguments up in the function's MemoTable before running its body and records the result
+ * after. Anything being defined or bound can change what is pure and what a function returns, so that
+ * clears every table and purity is worked out again before the next top-level expression runs.
+ *
+ * A MemoTable is open addressing with linear probing over a short window, so a lookup touches one or
+ * two cache lines. When the window is full an insert evicts CLOCK style: entries hit since the last
+ * sweep get a second chance. Arguments are compared by bit pattern.
+ */
+
+/// MemoizeAll / MemoizeNames / MemoSize -- --memoize, --memoize=f,g and --memo-size=N (entries per function)
+static bool MemoizeAll = false;
+static std::vector<std::string> MemoizeNames;
+static size_t MemoSize = 1 << 12;
+
+static bool MemoizeAny() {
+    return MemoizeAll || !MemoizeNames.empty();
+}
+
+class MemoTable {
+    static const unsigned ProbeWindow = 4;
+    static const uint64_t Referenced = 1; // low bit of a tag, the rest is the hash with bit 1 forced on
+
+    unsigned Arity;
+    size_t Mask;
+    std::vector<uint64_t> Tags;   // 0 is an empty entry
+    std::vector<double> Entries;  // per entry, Arity arguments and then the result
+
+    static uint64_t mix(uint64_t X) {
+        X ^= X >> 30;
+        X *= 0xbf58476d1ce4e5b9ull;
+        X ^= X >> 27;
+        X *= 0x94d049bb133111ebull;
+        return X ^ (X >> 31);
+    }
+
+    static uint64_t tag(uint64_t Hash) { return (Hash | 2) & ~Referenced; }
+
+    uint64_t hash(const double *Args) const {
+        uint64_t H = Arity;
+        for (unsigned i = 0; i < Arity; ++i) {
+            uint64_t Bits;
+            memcpy(&Bits, &Args[i], 8);
+            H = mix(H ^ Bits);
+        }
+        return H;
+    }
+
+    double *entry(size_t Idx) { return &Entries[Idx * (Arity + 1)]; }
+
+public:
+    bool Enabled = false;
+    uint64_t Hits = 0, Misses = 0, Evictions = 0;
+    double LastHit = 0.0; // where lookupNative leaves the value for native code
+
+    MemoTable(unsigned Arity, size_t Size) : Arity(Arity) {
+        size_t Capacity = ProbeWindow;
+        while (Capacity < Size)
+            Capacity *= 2;
+        Mask = Capacity - 1;
+        Tags.assign(Capacity, 0);
+        Entries.assign(Capacity * (Arity + 1), 0.0);
+    }
+
+    unsigned arity() const { return Arity; }
+
+    bool lookup(const double *Args, double &Result) {
+        uint64_t H = hash(Args), Tag = tag(H);
+        for (unsigned i = 0; i < ProbeWindow; ++i) {
+            size_t Idx = (H + i) & Mask;
+            if (!Tags[Idx])
+                break;
+            if ((Tags[Idx] & ~Referenced) == Tag && !memcmp(entry(Idx), Args, 8 * Arity)) {
+                Tags[Idx] |= Referenced;
+                Result = entry(Idx)[Arity];
+                ++Hits;
+                return true;
+            }
+        }
+        ++Misses;
+        return false;
+    }
+
+    void insert(const double *Args, double Result) {
+        uint64_t H = hash(Args);
+        size_t Victim = H & Mask;
+        bool Found = false;
+        for (unsigned i = 0; i < ProbeWindow && !Found; ++i) {
+            size_t Idx = (H + i) & Mask;
+            if (!Tags[Idx]) {
+                Victim = Idx;
+                Found = true;
+            }
+        }
+        for (unsigned i = 0; i < ProbeWindow && !Found; ++i) {
+            size_t Idx = (H + i) & Mask;
+            if (Tags[Idx] & Referenced) {
+                Tags[Idx] &= ~Referenced;
+            } else {
+                Victim = Idx;
+                Found = true;
+            }
+        }
+        if (Tags[Victim])
+            ++Evictions;
+
+        Tags[Victim] = tag(H);
+        memcpy(entry(Victim), Args, 8 * Arity);
+        entry(Victim)[Arity] = Result;
+    }
+
+    void clear() { std::fill(Tags.begin(), Tags.end(), 0); }
+};
+
+static std::vector<std::unique_ptr<MemoTable>> MemoTables;
+
+/// DefinitionsVersion -- bumped whenever a definition or extern changes, see UpdateMemoization
+static uint64_t DefinitionsVersion = 0;
+static uint64_t MemoVersion = ~0ull;
+
+/// ForEachCallee -- the names Slot's definition calls, from its bytecode if it has some and its AST otherwise
+template <typename Fn>
+static void ForEachCallee(FunctionSlot &Slot, Fn &&Visit) {
+    if (Slot.BC) {
+        for (auto &Name : Slot.BC->Callees)
+            Visit(Name);
+        return;
+    }
+
+    const ExprAST *Body = Slot.AST ? GetFunctionBody(*Slot.AST) : nullptr;
+    std::vector<const ExprAST *> Work;
+    if (Body)
+        Work.push_back(Body);
+    while (!Work.empty()) {
+        const ExprAST &E = *Work.back();
+        Work.pop_back();
+        switch (E.getKind()) {
+            case EK_Number:
+            case EK_Variable:
+                break;
+            case EK_Unary: {
+                auto &U = static_cast<const UnaryExprAST &>(E);
+                Visit(std::string("unary") + U.getOpcode());
+                Work.push_back(&U.getOperand());
+                break;
+            }
+            case EK_Binary: {
+                auto &B = static_cast<const BinaryExprAST &>(E);
+                if (!IsBuiltinBinOp(B.getOp()))
+                    Visit(std::string("binary") + B.getOp());
+                Work.push_back(&B.getLHS());
+                Work.push_back(&B.getRHS());
+                break;
+            }
+            case EK_Call: {
+                auto &C = static_cast<const CallExprAST &>(E);
+                Visit(C.getCallee());
+                for (auto &Arg : C.getArgs())
+                    Work.push_back(Arg.get());
+                break;
+            }
+            case EK_If: {
+                auto &I = static_cast<const IfExprAST &>(E);
+                Work.push_back(&I.getCond());
+                Work.push_back(&I.getThen());
+                Work.push_back(&I.getElse());
+                break;
+            }
+        }
+    }
+}
+
+/// UpdateMemoization -- after definitions changed, empty every table and work out again which functions
+/// are pure: start from all definitions and drop callers of anything impure until nothing changes.
+/// The tier-up compiler reads the tables (see ActiveMemo), so this holds DefinitionsLock throughout.
+static void UpdateMemoization() {
+    if (!MemoizeAny() || MemoVersion == DefinitionsVersion)
+        return;
+    MemoVersion = DefinitionsVersion;
+    std::lock_guard<std::mutex> Lock(DefinitionsLock);
+
+    std::vector<FunctionSlot *> Defined;
+    std::unordered_map<FunctionSlot *, std::vector<FunctionSlot *>> Callees;
+    std::unordered_map<FunctionSlot *, bool> Pure;
+    for (size_t i = 0, E = FunctionTable.size(); i < E; ++i) { // FunctionSlotFor may add slots
+        FunctionSlot *Slot = FunctionTable[i].get();
+        if (!Slot->AST && !Slot->BC)
+            continue;
+        Defined.push_back(Slot);
+        Pure[Slot] = true;
+        auto &Calls = Callees[Slot];
+        ForEachCallee(*Slot, [&](const std::string &Name) { Calls.push_back(&FunctionSlotFor(Name)); });
+    }
+
+    for (bool Changed = true; Changed;) {
+        Changed = false;
+        for (FunctionSlot *Slot : Defined) {
+            if (!Pure[Slot])
+                continue;
+            for (FunctionSlot *Callee : Callees[Slot]) {
+                bool CalleePure = Pure.count(Callee) ? Pure[Callee] : Callee->Extern && LibmArity(Callee->Name) >= 0;
+                if (!CalleePure) {
+                    Pure[Slot] = false;
+                    Changed = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    for (auto &Table : MemoTables) {
+        Table->clear();
+        Table->Enabled = false;
+    }
+    for (FunctionSlot *Slot : Defined) {
+        unsigned Arity = Slot->BC ? Slot->BC->NumParams : (unsigned)Slot->AST->getProto().getArgs().size();
+        bool Wanted = MemoizeAll || std::find(MemoizeNames.begin(), MemoizeNames.end(), Slot->Name) != MemoizeNames.end();
+        if (!Pure[Slot] || !Wanted || !Arity)
+            continue;
+        if (!Slot->Memo || Slot->Memo->arity() != Arity) {
+            MemoTables.push_back(std::make_unique<MemoTable>(Arity, MemoSize));
+            Slot->Memo = MemoTables.back().get();
+        }
+        Slot->Memo->Enabled = true;
+    }
+}
+
+/// ActiveMemo -- Slot's table if calls to it should be memoized right now
+static MemoTable *ActiveMemo(const FunctionSlot &Slot) {
+    return Slot.Memo && Slot.Memo->Enabled ? Slot.Memo : nullptr;
+}
+
+static void PrintMemoStats() {
+    for (auto &Slot : FunctionTable) {
+        MemoTable *T = Slot->Memo;
+        if (T && T->Hits + T->Misses)
+            fprintf(stderr, "memo: %s: %llu hits, %llu misses, %llu evictions\n", Slot->Name.c_str(),
+                    (unsigned long long)T->Hits, (unsigned long long)T->Misses, (unsigned long long)T->Evictions);
+    }
+}
+
+// -----------------------------------=======
+//            End Memoization
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            Inliner
+// -----------------------------------=======
+
+/*
+ * With --opt the IRBuilder asks ShouldInline about every call to a user definition, named calls and
+ * user defined operators alike. A callee costs the number of nodes in its body, and a call to it is
+ * inlined when
+ *   - the body is about as small as the call itself (its arguments and two more nodes), or
+ *   - the cost is within --inline-threshold, which every constant argument raises by InlineConstBonus
+ *     (folding will shrink the body) and which doubles for a callee that has been called
+ *     InlineHotCalls times already (not with --cache);
+ * as long as the caller hasn't grown by InlineGrowth thresholds yet and the call isn't inside more
+ * than InlineMaxDepth inlined bodies. Nothing that's being built, the caller or a body the call is
+ * in, is ever inlined: that's what keeps recursion finite, a recursive function's recursive calls
+ * stay calls. With --memoize nothing that could get a memo table is inlined, the table would never
+ * see those calls.
+ *
+ * A body is copied into its callers, so a redefinition has to recompile them; RecompileInliners does.
+ * --inline-report prints every decision as it's made and a summary at exit.
+ */
+
+/// InlineThreshold -- --inline-threshold=N, 0 turns inlining off
+static unsigned InlineThreshold = 24;
+static const unsigned InlineConstBonus = 4;
+static const uint64_t InlineHotCalls = 1000;
+static bool InlineHotBonus = true; // off with --cache, whose entries mustn't depend on what has run
+static const unsigned InlineGrowth = 8;
+static const unsigned InlineMaxDepth = 8;
+static bool InlineReport = false;
+
+enum InlineOutcome {
+    IO_Inlined,
+    IO_NotDefined,
+    IO_Recursive,
+    IO_Memoized,
+    IO_ArgCount,
+    IO_TooDeep,
+    IO_TooBig,
+    IO_CallerTooBig,
+    IO_Count,
+};
+
+static const char *const InlineOutcomeNames[IO_Count] = {
+    "inlined", "not a compiled definition", "recursive", "memoized", "wrong number of arguments",
+    "nested too deep", "too big", "caller grew too much",
+};
+
+static uint64_t InlineStats[IO_Count];
+
+/// InlineCost -- the size of Def's body, counting stops past Limit. Valid is false when the body
+/// can't compile (it names something that isn't a parameter), so inlining it would break the caller.
+static unsigned InlineCost(const FunctionAST &Def, unsigned Limit, bool &Valid) {
+    const std::vector<std::string> &Params = Def.getProto().getArgs();
+    unsigned Cost = 0;
+    std::vector<const ExprAST *> Work{Def.getBody()};
+    Valid = true;
+    while (!Work.empty() && Cost <= Limit) {
+        const ExprAST &E = *Work.back();
+        Work.pop_back();
+        ++Cost;
+        switch (E.getKind()) {
+            case EK_Number:
+                break;
+            case EK_Variable: {
+                auto &Name = static_cast<const VariableExprAST &>(E).getName();
+                if (std::find(Params.begin(), Params.end(), Name) == Params.end())
+                    Valid = false;
+                break;
+            }
+            case EK_Unary:
+                Work.push_back(&static_cast<const UnaryExprAST &>(E).getOperand());
+                break;
+            case EK_Binary: {
+                auto &B = static_cast<const BinaryExprAST &>(E);
+                Work.push_back(&B.getLHS());
+                Work.push_back(&B.getRHS());
+                break;
+            }
+            case EK_Call: {
+                auto &C = static_cast<const CallExprAST &>(E);
+                if (C.getArgs().size() > MaxCallArgs)
+                    Valid = false;
+                for (auto &Arg : C.getArgs())
+                    Work.push_back(Arg.get());
+                break;
+            }
+            case EK_If: {
+                auto &I = static_cast<const IfExprAST &>(E);
+                Work.push_back(&I.getCond());
+                Work.push_back(&I.getThen());
+                Work.push_back(&I.getElse());
+                break;
+            }
+        }
+    }
+    return Cost;
+}
+
+/// ShouldInline -- the callee's definition if the call at Site should be inlined, null if not
+static const FunctionAST *ShouldInline(const InlineSite &Site) {
+    if (!InlineThreshold)
+        return nullptr;
+
+    auto It = FunctionIndex.find(Site.Callee);
+    FunctionSlot *Slot = It != FunctionIndex.end() ? FunctionTable[It->second].get() : nullptr;
+    const FunctionAST *Def = Slot && Slot->BC && Slot->AST && Slot->AST->getBody() ? Slot->AST : nullptr;
+    unsigned Cost = 0, Limit = InlineThreshold + InlineConstBonus * Site.ConstArgs;
+    bool Valid = true;
+
+    InlineOutcome Outcome;
+    if (Site.Recursive) {
+        Outcome = IO_Recursive;
+    } else if (!Def) {
+        Outcome = IO_NotDefined;
+    } else if (MemoizeAll || std::find(MemoizeNames.begin(), MemoizeNames.end(), Site.Callee) != MemoizeNames.end()) {
+        Outcome = IO_Memoized;
+    } else if (Def->getProto().getArgs().size() != Site.NumArgs) {
+        Outcome = IO_ArgCount;
+    } else if (Site.Depth >= InlineMaxDepth) {
+        Outcome = IO_TooDeep;
+    } else {
+        if (InlineHotBonus && Slot->BC->Calls >= InlineHotCalls)
+            Limit *= 2;
+        Cost = InlineCost(*Def, std::max(Limit, Site.NumArgs + 2), Valid);
+        if (!Valid)
+            Outcome = IO_NotDefined;
+        else if (Cost > Limit && Cost > Site.NumArgs + 2)
+            Outcome = IO_TooBig;
+        else if (Site.Growth + Cost > InlineGrowth * InlineThreshold)
+            Outcome = IO_CallerTooBig;
+        else
+            Outcome = IO_Inlined;
+    }
+
+    ++InlineStats[Outcome];
+    if (Outcome == IO_Inlined)
+        Site.Growth += Cost;
+    if (InlineReport) {
+        fprintf(stderr, "inline: %s in %s: %s", Site.Callee.c_str(), Site.Caller.c_str(), InlineOutcomeNames[Outcome]);
+        if (Cost)
+            fprintf(stderr, " (cost %u, limit %u%s)", Cost, Limit, Site.Depth ? ", nested" : "");
+        fprintf(stderr, "\n");
+    }
+    return Outcome == IO_Inlined ? Def : nullptr;
+}
+
+/// NoteInlined -- remember which definitions F's bytecode has copies of. Top-level expressions only
+/// run once, they never need recompiling.
+static void NoteInlined(const BytecodeFunction &F) {
+    if (F.Inlined.empty() || F.Name == "__anon_expr")
+        return;
+    FunctionSlot &Slot = FunctionSlotFor(F.Name);
+    for (auto &Name : F.Inlined) {
+        auto &Into = FunctionSlotFor(Name).InlinedInto;
+        if (std::find(Into.begin(), Into.end(), &Slot) == Into.end())
+            Into.push_back(&Slot);
+    }
+}
+
+static void DefineBytecodeFunction(std::unique_ptr<BytecodeFunction> F);
+static void RebuildClones(const std::string &Changed);
+
+/// RecompileInliners -- Slot was just redefined: recompile every function that has its old body, and
+/// in turn every function that has one of theirs. Each is recompiled once, whatever the cycles. The
+/// specialized clones of all of them are rebuilt as well.
+static void RecompileInliners(FunctionSlot &Slot) {
+    std::vector<FunctionSlot *> Work{&Slot}, Done{&Slot};
+    while (!Work.empty()) {
+        FunctionSlot *Changed = Work.back();
+        Work.pop_back();
+        RebuildClones(Changed->Name);
+        std::vector<FunctionSlot *> Into = std::move(Changed->InlinedInto);
+        Changed->InlinedInto.clear();
+        for (FunctionSlot *Caller : Into) {
+            // entries go stale when a caller is recompiled without the inlining
+            if (!Caller->BC || !Caller->AST || !Caller->AST->getBody() ||
+                std::find(Caller->BC->Inlined.begin(), Caller->BC->Inlined.end(), Changed->Name) == Caller->BC->Inlined.end() ||
+                std::find(Done.begin(), Done.end(), Caller) != Done.end())
+                continue;
+            Done.push_back(Caller);
+            if (InlineReport)
+                fprintf(stderr, "inline: recompiling %s, %s changed\n", Caller->Name.c_str(), Changed->Name.c_str());
+            auto BC = CompileThroughIR(Caller->AST->getProto(), Caller->AST->getBody());
+            if (!BC)
+                continue;
+            BindCallees(*BC);
+            NoteInlined(*BC);
+            DefineBytecodeFunction(std::move(BC));
+            Work.push_back(Caller);
+        }
+    }
+}
+
+static void PrintInlineStats() {
+    uint64_t Total = 0;
+    for (uint64_t N : InlineStats)
+        Total += N;
+    fprintf(stderr, "inline: %llu calls considered", (unsigned long long)Total);
+    for (unsigned i = 0; i < IO_Count; ++i)
+        if (InlineStats[i])
+            fprintf(stderr, ", %llu %s", (unsigned long long)InlineStats[i], InlineOutcomeNames[i]);
+    fprintf(stderr, "\n");
+}
+
+// -----------------------------------=======
+//            End Inliner
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            Specialization
+// -----------------------------------=======
+
+/*
+ * With --opt a call that still has constant arguments once the caller is optimized, poly(x, 3) or
+ * scale(v, 1000), is pointed at a clone of the callee with those parameters bound: the clone is
+ * compiled from the callee's definition with the constants in place of the parameters, so folding
+ * takes out every test and every bit of arithmetic that only depended on them, and the call passes
+ * just the other arguments. Clones are cached by callee and constants, which is what the clone's name
+ * spells out (poly<_,3>), so every such call shares one, and a recursive call in the clone with the
+ * same constants calls the clone itself. A recursive function whose constant changes on the way down
+ * gets a clone per step, until its base case folds the recursion away or SpecializeMaxDepth stops it.
+ * A call with nothing but constants is left alone: its clone would only work out one value, one
+ * clone per step of the recursion.
+ *
+ * Callees are chosen as for inlining (compiled definitions, no memoized ones), and the code of all
+ * clones together is capped by --specialize-budget instructions, after which calls stay generic. A
+ * clone is rebuilt in place when its callee or anything inlined into it is redefined, so callers keep
+ * calling it through its slot; if the callee doesn't take those arguments any more the clone becomes
+ * a plain call to it. --inline-report reports specialization too.
+ */
+
+/// SpecializeBudget -- --specialize-budget=N, bytecode instructions for all clones, 0 turns it off
+static unsigned SpecializeBudget = 4096;
+static const unsigned SpecializeMaxDepth = 16;
+static unsigned SpecializeSpent = 0;
+static unsigned SpecializeDepth = 0; // clones being compiled, one inside the other
+
+/// Specialization -- a clone in the cache. Deps are the functions it has a copy of: Callee and what
+/// was inlined into it, see RebuildClones.
+struct Specialization {
+    std::string Callee;
+    ConstSignature Sig;
+    std::vector<std::string> Deps;
+    unsigned Size = 0;
+};
+
+static std::unordered_map<std::string, Specialization> Specializations;
+
+enum SpecializeOutcome {
+    SO_Cloned,
+    SO_Cached,
+    SO_NotDefined,
+    SO_Memoized,
+    SO_ArgCount,
+    SO_TooDeep,
+    SO_OverBudget,
+    SO_Count,
+};
+
+static const char *const SpecializeOutcomeNames[SO_Count] = {
+    "cloned", "cached", "not a compiled definition", "memoized", "wrong number of arguments",
+    "nested too deep", "over budget",
+};
+
+static uint64_t SpecializeStats[SO_Count];
+
+/// SpecializedName -- Callee<_,3> for Callee(x, 3). The constants read back exactly, so the name is
+/// the cache key.
+static std::string SpecializedName(const std::string &Callee, const ConstSignature &Sig) {
+    std::string Name = Callee + "<";
+    for (size_t i = 0; i < Sig.Bound.size(); ++i) {
+        if (i)
+            Name += ',';
+        if (!Sig.Bound[i]) {
+            Name += '_';
+            continue;
+        }
+        char Buf[32];
+        snprintf(Buf, sizeof(Buf), "%.15g", Sig.K[i]);
+        if (strtod(Buf, nullptr) != Sig.K[i])
+            snprintf(Buf, sizeof(Buf), "%.17g", Sig.K[i]);
+        Name += Buf;
+    }
+    return Name + ">";
+}
+
+/// SpecializableDef -- Callee's definition if a clone of it can be compiled for NumArgs arguments
+static const FunctionAST *SpecializableDef(const std::string &Callee, size_t NumArgs, SpecializeOutcome &Why) {
+    auto It = FunctionIndex.find(Callee);
+    FunctionSlot *Slot = It != FunctionIndex.end() ? FunctionTable[It->second].get() : nullptr;
+    const FunctionAST *Def = Slot && Slot->BC && Slot->AST && Slot->AST->getBody() ? Slot->AST : nullptr;
+    bool Valid = true;
+    if (Def)
+        InlineCost(*Def, ~0u, Valid);
+    if (!Def || !Valid)
+        Why = SO_NotDefined;
+    else if (MemoizeAll || std::find(MemoizeNames.begin(), MemoizeNames.end(), Callee) != MemoizeNames.end())
+        Why = SO_Memoized;
+    else if (Def->getProto().getArgs().size() != NumArgs)
+        Why = SO_ArgCount;
+    else
+        return Def;
+    return nullptr;
+}
+
+/// CompileClone -- (re)compile S from its callee's definition, or as a call to it without one, and
+/// install it in its slot. False if it didn't compile.
+static bool CompileClone(Specialization &S, const FunctionAST *Def) {
+    std::unique_ptr<BytecodeFunction> BC;
+    ++SpecializeDepth;
+    if (Def) {
+        BC = CompileThroughIR(Def->getProto(), Def->getBody(), &S.Sig);
+    } else {
+        PrototypeAST Proto(S.Callee, std::vector<std::string>(S.Sig.Bound.size()));
+        BC = CompileThroughIR(Proto, nullptr, &S.Sig);
+    }
+    --SpecializeDepth;
+    if (!BC)
+        return false;
+
+    SpecializeSpent = SpecializeSpent - S.Size + (unsigned)BC->Code.size();
+    S.Size = (unsigned)BC->Code.size();
+    S.Deps.assign(1, S.Callee);
+    for (auto &Name : BC->Inlined)
+        if (Name != S.Callee)
+            S.Deps.push_back(Name);
+    BindCallees(*BC);
+    DefineBytecodeFunction(std::move(BC));
+    ++DefinitionsVersion;
+    return true;
+}
+
+/// Specialize -- the name of Callee's clone for Sig, compiled the first time it's asked for; null if
+/// the call should stay as it is. Caller is for the report.
+static const std::string *Specialize(const std::string &Caller, const std::string &Callee, ConstSignature &Sig) {
+    Sig.Clone = SpecializedName(Callee, Sig);
+    auto Cached = Specializations.find(Sig.Clone);
+
+    SpecializeOutcome Outcome = SO_Cloned;
+    const FunctionAST *Def = nullptr;
+    if (Cached != Specializations.end())
+        Outcome = SO_Cached;
+    else if (!(Def = SpecializableDef(Callee, Sig.Bound.size(), Outcome)))
+        ;
+    else if (SpecializeDepth >= SpecializeMaxDepth)
+        Outcome = SO_TooDeep;
+    else if (SpecializeSpent >= SpecializeBudget)
+        Outcome = SO_OverBudget;
+
+    if (Outcome == SO_Cloned) {
+        // in the cache before it's compiled, so that its recursive calls find it
+        Cached = Specializations.emplace(Sig.Clone, Specialization()).first;
+        Cached->second.Callee = Callee;
+        Cached->second.Sig = Sig;
+        if (!CompileClone(Cached->second, Def)) {
+            Specializations.erase(Cached);
+            return nullptr;
+        }
+    }
+
+    ++SpecializeStats[Outcome];
+    if (InlineReport && Outcome != SO_Cached) {
+        fprintf(stderr, "specialize: %s in %s: %s", Sig.Clone.c_str(), Caller.c_str(), SpecializeOutcomeNames[Outcome]);
+        if (Outcome == SO_Cloned)
+            fprintf(stderr, " (%u instructions, %u of %u spent)", Cached->second.Size, SpecializeSpent, SpecializeBudget);
+        fprintf(stderr, "\n");
+    }
+    return Outcome == SO_Cloned || Outcome == SO_Cached ? &Cached->first : nullptr;
+}
+
+/// SpecializeCalls -- point F's calls with constant arguments at clones, see Specialize
+static bool SpecializeCalls(IRFunction &F) {
+    if (!SpecializeBudget)
+        return false;
+    bool Changed = false;
+    for (IRBlock &B : F.Blocks) {
+        for (unsigned Id : B.Values) {
+            IRValue &V = F.Values[Id];
+            if (V.Op != IR_Call)
+                continue;
+            ConstSignature Sig;
+            unsigned NumBound = 0;
+            for (unsigned Op : V.Ops) {
+                double K = 0.0;
+                Sig.Bound.push_back(IsConstIR(F, Op, K));
+                Sig.K.push_back(K);
+                NumBound += Sig.Bound.back();
+            }
+            bool Partial = NumBound && NumBound < V.Ops.size();
+            const std::string *Clone = Partial ? Specialize(F.Name, F.Callees[V.Index], Sig) : nullptr;
+            if (!Clone)
+                continue;
+
+            std::vector<unsigned> Args;
+            for (size_t i = 0; i < V.Ops.size(); ++i)
+                if (!Sig.Bound[i])
+                    Args.push_back(V.Ops[i]);
+            V.Ops = std::move(Args);
+            auto It = std::find(F.Callees.begin(), F.Callees.end(), *Clone);
+            V.Index = (unsigned)(It - F.Callees.begin());
+            if (It == F.Callees.end())
+                F.Callees.push_back(*Clone);
+            Changed = true;
+        }
+    }
+    return Changed;
+}
+
+/// RebuildClones -- Changed was redefined: recompile every clone that has a copy of it
+static void RebuildClones(const std::string &Changed) {
+    std::vector<std::string> Stale;
+    for (auto &Entry : Specializations)
+        if (std::find(Entry.second.Deps.begin(), Entry.second.Deps.end(), Changed) != Entry.second.Deps.end())
+            Stale.push_back(Entry.first);
+    for (auto &Name : Stale) {
+        Specialization &S = Specializations[Name];
+        SpecializeOutcome Why;
+        const FunctionAST *Def = SpecializableDef(S.Callee, S.Sig.Bound.size(), Why);
+        if (InlineReport)
+            fprintf(stderr, "specialize: rebuilding %s, %s changed\n", Name.c_str(), Changed.c_str());
+        CompileClone(S, Def);
+    }
+}
+
+static void PrintSpecializeStats() {
+    uint64_t Total = 0;
+    for (uint64_t N : SpecializeStats)
+        Total += N;
+    fprintf(stderr, "specialize: %llu calls considered", (unsigned long long)Total);
+    for (unsigned i = 0; i < SO_Count; ++i)
+        if (SpecializeStats[i])
+            fprintf(stderr, ", %llu %s", (unsigned long long)SpecializeStats[i], SpecializeOutcomeNames[i]);
+    fprintf(stderr, ", %zu clones, %u instructions\n", Specializations.size(), SpecializeSpent);
+}
+
+// -----------------------------------=======
+//            End Specialization
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            Evaluator
+// -----------------------------------=======
+
+/// FunctionDefs -- every definition seen so far, by name. A later definition replaces an earlier one.
+static std::map<std::string, std::unique_ptr<FunctionAST>> FunctionDefs;
+
+/// ExternProtos -- every extern seen so far, by name. Nothing implements them yet.
+static std::map<std::string, std::unique_ptr<PrototypeAST>> ExternProtos;
+
+/*
+ * The tree-walking evaluator, the baseline engine. Every value is a double. A call evaluates its
+ * arguments onto EvalStack, and those slots are the callee's frame: a VariableExprAST is FrameBase plus
+ * its parameter index, which is looked up once and cached on the node. Returning pops the frame with a
+ * resize, so once EvalStack has grown to the deepest call chain no call touches the heap.
+ *
+ * Errors (unknown function, wrong argument count, running out of stack) are reported once, after which
+ * EvalFailed makes every pending call return straight away.
+ *
+ * A function's body is evaluated with EvalTail, which doesn't make the call in tail position itself but
+ * hands it back to CallFunction. That moves its arguments over the frame being left and loops, so tail
+ * recursion doesn't nest on the native stack. Other calls do, and a call that finds less than
+ * EvalStackBudget left of what evaluation started with fails with "call stack overflow", however big
+ * the frames of this build are.
+ */
+
+static std::vector<double> EvalStack;
+static size_t FrameBase = 0;
+static const PrototypeAST *FrameProto = nullptr;
+static bool EvalFailed = false;
+static uint64_t EvalCalls = 0; // calls made by any engine, for --bench
+
+/// EvalStackBudget / EvalStackLimit -- how much native stack the evaluator may use, as compiled code
+/// may (see NativeStackBudget), and the frame address below which a call fails. The main thread
+/// normally has 8MB.
+static const uintptr_t EvalStackBudget = 4 << 20;
+static uintptr_t EvalStackLimit = 0;
+
+static double EvalError(const char *Str) {
+    if (!EvalFailed)
+        LogError(Str);
+    EvalFailed = true;
+    return 0.0;
+}
+
+/// PendingTailCall / PendingTailArgs -- the call EvalTail left for CallFunction, its arguments are the top
+/// PendingTailArgs entries of EvalStack
+static const FunctionSlot *PendingTailCall = nullptr;
+static size_t PendingTailArgs = 0;
+
+static double EvalExpr(const ExprAST &E);
+static double EvalTail(const ExprAST &E);
+
+/// CallFunction -- call the function in First with the NumArgs arguments on top of EvalStack, and pop them
+static double CallFunction(const FunctionSlot &First, size_t Base, size_t NumArgs) {
+    const FunctionSlot *Callee = &First;
+    while (true) {
+        if (!Callee->AST && Callee->Extern) {
+            double V = 0.0;
+            if (NumArgs != Callee->ExternArity)
+                EvalError("Incorrect # arguments passed");
+            else
+                V = CallNative(Callee->Extern, EvalStack.data() + Base, (unsigned)NumArgs);
+            EvalStack.resize(Base);
+            return V;
+        }
+        if (!Callee->AST) {
+            EvalStack.resize(Base);
+            if (ExternProtos.count(Callee->Name))
+                return EvalError("extern function has no implementation");
+            return EvalError("Unknown function referenced");
+        }
+
+        FunctionAST &F = *Callee->AST;
+        if (NumArgs != F.getProto().getArgs().size()) {
+            EvalStack.resize(Base);
+            return EvalError("Incorrect # arguments passed");
+        }
+        if ((uintptr_t)__builtin_frame_address(0) < EvalStackLimit) {
+            EvalStack.resize(Base);
+            return EvalError("call stack overflow");
+        }
+
+        const ExprAST *Body = GetFunctionBody(F);
+        if (!Body) {
+            EvalStack.resize(Base);
+            return EvalError("called function has no body");
+        }
+
+        MemoTable *Memo = ActiveMemo(*Callee);
+        double V;
+        if (Memo && Memo->lookup(EvalStack.data() + Base, V)) {
+            EvalStack.resize(Base);
+            return V;
+        }
+
+        ++EvalCalls;
+        size_t SavedBase = FrameBase;
+        const PrototypeAST *SavedProto = FrameProto;
+        FrameBase = Base;
+        FrameProto = &F.getProto();
+
+        // a memoized call needs its arguments until it has its result, so it keeps its frame
+        V = TailCalls && !Memo ? EvalTail(*Body) : EvalExpr(*Body);
+        if (Memo && !EvalFailed)
+            Memo->insert(EvalStack.data() + Base, V);
+
+        FrameProto = SavedProto;
+        FrameBase = SavedBase;
+
+        if (PendingTailCall) {
+            Callee = PendingTailCall;
+            PendingTailCall = nullptr;
+            if (!EvalFailed) {
+                NumArgs = PendingTailArgs;
+                std::copy(EvalStack.end() - NumArgs, EvalStack.end(), EvalStack.begin() + Base);
+                EvalStack.resize(Base + NumArgs);
+                continue;
+            }
+        }
+        EvalStack.resize(Base);
+        return V;
+    }
+}
+
+static double EvalVariable(const VariableExprAST &V) {
+    int Slot = V.getSlot();
+    if (Slot < 0) {
+        const auto &Args = FrameProto->getArgs();
+        for (size_t i = Args.size(); i-- > 0;) // the last of two parameters with one name wins
+            if (Args[i] == V.getName()) {
+                Slot = (int)i;
+                break;
+            }
+        if (Slot < 0)
+            return EvalError("Unknown variable name");
+        V.setSlot(Slot);
+    }
+    return EvalStack[FrameBase + Slot];
+}
+
+/// CalleeSlot -- the slot Node calls, binding it on the first call
+template <typename NodeT, typename NameFn>
+static const FunctionSlot &CalleeSlot(const NodeT &Node, NameFn &&Name) {
+    FunctionSlot *Slot = Node.getSlot();
+    if (!Slot) {
+        Slot = &FunctionSlotFor(Name());
+        Node.setSlot(Slot);
+    }
+    return *Slot;
+}
+
+static double EvalExpr(const ExprAST &E) {
+    if (EvalFailed)
+        return 0.0;
+
+    switch (E.getKind()) {
+        case EK_Number:
+            return static_cast<const NumberExprAST &>(E).getValue();
+        case EK_Variable:
+            return EvalVariable(static_cast<const VariableExprAST &>(E));
+        case EK_Unary: {
+            auto &U = static_cast<const UnaryExprAST &>(E);
+            size_t Base = EvalStack.size();
+            EvalStack.push_back(EvalExpr(U.getOperand()));
+            return CallFunction(CalleeSlot(U, [&] { return std::string("unary") + U.getOpcode(); }), Base, 1);
+        }
+        case EK_Binary: {
+            auto &B = static_cast<const BinaryExprAST &>(E);
+            if (IsBuiltinBinOp(B.getOp())) {
+                double L = EvalExpr(B.getLHS());
+                double R = EvalExpr(B.getRHS());
+                return ApplyBuiltinBinOp(B.getOp(), L, R);
+            }
+            size_t Base = EvalStack.size();
+            EvalStack.push_back(EvalExpr(B.getLHS()));
+            EvalStack.push_back(EvalExpr(B.getRHS()));
+            return CallFunction(CalleeSlot(B, [&] { return std::string("binary") + B.getOp(); }), Base, 2);
+        }
+        case EK_Call: {
+            auto &C = static_cast<const CallExprAST &>(E);
+            size_t Base = EvalStack.size();
+            for (auto &Arg : C.getArgs())
+                EvalStack.push_back(EvalExpr(*Arg));
+            return CallFunction(CalleeSlot(C, [&] { return C.getCallee(); }), Base, C.getArgs().size());
+        }
+        case EK_If: {
+            auto &I = static_cast<const IfExprAST &>(E);
+            if (IsTrue(EvalExpr(I.getCond())))
+                return EvalExpr(I.getThen());
+            return EvalExpr(I.getElse());
+        }
+    }
+    return 0.0;
+}
+
+/// EvalTail -- EvalExpr for a function body: a call in tail position is left in PendingTailCall instead
+/// of being made, see CallFunction
+static double EvalTail(const ExprAST &E) {
+    if (EvalFailed)
+        return 0.0;
+
+    size_t Base = EvalStack.size();
+    switch (E.getKind()) {
+        case EK_Unary: {
+            auto &U = static_cast<const UnaryExprAST &>(E);
+            EvalStack.push_back(EvalExpr(U.getOperand()));
+            PendingTailCall = &CalleeSlot(U, [&] { return std::string("unary") + U.getOpcode(); });
+            break;
+        }
+        case EK_Binary: {
+            auto &B = static_cast<const BinaryExprAST &>(E);
+            if (IsBuiltinBinOp(B.getOp()))
+                return EvalExpr(E);
+            EvalStack.push_back(EvalExpr(B.getLHS()));
+            EvalStack.push_back(EvalExpr(B.getRHS()));
+            PendingTailCall = &CalleeSlot(B, [&] { return std::string("binary") + B.getOp(); });
+            break;
+        }
+        case EK_Call: {
+            auto &C = static_cast<const CallExprAST &>(E);
+            for (auto &Arg : C.getArgs())
+                EvalStack.push_back(EvalExpr(*Arg));
+            PendingTailCall = &CalleeSlot(C, [&] { return C.getCallee(); });
+            break;
+        }
+        case EK_If: {
+            auto &I = static_cast<const IfExprAST &>(E);
+            if (IsTrue(EvalExpr(I.getCond())))
+                return EvalTail(I.getThen());
+            return EvalTail(I.getElse());
+        }
+        default:
+            return EvalExpr(E);
+    }
+    PendingTailArgs = EvalStack.size() - Base;
+    return 0.0;
+}
+
+/// StartEvaluation -- reset the evaluator for a run that starts in the caller's frame
+static void StartEvaluation() {
+    EvalFailed = false;
+    EvalStack.clear();
+    EvalStackLimit = (uintptr_t)__builtin_frame_address(0) - EvalStackBudget;
+}
+
+/// EvaluateTopLevel -- run a top-level expression, false if evaluation failed (the error is in PendingDiags)
+static bool EvaluateTopLevel(FunctionAST &Fn, double &Result) {
+    StartEvaluation();
+    FrameBase = 0;
+    FrameProto = &Fn.getProto();
+
+    const ExprAST *Body = GetFunctionBody(Fn);
+    if (!Body)
+        return false;
+    Result = EvalExpr(*Body);
+    return !EvalFailed;
+}
+
+/// BenchRuns -- --bench=N: run every top-level expression N more times and print the time per run and per call
+static unsigned BenchRuns = 0;
+
+/// Benchmark -- Run is one evaluation of the top-level expression with whichever engine is in use
+template <typename RunFn>
+static void Benchmark(RunFn &&Run) {
+    double Result;
+    uint64_t CallsBefore = EvalCalls;
+    auto Start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < BenchRuns; ++i)
+        if (!Run(Result))
+            return;
+    auto Elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - Start).count();
+
+    uint64_t Calls = EvalCalls - CallsBefore;
+    fprintf(stderr, "bench: %u runs, %.1f ns/run, %llu calls, %.2f ns/call\n", BenchRuns, Elapsed / BenchRuns,
+            (unsigned long long)Calls, Calls ? Elapsed / (double)Calls : 0.0);
+}
+
+// -----------------------------------=======
+//            End Evaluator
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            Bytecode VM
+// -----------------------------------=======
+
+/// KeepReplacedBytecode / ReplacedBytecode -- with --emit-obj a definition that is replaced is kept,
+/// for the top-level expressions parsed before that (see Object Files)
+static bool KeepReplacedBytecode = false;
+static std::vector<std::unique_ptr<BytecodeFunction>> ReplacedBytecode;
+
+/// DefineBytecodeFunction -- install F (with its callees bound) in its slot
+static void DefineBytecodeFunction(std::unique_ptr<BytecodeFunction> F) {
+    FunctionSlot &Slot = FunctionSlotFor(F->Name);
+    std::lock_guard<std::mutex> Lock(DefinitionsLock);
+    RetireNativeCode(Slot, F->NumParams);
+    if (KeepReplacedBytecode && Slot.BC)
+        ReplacedBytecode.push_back(std::move(Slot.BC));
+    Slot.BC = std::move(F);
+}
+
+/*
+ * The VM never recurses on the native stack: a CALL pushes a VMFrame and carries on in the callee, a
+ * RET pops it. All register files are windows into the one preallocated VMRegs array. The arguments
+ * of a CALL are always the caller's topmost live registers (see BytecodeEmitter::argument), so the
+ * callee's window simply starts at the first argument and its parameters are already in place.
+ * A TCALL instead moves its arguments down to the start of the current window and replaces the
+ * running function in the same frame, so tail recursion doesn't use up frames or registers.
+ *
+ * Dispatch is a computed goto per instruction where the compiler has labels as values (GCC, Clang),
+ * which gives every opcode its own indirect branch to predict, and a switch in a loop elsewhere.
+ */
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LAP_COMPUTED_GOTO 1
+#else
+#define LAP_COMPUTED_GOTO 0
+#endif
+
+/// VMStackSize / VMMaxFrames -- registers for all frames together, and how deep calls may nest
+static const size_t VMStackSize = 1 << 20;
+static const size_t VMMaxFrames = 1 << 20;
+
+struct VMFrame {
+    BytecodeFunction *F;
+    const Instr *PC; // the instruction after the CALL
+    double *Regs;
+    MemoTable *Memo; // the callee's, to record its result in when it returns
+};
+
+static std::vector<double> VMRegs;
+static std::vector<VMFrame> VMFrames;
+
+/// TierThreshold -- --engine=tiered promotes a function to native code after this many calls (--tier-threshold=N)
+static uint64_t TierThreshold = 0;
+
+static void RequestTierUp(FunctionSlot &Slot);
+
+static bool VMError(const char *Str) {
+    LogError(Str);
+    return false;
+}
+
+/// RunBytecode -- run Entry (a function without parameters) to completion. false if it failed, the error is in PendingDiags.
+static bool RunBytecode(BytecodeFunction &Entry, double &Result) {
+    if (VMRegs.empty())
+        VMRegs.resize(VMStackSize);
+    double *const Limit = VMRegs.data() + VMRegs.size();
+    VMFrames.clear();
+
+    BytecodeFunction *F = &Entry;
+    double *R = VMRegs.data();
+    if (R + F->NumRegs > Limit)
+        return VMError("call stack overflow");
+    const Instr *PC = F->Code.data();
+    const double *K = F->Consts.data();
+    const Instr *I;
+    bool Tail;
+
+#if LAP_COMPUTED_GOTO
+    // in Opcode order
+    static void *Dispatch[] = {&&do_LOADK, &&do_MOV, &&do_ADD, &&do_SUB, &&do_MUL, &&do_LT,
+                               &&do_CALL, &&do_RET, &&do_JMP, &&do_JMPF, &&do_TCALL, &&do_JNLT};
+#define VM_OP(Name) do_##Name:
+#define VM_NEXT() goto *Dispatch[(I = PC++)->Op]
+    VM_NEXT();
+#else
+#define VM_OP(Name) case OP_##Name:
+#define VM_NEXT() continue
+    while (true) {
+        I = PC++;
+        switch (I->Op) {
+#endif
+
+    VM_OP(LOADK)
+        R[I->A] = K[I->B];
+        VM_NEXT();
+    VM_OP(MOV)
+        R[I->A] = R[I->B];
+        VM_NEXT();
+    VM_OP(ADD)
+        R[I->A] = R[I->B] + R[I->C];
+        VM_NEXT();
+    VM_OP(SUB)
+        R[I->A] = R[I->B] - R[I->C];
+        VM_NEXT();
+    VM_OP(MUL)
+        R[I->A] = R[I->B] * R[I->C];
+        VM_NEXT();
+    VM_OP(LT)
+        R[I->A] = R[I->B] < R[I->C] ? 1.0 : 0.0;
+        VM_NEXT();
+    VM_OP(JMP)
+        PC = F->Code.data() + JumpTarget(*I);
+        VM_NEXT();
+    VM_OP(JMPF)
+        if (!IsTrue(R[I->A]))
+            PC = F->Code.data() + JumpTarget(*I);
+        VM_NEXT();
+    VM_OP(JNLT)
+        if (!(R[I->A] < R[I->B]))
+            PC = F->Code.data() + JumpTarget(*I);
+        VM_NEXT();
+    VM_OP(TCALL)
+        Tail = true;
+        goto vm_call;
+    VM_OP(CALL)
+        Tail = false;
+    vm_call: {
+        FunctionSlot *Slot = F->CalleeSlots[I->B];
+        BytecodeFunction *Callee = Slot->BC.get();
+        if (!Callee && Slot->Extern) {
+            if (Slot->ExternArity != I->N)
+                return VMError("Incorrect # arguments passed");
+            R[I->A] = CallNative(Slot->Extern, R + I->C, I->N);
+            VM_NEXT();
+        }
+        if (!Callee)
+            return VMError(ExternProtos.count(Slot->Name) ? "extern function has no implementation" : "Unknown function referenced");
+        if (Callee->NumParams != I->N)
+            return VMError("Incorrect # arguments passed");
+#if LAP_NATIVE
+        // promoted: the native code counts the call itself (see RunTiered)
+        void *Code = Callee->NativeEntry.load(std::memory_order_acquire);
+        if (Code && I->N <= 8) {
+            R[I->A] = CallNative(Code, R + I->C, I->N);
+            VM_NEXT();
+        }
+#endif
+        MemoTable *Memo = ActiveMemo(*Slot);
+        if (Memo && Memo->lookup(R + I->C, R[I->A]))
+            VM_NEXT();
+        if (++Callee->Calls == TierThreshold)
+            RequestTierUp(*Slot);
+
+        // the frame can't be reused while a memo table still needs this function's arguments for its
+        // RET, but the callee's table can take its place
+        if (Tail && !(VMFrames.empty() ? Memo : VMFrames.back().Memo)) {
+            if (R + Callee->NumRegs > Limit)
+                return VMError("call stack overflow");
+            std::copy(R + I->C, R + I->C + I->N, R);
+            if (!VMFrames.empty())
+                VMFrames.back().Memo = Memo;
+            ++EvalCalls;
+            F = Callee;
+            PC = F->Code.data();
+            K = F->Consts.data();
+            VM_NEXT();
+        }
+
+        double *NewR = R + I->C;
+        if (NewR + Callee->NumRegs > Limit || VMFrames.size() >= VMMaxFrames)
+            return VMError("call stack overflow");
+
+        VMFrames.push_back({F, PC, R, Memo});
+        ++EvalCalls;
+        F = Callee;
+        R = NewR;
+        PC = F->Code.data();
+        K = F->Consts.data();
+        VM_NEXT();
+    }
+    VM_OP(RET) {
+        double V = R[I->A];
+        if (VMFrames.empty()) {
+            Result = V;
+            return true;
+        }
+        const VMFrame &Caller = VMFrames.back();
+        if (Caller.Memo)
+            Caller.Memo->insert(R, V); // parameters are never written, so R still holds the arguments
+        F = Caller.F;
+        PC = Caller.PC;
+        R = Caller.Regs;
+        VMFrames.pop_back();
+        K = F->Consts.data();
+        R[PC[-1].A] = V; // PC[-1] is the CALL (or a TCALL that couldn't reuse the frame)
+        VM_NEXT();
+    }
+
+#if !LAP_COMPUTED_GOTO
+        }
+    }
+#endif
+#undef VM_OP
+#undef VM_NEXT
+}
+
+// -----------------------------------=======
+//            End Bytecode VM
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            Native Code
+// -----------------------------------=======
+
+/*
+ * --engine=jit compiles bytecode to x86-64 machine code. Every definition becomes a real function with
+ * the System V calling convention, double f(double, ...): the first 8 arguments arrive in xmm0-xmm7, the
+ * rest on the stack, the result goes back in xmm0. So FunctionSlot::Code can be cast to a function
+ * pointer and called from C++ like any other function.
+ *
+ * Every bytecode register has a stack slot at [rbp - 8 * (Reg + 1)], but it only lives there where the
+ * register allocator (see AllocateXmm) couldn't give it an xmm register. Instructions work on the xmm
+ * registers directly, with a memory operand or xmm15 for whatever is in a slot.
+ *
+ * Calls go through the callee's FunctionSlot::Entry, which starts out pointing at the resolve stub.
+ * The first call through it compiles the callee (NativeResolve), patches Entry to the new code and
+ * jumps on, so a function is only compiled once it's called and callers never need patching, not even
+ * for a callee that was defined after them.
+ *
+ * Code pages are never writable and executable at once: a function is written into a fresh RW mapping
+ * which is then made RX, and it is never written again (it is unmapped when its definition is
+ * replaced, see RetireNativeCode).
+ *
+ * Errors (unknown callee, wrong argument count, too deep recursion) call NativeFail, which longjmps back
+ * to RunNative. Compiled code keeps no state that would need unwinding, so that's safe.
+ */
+
+/// XmmAllocate / RegAllocReport -- --regalloc=spill turns the register allocator off, --regalloc-stats
+/// reports on it at exit
+static bool XmmAllocate = true;
+static bool RegAllocReport = false;
+
+#if LAP_NATIVE
+
+/// NativeFunction -- the machine code for a top-level expression
+struct NativeFunction {
+    void *Code = nullptr;
+    size_t MappedSize = 0;
+
+    NativeFunction() = default;
+    NativeFunction(const NativeFunction &) = delete;
+    NativeFunction &operator=(const NativeFunction &) = delete;
+    ~NativeFunction() {
+        if (Code)
+            munmap(Code, MappedSize);
+    }
+};
+
+/// NativeRuntime -- the state compiled code touches, at an address baked into it
+struct NativeRuntime {
+    uint64_t Calls;       // incremented in every prologue, added to EvalCalls by RunNative
+    uintptr_t StackLimit; // a prologue that leaves rsp below this fails with "call stack overflow"
+};
+static NativeRuntime Native;
+
+/// NativeStackBudget -- how much native stack compiled code may use. The main thread normally has 8MB.
+static const uintptr_t NativeStackBudget = 4 << 20;
+
+enum NativeError : uint32_t {
+    NE_StackOverflow,
+    NE_UnknownFunction,
+    NE_NoImplementation,
+    NE_WrongArgCount,
+    NE_NoMemory,
+    NE_Count,
+};
+
+static const char *NativeErrorMessage(uint32_t Code) {
+    switch (Code) {
+        case NE_StackOverflow: return "call stack overflow";
+        case NE_UnknownFunction: return "Unknown function referenced";
+        case NE_NoImplementation: return "extern function has no implementation";
+        case NE_WrongArgCount: return "Incorrect # arguments passed";
+        case NE_NoMemory: return "could not allocate executable memory";
+    }
+    return "native code failed";
+}
+
+static jmp_buf *NativeErrorJump = nullptr; // set while RunNative or RunTiered is running
+static uint32_t NativeErrorCode = 0;
+
+[[noreturn]] static void NativeFail(uint32_t Code) {
+    if (!NativeErrorJump) {
+        // called straight through a function pointer, there's nobody to report to
+        fprintf(stderr, "Error: %s\n", NativeErrorMessage(Code));
+        abort();
+    }
+    NativeErrorCode = Code;
+    longjmp(*NativeErrorJump, 1);
+}
+
+/*
+ * Machine code peephole rules. The code generator emits each bytecode instruction on its own, so one
+ * ends storing a register to its slot and the next loads it right back, a constant goes through rax
+ * into one register after another, and so on. The rules see the loads, stores and copies (X86Move) as
+ * they are emitted, with the moves emitted just before them that nothing else has come between: a
+ * rule can change the new move, drop it, or take back the one before. The code generator marks every
+ * branch target as a label, which starts the window afresh.
+ */
+
+/// X86Rax -- rax in an X86Move, next to xmm0-xmm15
+static const unsigned X86Rax = 16;
+
+/// X86Move -- a load from a slot, store to a slot, register copy or constant into rax
+struct X86Move {
+    enum MoveKind : uint8_t { None, Load, Store, Copy, Imm } Kind; // None: dropped by a rule
+    unsigned Dst, Src; // Load, Copy and Imm write Dst, Store and Copy read Src
+    int32_t Disp;      // a Load's or Store's [rbp + Disp]
+    uint64_t Bits;     // an Imm's
+    size_t Start, End; // its bytes, once emitted
+};
+
+/// StoreReload -- a load from the slot just stored to: copy the register that was stored instead
+static bool StoreReload(std::vector<X86Move> &Recent, X86Move &New) {
+    if (New.Kind != X86Move::Load || Recent.empty() || Recent.back().Kind != X86Move::Store ||
+        Recent.back().Disp != New.Disp)
+        return false;
+    New.Kind = New.Dst == Recent.back().Src ? X86Move::None : X86Move::Copy;
+    New.Src = Recent.back().Src;
+    return true;
+}
+
+/// Reload -- a load from the slot just loaded from
+static bool Reload(std::vector<X86Move> &Recent, X86Move &New) {
+    if (New.Kind != X86Move::Load || Recent.empty() || Recent.back().Kind != X86Move::Load ||
+        Recent.back().Disp != New.Disp)
+        return false;
+    New.Kind = New.Dst == Recent.back().Dst ? X86Move::None : X86Move::Copy;
+    New.Src = Recent.back().Dst;
+    return true;
+}
+
+/// DeadStore -- a store to the slot just stored to makes that one pointless
+static bool DeadStore(std::vector<X86Move> &Recent, X86Move &New) {
+    if (New.Kind != X86Move::Store || Recent.empty() || Recent.back().Kind != X86Move::Store ||
+        Recent.back().Disp != New.Disp)
+        return false;
+    Recent.pop_back();
+    return true;
+}
+
+/// SelfCopy / CopyBack -- a copy to itself, or back to where it just came from
+static bool SelfCopy(std::vector<X86Move> &, X86Move &New) {
+    if (New.Kind != X86Move::Copy || New.Dst != New.Src)
+        return false;
+    New.Kind = X86Move::None;
+    return true;
+}
+
+static bool CopyBack(std::vector<X86Move> &Recent, X86Move &New) {
+    if (New.Kind != X86Move::Copy || Recent.empty() || Recent.back().Kind != X86Move::Copy ||
+        Recent.back().Dst != New.Src || Recent.back().Src != New.Dst)
+        return false;
+    New.Kind = X86Move::None;
+    return true;
+}
+
+/// ConstantReload -- the constant rax still has from a few moves back
+static bool ConstantReload(std::vector<X86Move> &Recent, X86Move &New) {
+    if (New.Kind != X86Move::Imm)
+        return false;
+    for (size_t i = Recent.size(); i-- > 0;) {
+        const X86Move &M = Recent[i];
+        if (M.Kind == X86Move::Store || M.Dst != X86Rax)
+            continue;
+        if (M.Kind != X86Move::Imm || M.Bits != New.Bits)
+            return false;
+        New.Kind = X86Move::None;
+        return true;
+    }
+    return false;
+}
+
+/// X86Rule -- one machine code rule and how often it has fired
+struct X86Rule {
+    const char *Name;
+    bool (*Apply)(std::vector<X86Move> &Recent, X86Move &New);
+    std::atomic<uint64_t> Fired{0};
+};
+
+static X86Rule X86Rules[] = {
+    {"store-reload", StoreReload},
+    {"reload", Reload},
+    {"dead-store", DeadStore},
+    {"self-copy", SelfCopy},
+    {"copy-back", CopyBack},
+    {"const-reload", ConstantReload},
+};
+
+/// X86Emitter -- just the instructions the code generator needs. Memory operands are all [rbp + disp32],
+/// and the only REX prefixes are for the 64 bit integer moves and xmm8-xmm15.
+class X86Emitter {
+    std::vector<X86Move> Recent; // the peephole window, see X86Rules
+
+public:
+    std::vector<uint8_t> Bytes;
+
+    size_t size() const { return Bytes.size(); }
+
+    void byte(uint8_t B) { Bytes.push_back(B); }
+    void bytes(std::initializer_list<uint8_t> Bs) { Bytes.insert(Bytes.end(), Bs); }
+    void u32(uint32_t V) {
+        for (int i = 0; i < 4; ++i)
+            byte((uint8_t)(V >> (8 * i)));
+    }
+    void u64(uint64_t V) {
+        for (int i = 0; i < 8; ++i)
+            byte((uint8_t)(V >> (8 * i)));
+    }
+
+    static int32_t slot(unsigned Reg) { return -8 * ((int32_t)Reg + 1); }
+
+    // mod=10 r/m=rbp: [rbp + disp32]
+    void rbpOperand(unsigned RegField, int32_t Disp) {
+        byte((uint8_t)(0x80 | (RegField << 3) | 5));
+        u32((uint32_t)Disp);
+    }
+    void sse(uint8_t Prefix, uint8_t Op, unsigned Xmm, int32_t Disp) {
+        byte(Prefix);
+        if (Xmm >= 8)
+            byte(0x44);
+        bytes({0x0F, Op});
+        rbpOperand(Xmm & 7, Disp);
+    }
+    void sseReg(uint8_t Prefix, uint8_t Op, unsigned Dst, unsigned Src) {
+        byte(Prefix);
+        if (Dst >= 8 || Src >= 8)
+            byte((uint8_t)(0x40 | (Dst >= 8 ? 4 : 0) | (Src >= 8 ? 1 : 0)));
+        bytes({0x0F, Op, (uint8_t)(0xC0 | ((Dst & 7) << 3) | (Src & 7))});
+    }
+
+    /// move -- emit M, or what the peephole rules make of it
+    void move(X86Move M) {
+        if (!Recent.empty() && Recent.back().End != size())
+            Recent.clear();
+        size_t WindowStart = Recent.empty() ? size() : Recent.front().Start;
+        for (X86Rule &Rule : X86Rules) {
+            if (Peephole && Rule.Apply(Recent, M)) {
+                Rule.Fired.fetch_add(1, std::memory_order_relaxed);
+                break;
+            }
+        }
+        Bytes.resize(Recent.empty() ? WindowStart : Recent.back().End);
+
+        M.Start = size();
+        switch (M.Kind) {
+            case X86Move::None:
+                return;
+            case X86Move::Load:
+                if (M.Dst == X86Rax) {
+                    bytes({0x48, 0x8B});
+                    rbpOperand(0, M.Disp);
+                } else {
+                    sse(0xF2, 0x10, M.Dst, M.Disp);
+                }
+                break;
+            case X86Move::Store:
+                if (M.Src == X86Rax) {
+                    bytes({0x48, 0x89});
+                    rbpOperand(0, M.Disp);
+                } else {
+                    sse(0xF2, 0x11, M.Src, M.Disp);
+                }
+                break;
+            case X86Move::Copy:
+                if (M.Dst == X86Rax && M.Src == X86Rax)
+                    return;
+                if (M.Dst == X86Rax) // movq rax, xmm
+                    bytes({0x66, (uint8_t)(M.Src >= 8 ? 0x4C : 0x48), 0x0F, 0x7E, (uint8_t)(0xC0 | ((M.Src & 7) << 3))});
+                else if (M.Src == X86Rax) // movq xmm, rax
+                    bytes({0x66, (uint8_t)(M.Dst >= 8 ? 0x4C : 0x48), 0x0F, 0x6E, (uint8_t)(0xC0 | ((M.Dst & 7) << 3))});
+                else
+                    sseReg(0x66, 0x28, M.Dst, M.Src); // movapd
+                break;
+            case X86Move::Imm:
+                bytes({0x48, 0xB8});
+                u64(M.Bits);
+                break;
+        }
+        M.End = size();
+        if (Recent.size() == 4)
+            Recent.erase(Recent.begin());
+        Recent.push_back(M);
+    }
+
+    /// label -- a branch target is here, what came before may not have happened
+    void label() { Recent.clear(); }
+
+    void movsdLoad(unsigned Xmm, int32_t Disp) { move({X86Move::Load, Xmm, 0, Disp, 0, 0, 0}); }
+    void movsdStore(int32_t Disp, unsigned Xmm) { move({X86Move::Store, 0, Xmm, Disp, 0, 0, 0}); }
+    void addsd(unsigned Xmm, int32_t Disp) { sse(0xF2, 0x58, Xmm, Disp); }
+    void mulsd(unsigned Xmm, int32_t Disp) { sse(0xF2, 0x59, Xmm, Disp); }
+    void subsd(unsigned Xmm, int32_t Disp) { sse(0xF2, 0x5C, Xmm, Disp); }
+    void ucomisd(unsigned Xmm, int32_t Disp) { sse(0x66, 0x2E, Xmm, Disp); }
+    void movapd(unsigned Dst, unsigned Src) { move({X86Move::Copy, Dst, Src, 0, 0, 0, 0}); }
+    void addsdReg(unsigned Dst, unsigned Src) { sseReg(0xF2, 0x58, Dst, Src); }
+    void mulsdReg(unsigned Dst, unsigned Src) { sseReg(0xF2, 0x59, Dst, Src); }
+    void subsdReg(unsigned Dst, unsigned Src) { sseReg(0xF2, 0x5C, Dst, Src); }
+    void xorpd(unsigned Dst, unsigned Src) { sseReg(0x66, 0x57, Dst, Src); }
+    void ucomisdReg(unsigned A, unsigned B) { sseReg(0x66, 0x2E, A, B); }
+    void cvtsi2sdEax(unsigned Xmm) { sseReg(0xF2, 0x2A, Xmm, 0); }
+    void movqXmmRax(unsigned Xmm) { move({X86Move::Copy, Xmm, X86Rax, 0, 0, 0, 0}); }
+    void movqRaxXmm(unsigned Xmm) { move({X86Move::Copy, X86Rax, Xmm, 0, 0, 0, 0}); }
+    void setaMovzxEax() { bytes({0x0F, 0x97, 0xC0, 0x0F, 0xB6, 0xC0}); }
+
+    void movRaxImm(uint64_t V) { move({X86Move::Imm, X86Rax, 0, 0, V, 0, 0}); }
+    void movRaxLoad(int32_t Disp) { move({X86Move::Load, X86Rax, 0, Disp, 0, 0, 0}); }
+    void movRaxStore(int32_t Disp) { move({X86Move::Store, 0, X86Rax, Disp, 0, 0, 0}); }
+    void movEdiImm(uint32_t V) { byte(0xBF); u32(V); }
+    void pushRax() { byte(0x50); }
+    void subRsp(uint32_t V) { bytes({0x48, 0x81, 0xEC}); u32(V); }
+    void addRsp(uint32_t V) { bytes({0x48, 0x81, 0xC4}); u32(V); }
+    void callRax() { bytes({0xFF, 0xD0}); }
+    size_t callRel() { byte(0xE8); u32(0); return size() - 4; } // returns where the rel32 is
+    void ud2() { bytes({0x0F, 0x0B}); }
+    void callMemRax() { bytes({0xFF, 0x10}); }
+    void movEdiRax8() { bytes({0x8B, 0x78, 0x08}); } // mov edi, [rax + 8]
+    void movRdiImm(uint64_t V) { bytes({0x48, 0xBF}); u64(V); }
+    void movRsiRbp() { bytes({0x48, 0x89, 0xEE}); }
+    void testEax() { bytes({0x85, 0xC0}); }
+    void movsdLoadRax(unsigned Xmm) { bytes({0xF2, 0x0F, 0x10, (uint8_t)(Xmm << 3)}); } // movsd xmm, [rax]
+    void movR11Rax() { bytes({0x49, 0x89, 0xC3}); }
+    void jmpR11() { bytes({0x41, 0xFF, 0xE3}); }
+
+    void prologue() { bytes({0x55, 0x48, 0x89, 0xE5}); } // push rbp; mov rbp, rsp
+    void epilogue() { bytes({0xC9, 0xC3}); }             // leave; ret
+    void leaveJmpMemRax() { bytes({0xC9, 0xFF, 0x20}); } // leave; jmp [rax]
+
+    // rel32 branches return where their displacement is, for patch()
+    size_t jmp() { byte(0xE9); u32(0); return size() - 4; }
+    size_t jcc(uint8_t Cond) { bytes({0x0F, Cond}); u32(0); return size() - 4; }
+    void patch(size_t At, size_t Target) {
+        uint32_t Rel = (uint32_t)((int64_t)Target - (int64_t)(At + 4));
+        memcpy(&Bytes[At], &Rel, 4);
+    }
+
+    static const uint8_t CondBelow = 0x82, CondEqual = 0x84, CondBelowEqual = 0x86;
+};
+
+/// BindArity -- record the argument count a caller being compiled assumes Slot's function has
+static void BindArity(FunctionSlot &Slot, unsigned Arity) {
+    if (Slot.BoundArity == -1)
+        Slot.BoundArity = (int)Arity;
+    else if (Slot.BoundArity != (int)Arity)
+        Slot.BoundArity = -2;
+}
+
+/// MemoLookupNative / MemoInsertNative -- the memoization hooks compiled code calls, with its rbp. The
+/// parameters are at rbp - 8 * (i + 1), where the prologue put them.
+static int MemoLookupNative(MemoTable *T, const char *Rbp) {
+    double Args[MaxCallArgs];
+    for (unsigned i = 0; i < T->arity(); ++i)
+        memcpy(&Args[i], Rbp - 8 * (i + 1), 8);
+    return T->Enabled && T->lookup(Args, T->LastHit);
+}
+
+static double MemoInsertNative(MemoTable *T, const char *Rbp, double Result) {
+    double Args[MaxCallArgs];
+    for (unsigned i = 0; i < T->arity(); ++i)
+        memcpy(&Args[i], Rbp - 8 * (i + 1), 8);
+    if (T->Enabled)
+        T->insert(Args, Result);
+    return Result;
+}
+
+/*
+ * Register allocation. Bytecode registers live in xmm registers wherever they can, and only what
+ * doesn't fit goes to its stack slot; --regalloc=spill keeps every register in its slot all the time
+ * instead, the way this code generator started out, to measure against.
+ *
+ * Liveness is one backward pass over the instructions, which is exact since bytecode only jumps
+ * forward. A register's live range, from the first point where it's live to the last, is split at
+ * every call: the calling convention has no callee saved xmm registers, so nothing could stay in one
+ * across a call anyway. A linear scan then gives each piece a register, or, when all are taken, spills
+ * whichever piece ends last to the stack slot. xmm15 is never allocated, it's the scratch register
+ * for results going to a slot and for breaking cycles of moves.
+ *
+ * A call stores the values that live across it to their slots first, unless the slot has the value
+ * already (see XmmPiece::Clean), and loads them back into the registers of their next pieces after.
+ * A jump over a call leaves one piece for another without either, so its edge gets the moves between
+ * the two.
+ */
+
+static const int XmmInMemory = -1;
+static const unsigned XmmScratch = 15;
+static const uint64_t XmmMaxLiveBits = 1ull << 26; // instructions times registers, bigger stays in slots
+
+/// XmmPiece -- a register's live range between two calls, from point Start to point End. Point 2p is
+/// instruction p reading its operands, 2p + 1 it writing its result.
+struct XmmPiece {
+    unsigned Reg, Start, End;
+    int Loc = XmmInMemory;
+    int Hint = -1;      // the xmm register it's wanted in: a parameter's, a call result's or argument's
+    bool Clean = false; // the slot has the value throughout, a call needn't store it
+};
+
+/// XmmAllocation -- where F's registers are at each point. Empty (everything in its slot) if
+/// allocation is off or F isn't one it can do.
+struct XmmAllocation {
+    unsigned Words = 0;           // in a live set
+    std::vector<uint64_t> LiveIn; // a live set per instruction
+    std::vector<XmmPiece> Pieces;
+    std::vector<std::vector<unsigned>> ByReg; // each register's pieces, in order
+
+    bool empty() const { return Pieces.empty(); }
+
+    template <typename Fn>
+    void forEachLiveIn(size_t PC, Fn &&Visit) const {
+        if (PC * Words >= LiveIn.size())
+            return;
+        for (unsigned w = 0; w < Words; ++w)
+            for (uint64_t Bits = LiveIn[PC * Words + w]; Bits; Bits &= Bits - 1)
+                Visit(64 * w + (unsigned)__builtin_ctzll(Bits));
+    }
+
+    const XmmPiece *piece(unsigned Reg, unsigned Point) const {
+        if (Reg < ByReg.size())
+            for (unsigned i : ByReg[Reg])
+                if (Pieces[i].Start <= Point && Point <= Pieces[i].End)
+                    return &Pieces[i];
+        return nullptr;
+    }
+
+    int loc(unsigned Reg, unsigned Point) const {
+        const XmmPiece *P = piece(Reg, Point);
+        return P ? P->Loc : XmmInMemory;
+    }
+};
+
+/// RegAllocStats -- totals for --regalloc-stats. Only changed with DefinitionsLock held.
+static struct {
+    uint64_t Functions, CodeBytes, Pieces, InRegisters, Stores, Loads, Copies;
+} RegAllocStats;
+
+/// AllocateXmm -- liveness, live range splitting and the linear scan for F. With a Memo every
+/// parameter is in its slot from the prologue on.
+static void AllocateXmm(const BytecodeFunction &F, bool Memo, XmmAllocation &RA) {
+    size_t N = F.Code.size();
+    if (!XmmAllocate || !F.NumRegs || (uint64_t)N * F.NumRegs > XmmMaxLiveBits)
+        return;
+    for (size_t PC = 0; PC < N; ++PC)
+        if (IsJump(F.Code[PC].Op) && JumpTarget(F.Code[PC]) <= PC)
+            return;
+
+    unsigned W = RA.Words = (F.NumRegs + 63) / 64;
+    RA.LiveIn.assign(N * W, 0);
+    std::vector<unsigned> Lo(F.NumRegs, ~0u), Hi(F.NumRegs, 0);
+    std::vector<std::vector<unsigned>> Defs(F.NumRegs);
+    std::vector<unsigned> Calls;
+    std::vector<uint64_t> Live(W);
+    auto Extend = [&](unsigned R, unsigned Point) {
+        Lo[R] = std::min(Lo[R], Point);
+        Hi[R] = std::max(Hi[R], Point);
+    };
+    auto ExtendLive = [&](unsigned Point) {
+        for (unsigned w = 0; w < W; ++w)
+            for (uint64_t Bits = Live[w]; Bits; Bits &= Bits - 1)
+                Extend(64 * w + (unsigned)__builtin_ctzll(Bits), Point);
+    };
+    auto Set = [&](unsigned R, bool On) {
+        if (On)
+            Live[R / 64] |= 1ull << (R % 64);
+        else
+            Live[R / 64] &= ~(1ull << (R % 64));
+    };
+
+    for (size_t PC = N; PC-- > 0;) {
+        const Instr &I = F.Code[PC];
+        std::fill(Live.begin(), Live.end(), 0);
+        ForEachSuccessor(F, PC, [&](size_t Succ) {
+            for (unsigned w = 0; Succ < N && w < W; ++w)
+                Live[w] |= RA.LiveIn[Succ * W + w];
+        });
+
+        ExtendLive(2 * (unsigned)PC + 1);
+        switch (I.Op) {
+            case OP_CALL:
+            case OP_TCALL:
+                Calls.push_back((unsigned)PC);
+                for (unsigned k = 0; k < I.N; ++k)
+                    Set(I.C + k, true);
+                // fall through
+            case OP_LOADK:
+            case OP_MOV:
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_LT:
+                Extend(I.A, 2 * (unsigned)PC + 1);
+                Defs[I.A].push_back((unsigned)PC);
+                if (!(I.Op == OP_CALL || I.Op == OP_TCALL) || I.A < I.C || I.A >= I.C + I.N)
+                    Set(I.A, false);
+                if (I.Op == OP_MOV || (I.Op >= OP_ADD && I.Op <= OP_LT))
+                    Set(I.B, true);
+                if (I.Op >= OP_ADD && I.Op <= OP_LT)
+                    Set(I.C, true);
+                break;
+            case OP_RET:
+            case OP_JMPF:
+                Set(I.A, true);
+                break;
+            case OP_JNLT:
+                Set(I.A, true);
+                Set(I.B, true);
+                break;
+            case OP_JMP:
+                break;
+        }
+        std::copy(Live.begin(), Live.end(), RA.LiveIn.begin() + PC * W);
+        ExtendLive(2 * (unsigned)PC);
+    }
+    std::reverse(Calls.begin(), Calls.end());
+
+    auto IsCall = [&](unsigned PC) { return F.Code[PC].Op == OP_CALL || F.Code[PC].Op == OP_TCALL; };
+    RA.ByReg.resize(F.NumRegs);
+    auto AddPiece = [&](unsigned R, unsigned Start, unsigned End) {
+        XmmPiece P;
+        P.Reg = R;
+        P.Start = Start;
+        P.End = End;
+        unsigned Before = Start / 2, After = End / 2;
+        bool Reloaded = Start % 2 && IsCall(Before) && F.Code[Before].A != R;
+        if (Start % 2 && IsCall(Before) && F.Code[Before].A == R)
+            P.Hint = 0;
+        else if (Start == 0 && R < F.NumParams && R < 8)
+            P.Hint = (int)R;
+        else if (End % 2 == 0 && IsCall(After) && R >= F.Code[After].C && R - F.Code[After].C < 8)
+            P.Hint = (int)(R - F.Code[After].C);
+        else if (End % 2 == 0 && F.Code[After].Op == OP_RET)
+            P.Hint = 0;
+        P.Clean = Memo && R < F.NumParams;
+        if (Reloaded) {
+            P.Clean = true;
+            for (unsigned D : Defs[R])
+                if (Start < 2 * D + 1 && 2 * D + 1 <= End)
+                    P.Clean = false;
+        }
+        RA.ByReg[R].push_back((unsigned)RA.Pieces.size());
+        RA.Pieces.push_back(P);
+    };
+    for (unsigned R = 0; R < F.NumRegs; ++R) {
+        if (Lo[R] > Hi[R])
+            continue;
+        unsigned Start = Lo[R];
+        for (auto It = std::lower_bound(Calls.begin(), Calls.end(), Start / 2); It != Calls.end() && 2 * *It + 1 <= Hi[R]; ++It) {
+            if (2 * *It < Start)
+                continue;
+            AddPiece(R, Start, 2 * *It);
+            Start = 2 * *It + 1;
+        }
+        AddPiece(R, Start, Hi[R]);
+    }
+
+    std::vector<unsigned> Order(RA.Pieces.size());
+    for (unsigned i = 0; i < Order.size(); ++i)
+        Order[i] = i;
+    std::stable_sort(Order.begin(), Order.end(), [&](unsigned A, unsigned B) { return RA.Pieces[A].Start < RA.Pieces[B].Start; });
+    std::vector<unsigned> Active;
+    uint32_t Free = (1u << XmmScratch) - 1;
+    for (unsigned i : Order) {
+        XmmPiece &P = RA.Pieces[i];
+        for (size_t a = 0; a < Active.size();) {
+            XmmPiece &Q = RA.Pieces[Active[a]];
+            if (Q.End < P.Start) {
+                Free |= 1u << Q.Loc;
+                Active[a] = Active.back();
+                Active.pop_back();
+            } else {
+                ++a;
+            }
+        }
+        if (Free) {
+            P.Loc = P.Hint >= 0 && (Free >> P.Hint & 1) ? P.Hint : __builtin_ctz(Free);
+            Free &= ~(1u << P.Loc);
+            Active.push_back(i);
+            continue;
+        }
+        size_t Victim = 0;
+        for (size_t a = 1; a < Active.size(); ++a)
+            if (RA.Pieces[Active[a]].End > RA.Pieces[Active[Victim]].End)
+                Victim = a;
+        XmmPiece &V = RA.Pieces[Active[Victim]];
+        if (V.End > P.End) {
+            P.Loc = V.Loc;
+            V.Loc = XmmInMemory;
+            Active[Victim] = i;
+        }
+    }
+
+    ++RegAllocStats.Functions;
+    RegAllocStats.Pieces += RA.Pieces.size();
+    for (const XmmPiece &P : RA.Pieces)
+        RegAllocStats.InRegisters += P.Loc != XmmInMemory;
+}
+
+/// XmmMoves -- moves that happen at once: stores to slots, then xmm to xmm copies, then loads from
+/// slots, so that nothing is overwritten before it's read. A cycle of copies goes through XmmScratch.
+struct XmmMoves {
+    std::vector<std::pair<int32_t, unsigned>> Stores; // to a slot, from an xmm register
+    std::vector<std::pair<unsigned, unsigned>> Copies; // to, from
+    std::vector<std::pair<unsigned, int32_t>> Loads;  // to an xmm register, from a slot
+
+    bool empty() const { return Stores.empty() && Copies.empty() && Loads.empty(); }
+
+    /// move -- Reg, at From, to To
+    void move(unsigned Reg, int From, int To) {
+        if (To == XmmInMemory) {
+            if (From != XmmInMemory)
+                Stores.push_back({X86Emitter::slot(Reg), (unsigned)From});
+        } else if (From == XmmInMemory) {
+            Loads.push_back({(unsigned)To, X86Emitter::slot(Reg)});
+        } else if (From != To) {
+            Copies.push_back({(unsigned)To, (unsigned)From});
+        }
+    }
+
+    void emit(X86Emitter &X) {
+        for (auto &S : Stores)
+            X.movsdStore(S.first, S.second);
+        RegAllocStats.Stores += Stores.size();
+        RegAllocStats.Copies += Copies.size();
+        while (!Copies.empty()) {
+            bool Progress = false;
+            for (size_t i = 0; i < Copies.size();) {
+                unsigned To = Copies[i].first;
+                bool Read = false;
+                for (size_t j = 0; j < Copies.size(); ++j)
+                    Read |= j != i && Copies[j].second == To;
+                if (Read) {
+                    ++i;
+                    continue;
+                }
+                X.movapd(To, Copies[i].second);
+                Copies.erase(Copies.begin() + i);
+                Progress = true;
+            }
+            if (!Progress) { // only cycles are left
+                unsigned From = Copies[0].second;
+                X.movapd(XmmScratch, From);
+                for (auto &C : Copies)
+                    if (C.second == From)
+                        C.second = XmmScratch;
+            }
+        }
+        for (auto &L : Loads)
+            X.movsdLoad(L.first, L.second);
+        RegAllocStats.Loads += Loads.size();
+    }
+};
+
+/// NativeReloc -- a rel32 in code for an object file that the linker fills in with Symbol's address,
+/// with ELF relocation type Type
+struct NativeReloc {
+    size_t At;
+    std::string Symbol;
+    uint32_t Type;
+};
+
+/// GenerateNative -- machine code for F. If Pending isn't null, callees that are defined but not compiled
+/// yet go on it. With a Memo the code looks its arguments up first and records its result.
+/// With Relocs it's code for an object file instead (see Object Files): calls go straight to the
+/// callee's symbol, there's no call counting or stack check, and the error stubs trap.
+static void GenerateNative(const BytecodeFunction &F, X86Emitter &X, std::vector<FunctionSlot *> *Pending,
+                           MemoTable *Memo, std::vector<NativeReloc> *Relocs = nullptr) {
+    size_t ErrorJumps[NE_Count];
+    std::vector<size_t> ErrorFixups[NE_Count];
+    size_t CodeStart = X.size();
+    XmmAllocation RA;
+    AllocateXmm(F, Memo != nullptr, RA);
+    auto Slot = [](unsigned Reg) { return X86Emitter::slot(Reg); };
+
+    X.prologue();
+    uint32_t FrameSize = (8 * F.NumRegs + 15) & ~15u; // keeps rsp 16 byte aligned for calls
+    if (FrameSize)
+        X.subRsp(FrameSize);
+    if (!Relocs) {
+        X.movRaxImm((uint64_t)(uintptr_t)&Native);
+        X.bytes({0x48, 0xFF, 0x00});       // inc qword [rax]
+        X.bytes({0x48, 0x3B, 0x60, 0x08}); // cmp rsp, [rax + 8]
+        ErrorFixups[NE_StackOverflow].push_back(X.jcc(X86Emitter::CondBelow));
+    }
+
+    // the parameters go where they're allocated, with a Memo through their slots
+    XmmMoves Params;
+    for (unsigned i = 0; i < F.NumParams; ++i) {
+        int To = Memo ? XmmInMemory : RA.loc(i, 0);
+        if (i < 8) {
+            Params.move(i, (int)i, To);
+        } else if (To == XmmInMemory) {
+            X.movRaxLoad(16 + 8 * (int32_t)(i - 8));
+            X.movRaxStore(Slot(i));
+        } else {
+            Params.Loads.push_back({(unsigned)To, 16 + 8 * (int32_t)(i - 8)});
+        }
+    }
+    Params.emit(X);
+
+    if (Memo) {
+        X.movRdiImm((uint64_t)(uintptr_t)Memo);
+        X.movRsiRbp();
+        X.movRaxImm((uint64_t)(uintptr_t)&MemoLookupNative);
+        X.callRax();
+        X.testEax();
+        size_t Miss = X.jcc(X86Emitter::CondEqual);
+        X.movRaxImm((uint64_t)(uintptr_t)&Memo->LastHit);
+        X.movsdLoadRax(0);
+        X.epilogue();
+        X.patch(Miss, X.size());
+        X.label();
+        XmmMoves Reload;
+        for (unsigned i = 0; i < F.NumParams; ++i)
+            Reload.move(i, XmmInMemory, RA.loc(i, 0));
+        Reload.emit(X);
+    }
+
+    // the moves on the edge from a jump at PC to Target, for what's in another piece there
+    auto EdgeMoves = [&](size_t PC, size_t Target, XmmMoves &M) {
+        RA.forEachLiveIn(Target, [&](unsigned R) {
+            const XmmPiece *From = RA.piece(R, 2 * (unsigned)PC + 1), *To = RA.piece(R, 2 * (unsigned)Target);
+            if (!From || !To || From == To)
+                return;
+            M.move(R, From->Loc, To->Loc);
+            if (To->Clean && !From->Clean && From->Loc != XmmInMemory && To->Loc != XmmInMemory)
+                M.Stores.push_back({Slot(R), (unsigned)From->Loc});
+        });
+    };
+
+    std::vector<size_t> Offsets(F.Code.size());
+    std::vector<std::pair<size_t, uint32_t>> JumpFixups;
+    std::vector<std::pair<size_t, std::pair<uint32_t, XmmMoves>>> EdgeStubs; // for a conditional jump's taken edge
+    std::vector<uint8_t> IsTarget(F.Code.size() + 1, 0);
+    for (const Instr &I : F.Code)
+        if (IsJump(I.Op))
+            IsTarget[JumpTarget(I)] = 1;
+
+    // the jcc for a conditional jump at PC, through a stub for the moves on its edge if there are any
+    auto CondJump = [&](uint8_t Cond, size_t PC, uint32_t Target) {
+        XmmMoves M;
+        EdgeMoves(PC, Target, M);
+        if (M.empty())
+            JumpFixups.push_back({X.jcc(Cond), Target});
+        else
+            EdgeStubs.push_back({X.jcc(Cond), {Target, std::move(M)}});
+    };
+
+    for (size_t PC = 0; PC < F.Code.size(); ++PC) {
+        const Instr &I = F.Code[PC];
+        if (IsTarget[PC])
+            X.label();
+        Offsets[PC] = X.size();
+        unsigned Before = 2 * (unsigned)PC, After = Before + 1;
+        int A = RA.loc(I.A, After), B = RA.loc(I.B, Before), C = RA.loc(I.C, Before);
+        // where an instruction computes its result: its register, or the scratch one on the way to the slot
+        unsigned Dst = A == XmmInMemory ? XmmScratch : (unsigned)A;
+        switch (I.Op) {
+            case OP_LOADK: {
+                uint64_t Bits;
+                memcpy(&Bits, &F.Consts[I.B], 8);
+                if (A != XmmInMemory && !Bits) {
+                    X.xorpd(Dst, Dst);
+                    break;
+                }
+                X.movRaxImm(Bits);
+                if (A == XmmInMemory)
+                    X.movRaxStore(Slot(I.A));
+                else
+                    X.movqXmmRax(Dst);
+                break;
+            }
+            case OP_MOV:
+                if (A == XmmInMemory && B == XmmInMemory) {
+                    X.movRaxLoad(Slot(I.B));
+                    X.movRaxStore(Slot(I.A));
+                } else if (B == XmmInMemory) {
+                    X.movsdLoad(Dst, Slot(I.B));
+                } else if (A == XmmInMemory) {
+                    X.movsdStore(Slot(I.A), (unsigned)B);
+                } else if (A != B) {
+                    X.movapd(Dst, (unsigned)B);
+                }
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+                // always B op C with B the first operand, so a NaN comes out as it does elsewhere
+                if (C != XmmInMemory && (unsigned)C == Dst && B != C)
+                    Dst = XmmScratch;
+                if (B == XmmInMemory)
+                    X.movsdLoad(Dst, Slot(I.B));
+                else if ((unsigned)B != Dst)
+                    X.movapd(Dst, (unsigned)B);
+                if (C == XmmInMemory) {
+                    if (I.Op == OP_ADD)
+                        X.addsd(Dst, Slot(I.C));
+                    else if (I.Op == OP_SUB)
+                        X.subsd(Dst, Slot(I.C));
+                    else
+                        X.mulsd(Dst, Slot(I.C));
+                } else {
+                    if (I.Op == OP_ADD)
+                        X.addsdReg(Dst, (unsigned)C);
+                    else if (I.Op == OP_SUB)
+                        X.subsdReg(Dst, (unsigned)C);
+                    else
+                        X.mulsdReg(Dst, (unsigned)C);
+                }
+                if (A == XmmInMemory)
+                    X.movsdStore(Slot(I.A), Dst);
+                else if ((unsigned)A != Dst)
+                    X.movapd((unsigned)A, Dst);
+                break;
+            case OP_LT: {
+                // C > B is "above" after ucomisd, and false when either is a NaN
+                unsigned CReg = C == XmmInMemory ? XmmScratch : (unsigned)C;
+                if (C == XmmInMemory)
+                    X.movsdLoad(CReg, Slot(I.C));
+                if (B == XmmInMemory)
+                    X.ucomisd(CReg, Slot(I.B));
+                else
+                    X.ucomisdReg(CReg, (unsigned)B);
+                X.setaMovzxEax();
+                X.cvtsi2sdEax(Dst);
+                if (A == XmmInMemory)
+                    X.movsdStore(Slot(I.A), Dst);
+                break;
+            }
+            case OP_JMP: {
+                XmmMoves M;
+                EdgeMoves(PC, JumpTarget(I), M);
+                M.emit(X);
+                JumpFixups.push_back({X.jmp(), JumpTarget(I)});
+                break;
+            }
+            case OP_JMPF: {
+                // equal also covers unordered, so NaNs jump like IsTrue says they should
+                int Cond = RA.loc(I.A, Before);
+                X.xorpd(XmmScratch, XmmScratch);
+                if (Cond == XmmInMemory)
+                    X.ucomisd(XmmScratch, Slot(I.A));
+                else
+                    X.ucomisdReg((unsigned)Cond, XmmScratch);
+                CondJump(X86Emitter::CondEqual, PC, JumpTarget(I));
+                break;
+            }
+            case OP_JNLT: {
+                // as for LT, B > A is "above", so not A < B is "below or equal", NaNs included
+                int L = RA.loc(I.A, Before);
+                unsigned BReg = B == XmmInMemory ? XmmScratch : (unsigned)B;
+                if (B == XmmInMemory)
+                    X.movsdLoad(BReg, Slot(I.B));
+                if (L == XmmInMemory)
+                    X.ucomisd(BReg, Slot(I.A));
+                else
+                    X.ucomisdReg(BReg, (unsigned)L);
+                CondJump(X86Emitter::CondBelowEqual, PC, JumpTarget(I));
+                break;
+            }
+            case OP_CALL:
+            case OP_TCALL: {
+                // a callee that isn't defined yet is called like any other, the resolve stub fails if
+                // it still isn't when the call happens. Object code checks its calls itself, against
+                // the definitions it calls rather than the latest ones (see CheckObjectCalls).
+                FunctionSlot &Callee = *F.CalleeSlots[I.B];
+                if (!Relocs && (Callee.BC || Callee.Extern)) {
+                    unsigned Arity = Callee.BC ? Callee.BC->NumParams : Callee.ExternArity;
+                    if (Arity != I.N) {
+                        BindArity(Callee, Arity);
+                        ErrorFixups[NE_WrongArgCount].push_back(X.jmp());
+                        break;
+                    }
+                }
+                BindArity(Callee, I.N);
+                if (Pending && Callee.BC && !Callee.Code)
+                    Pending->push_back(&Callee);
+
+                XmmMoves Args;
+                for (unsigned Arg = 0; Arg < I.N && Arg < 8; ++Arg)
+                    Args.move(I.C + Arg, RA.loc(I.C + Arg, Before), (int)Arg);
+
+                // a tail call leaves this frame and jumps, the callee returns straight to our caller.
+                // Arguments past the 8th go over our own, which the caller pops, so there must be no more
+                // of them than we got. Otherwise it's a CALL and the code after it returns.
+                unsigned StackArgs = I.N > 8 ? I.N - 8 : 0;
+                if (I.Op == OP_TCALL && !Memo && StackArgs <= (F.NumParams > 8 ? F.NumParams - 8 : 0)) {
+                    for (unsigned Arg = 8; Arg < I.N; ++Arg) {
+                        int From = RA.loc(I.C + Arg, Before);
+                        if (From == XmmInMemory) {
+                            X.movRaxLoad(Slot(I.C + Arg));
+                            X.movRaxStore(16 + 8 * (int32_t)(Arg - 8));
+                        } else {
+                            X.movsdStore(16 + 8 * (int32_t)(Arg - 8), (unsigned)From);
+                        }
+                    }
+                    Args.emit(X);
+                    if (Relocs) {
+                        X.byte(0xC9); // leave
+                        Relocs->push_back({X.jmp(), Callee.Name, R_X86_64_PLT32});
+                    } else {
+                        X.movRaxImm((uint64_t)(uintptr_t)&Callee.Entry.Code);
+                        X.leaveJmpMemRax();
+                    }
+                    break;
+                }
+
+                // every xmm register is caller saved: what lives across the call goes to its slot first
+                XmmMoves Save, Restore;
+                RA.forEachLiveIn(PC + 1, [&](unsigned R) {
+                    const XmmPiece *From = RA.piece(R, Before), *To = RA.piece(R, After);
+                    if (R == I.A || !From || !To)
+                        return;
+                    if (From->Loc != XmmInMemory && !From->Clean)
+                        Save.Stores.push_back({Slot(R), (unsigned)From->Loc});
+                    if (To->Loc != XmmInMemory)
+                        Restore.Loads.push_back({(unsigned)To->Loc, Slot(R)});
+                });
+                Save.emit(X);
+
+                // arguments past the 8th are pushed last to first, with padding to keep rsp aligned
+                uint32_t Pad = (StackArgs & 1) ? 8 : 0;
+                if (Pad)
+                    X.subRsp(Pad);
+                for (unsigned Arg = I.N; Arg-- > 8;) {
+                    int From = RA.loc(I.C + Arg, Before);
+                    if (From == XmmInMemory)
+                        X.movRaxLoad(Slot(I.C + Arg));
+                    else
+                        X.movqRaxXmm((unsigned)From);
+                    X.pushRax();
+                }
+                Args.emit(X);
+                if (Relocs) {
+                    Relocs->push_back({X.callRel(), Callee.Name, R_X86_64_PLT32});
+                } else {
+                    X.movRaxImm((uint64_t)(uintptr_t)&Callee.Entry.Code);
+                    X.callMemRax();
+                }
+                if (StackArgs)
+                    X.addRsp(8 * StackArgs + Pad);
+                if (A == XmmInMemory)
+                    X.movsdStore(Slot(I.A), 0);
+                else if (A != 0)
+                    X.movapd((unsigned)A, 0);
+                Restore.emit(X);
+                break;
+            }
+            case OP_RET: {
+                int From = RA.loc(I.A, Before);
+                if (From == XmmInMemory)
+                    X.movsdLoad(0, Slot(I.A));
+                else if (From != 0)
+                    X.movapd(0, (unsigned)From);
+                if (Memo) {
+                    X.movRdiImm((uint64_t)(uintptr_t)Memo);
+                    X.movRsiRbp();
+                    X.movRaxImm((uint64_t)(uintptr_t)&MemoInsertNative);
+                    X.callRax();
+                }
+                X.epilogue();
+                break;
+            }
+        }
+    }
+
+    for (auto &Stub : EdgeStubs) {
+        X.patch(Stub.first, X.size());
+        X.label();
+        Stub.second.second.emit(X);
+        JumpFixups.push_back({X.jmp(), Stub.second.first});
+    }
+    for (auto &Fixup : JumpFixups)
+        X.patch(Fixup.first, Offsets[Fixup.second]);
+
+    // one shared stub per kind of error; rsp is still aligned here, as at every call
+    for (uint32_t E = 0; E < NE_Count; ++E) {
+        if (ErrorFixups[E].empty())
+            continue;
+        ErrorJumps[E] = X.size();
+        for (size_t At : ErrorFixups[E])
+            X.patch(At, ErrorJumps[E]);
+        X.label();
+        if (Relocs) {
+            X.ud2();
+            continue;
+        }
+        X.movEdiImm(E);
+        X.movRaxImm((uint64_t)(uintptr_t)&NativeFail);
+        X.callRax();
+    }
+    RegAllocStats.CodeBytes += X.size() - CodeStart;
+}
+
+static void PrintRegAllocStats() {
+    auto &S = RegAllocStats;
+    fprintf(stderr,
+            "regalloc: %llu functions, %llu bytes of code, %llu live range pieces, %llu in xmm registers; %llu "
+            "stores, %llu loads, %llu copies\n",
+            (unsigned long long)S.Functions, (unsigned long long)S.CodeBytes, (unsigned long long)S.Pieces,
+            (unsigned long long)S.InRegisters, (unsigned long long)S.Stores, (unsigned long long)S.Loads,
+            (unsigned long long)S.Copies);
+}
+
+/// MapExecutable -- copy Code into fresh pages and make them read+execute, never writable again
+static void *MapExecutable(const std::vector<uint8_t> &Code, size_t &MappedSize) {
+    size_t Page = (size_t)sysconf(_SC_PAGESIZE);
+    MappedSize = (Code.size() + Page - 1) / Page * Page;
+    void *Mem = mmap(nullptr, MappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Mem == MAP_FAILED)
+        return nullptr;
+    memcpy(Mem, Code.data(), Code.size());
+    if (mprotect(Mem, MappedSize, PROT_READ | PROT_EXEC) != 0) {
+        munmap(Mem, MappedSize);
+        return nullptr;
+    }
+    return Mem;
+}
+
+/// CompileSlot -- compile Slot's definition and point its Entry at the code. Needs DefinitionsLock.
+static bool CompileSlot(FunctionSlot &Slot, std::vector<FunctionSlot *> *Pending) {
+    X86Emitter X;
+    GenerateNative(*Slot.BC, X, Pending, ActiveMemo(Slot));
+    Slot.Code = MapExecutable(X.Bytes, Slot.CodeSize);
+    if (!Slot.Code)
+        return false;
+    Slot.Entry.Code.store(Slot.Code, std::memory_order_release);
+    return true;
+}
+
+/// NativeResolve -- called by the resolve stub with the slot it was called through. Returns the code to
+/// go on to, or fails the call if there's no definition.
+static void *NativeResolve(uint32_t Index) {
+    uint32_t Error;
+    {
+        std::lock_guard<std::mutex> Lock(DefinitionsLock);
+        FunctionSlot &Slot = *FunctionTable[Index];
+        if (Slot.Code || (Slot.BC && CompileSlot(Slot, nullptr)))
+            return Slot.Code;
+        if (!Slot.BC && Slot.Extern) {
+            Slot.Entry.Code.store(Slot.Extern, std::memory_order_release);
+            return Slot.Extern;
+        }
+        Error = Slot.BC ? NE_NoMemory : ExternProtos.count(Slot.Name) ? NE_NoImplementation : NE_UnknownFunction;
+    }
+    NativeFail(Error);
+}
+
+/// InitNativeCode -- make the resolve stub. It saves the argument registers, asks NativeResolve for the
+/// code (rax still points at the Entry that was called through) and tail jumps to it, so the callee sees
+/// the call exactly as the caller made it.
+static bool InitNativeCode() {
+    X86Emitter X;
+    X.prologue();
+    X.subRsp(64);
+    for (unsigned i = 0; i < 8; ++i)
+        X.movsdStore(X86Emitter::slot(i), i);
+    X.movEdiRax8();
+    X.movRaxImm((uint64_t)(uintptr_t)&NativeResolve);
+    X.callRax();
+    X.movR11Rax();
+    for (unsigned i = 0; i < 8; ++i)
+        X.movsdLoad(i, X86Emitter::slot(i));
+    X.bytes({0xC9}); // leave
+    X.jmpR11();
+
+    size_t Size;
+    NativeResolveStub = MapExecutable(X.Bytes, Size);
+    for (auto &Slot : FunctionTable)
+        if (!Slot->Code)
+            Slot->Entry.Code.store(NativeResolveStub, std::memory_order_relaxed);
+    return NativeResolveStub != nullptr;
+}
+
+static void FreeSlotCode(FunctionSlot &Slot) {
+    if (Slot.Code)
+        munmap(Slot.Code, Slot.CodeSize);
+    Slot.Code = nullptr;
+    Slot.Entry.Code.store(NativeResolveStub, std::memory_order_relaxed);
+    if (Slot.BC)
+        Slot.BC->NativeEntry.store(nullptr, std::memory_order_relaxed);
+}
+
+/// RetireNativeCode -- Slot's function is being redefined with NewArity parameters. Its own code goes;
+/// callers only go as well if one of them was compiled assuming another argument count, as they have
+/// that check (or its absence) baked in. Needs DefinitionsLock, and no native code may be running.
+static void RetireNativeCode(FunctionSlot &Slot, unsigned NewArity) {
+    if (Slot.BoundArity == -1 || Slot.BoundArity == (int)NewArity) {
+        FreeSlotCode(Slot);
+        return;
+    }
+    for (auto &Other : FunctionTable) {
+        FreeSlotCode(*Other);
+        Other->BoundArity = -1;
+    }
+}
+
+/// CompileNative -- machine code for F, a top-level expression. What it calls is compiled when called.
+static std::unique_ptr<NativeFunction> CompileNative(const BytecodeFunction &F) {
+    auto Result = std::make_unique<NativeFunction>();
+    X86Emitter X;
+    {
+        std::lock_guard<std::mutex> Lock(DefinitionsLock);
+        GenerateNative(F, X, nullptr, nullptr);
+    }
+    Result->Code = MapExecutable(X.Bytes, Result->MappedSize);
+    if (!Result->Code) {
+        LogError(NativeErrorMessage(NE_NoMemory));
+        return nullptr;
+    }
+    return Result;
+}
+
+/// CatchNativeErrors -- run Body, which may call native code, turning a NativeFail into a diagnostic
+template <typename BodyFn>
+static bool CatchNativeErrors(BodyFn &&Body) {
+    jmp_buf Env;
+    Native.Calls = 0;
+    Native.StackLimit = (uintptr_t)__builtin_frame_address(0) - NativeStackBudget;
+
+    bool Ok = false;
+    NativeErrorJump = &Env;
+    if (setjmp(Env) == 0)
+        Ok = Body();
+    else
+        LogError(NativeErrorMessage(NativeErrorCode));
+    NativeErrorJump = nullptr;
+
+    EvalCalls += Native.Calls;
+    return Ok;
+}
+
+/// RunNative -- call F, a compiled top-level expression. false if it failed, the error is in PendingDiags.
+static bool RunNative(const NativeFunction &F, double &Result) {
+    bool Ok = CatchNativeErrors([&] {
+        Result = ((double (*)())F.Code)();
+        return true;
+    });
+    --EvalCalls; // F's own prologue counted too
+    return Ok;
+}
+
+#else
+
+static void RetireNativeCode(FunctionSlot &, unsigned) {
+}
+
+static void PrintRegAllocStats() {
+}
+
+#endif // LAP_NATIVE
+
+static void PrintPeepholeStats() {
+    for (const BytecodeRule &Rule : BytecodeRules)
+        fprintf(stderr, "peephole: bytecode %-14s %llu\n", Rule.Name, (unsigned long long)Rule.Fired.load());
+#if LAP_NATIVE
+    for (const X86Rule &Rule : X86Rules)
+        fprintf(stderr, "peephole: x86      %-14s %llu\n", Rule.Name, (unsigned long long)Rule.Fired.load());
+#endif
+}
+
+// -----------------------------------=======
+//            End Native Code
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            Tiered Execution
+// -----------------------------------=======
+
+/*
+ * --engine=tiered starts every function in the VM and counts its calls there. The language has no
+ * loops, so recursion is the only way code runs hot and the call count is the only counter needed.
+ * When a function reaches TierThreshold calls it is queued for the TierUpCompiler thread, which
+ * compiles it (and everything it calls) to native code and publishes the entry points through
+ * BytecodeFunction::NativeEntry. The VM checks that at every call, so the switch takes effect at the
+ * next call without stopping anything.
+ *
+ * Definitions only change on the main thread between top-level expressions, under DefinitionsLock,
+ * and the compiler thread holds that lock while it works, so it never sees a definition change under it.
+ */
+
+#if LAP_NATIVE
+
+class TierUpCompiler {
+    std::mutex QueueLock;
+    std::condition_variable Wake;
+    std::vector<FunctionSlot *> Queue;
+    bool Stop = false;
+    std::thread Worker;
+
+    void compile(FunctionSlot &Hot) {
+        std::lock_guard<std::mutex> Lock(DefinitionsLock);
+        std::vector<FunctionSlot *> Pending{&Hot}, Done;
+        while (!Pending.empty()) {
+            FunctionSlot *Slot = Pending.back();
+            Pending.pop_back();
+            if (!Slot->BC || (!Slot->Code && !CompileSlot(*Slot, &Pending)))
+                continue; // out of executable memory: its callers get it through the resolve stub
+            Done.push_back(Slot);
+        }
+        for (FunctionSlot *Slot : Done)
+            Slot->BC->NativeEntry.store(Slot->Code, std::memory_order_release);
+    }
+
+    void run() {
+        while (true) {
+            FunctionSlot *Slot;
+            {
+                std::unique_lock<std::mutex> Lock(QueueLock);
+                Wake.wait(Lock, [this] { return Stop || !Queue.empty(); });
+                if (Stop)
+                    return;
+                Slot = Queue.back();
+                Queue.pop_back();
+            }
+            compile(*Slot);
+        }
+    }
+
+public:
+    void request(FunctionSlot &Slot) {
+        std::lock_guard<std::mutex> Lock(QueueLock);
+        if (!Worker.joinable())
+            Worker = std::thread([this] { run(); });
+        Queue.push_back(&Slot);
+        Wake.notify_one();
+    }
+
+    ~TierUpCompiler() {
+        {
+            std::lock_guard<std::mutex> Lock(QueueLock);
+            Stop = true;
+        }
+        Wake.notify_one();
+        if (Worker.joinable())
+            Worker.join();
+    }
+};
+
+static TierUpCompiler TierUp;
+
+static void RequestTierUp(FunctionSlot &Slot) {
+    TierUp.request(Slot);
+}
+
+/// RunTiered -- run F, a top-level expression, in the VM, calling into native code where it's ready
+static bool RunTiered(BytecodeFunction &F, double &Result) {
+    return CatchNativeErrors([&] { return RunBytecode(F, Result); });
+}
+
+#else
+
+static void RequestTierUp(FunctionSlot &) {
+}
+
+#endif // LAP_NATIVE
+
+// -----------------------------------=======
+//            End Tiered Execution
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            Object Files
+// -----------------------------------=======
+
+/*
+ * --emit-obj=FILE compiles ahead of time. The input is parsed and compiled as usual but nothing is
+ * run. At the end, the native code for every definition goes into FILE as an ELF64 relocatable
+ * object for the system linker. A definition is a global function symbol with the JIT's calling
+ * convention, so C can declare double fib(double) and call it; specialized clones (see
+ * Specialization) are local symbols. Calls go to symbols through relocations, which leaves an extern
+ * as an undefined symbol for the linker to find in libm or in the program's own code.
+ *
+ * An object is meant to be linked into a program that has its own main, so the top-level
+ * expressions are left out of it. With --emit-main it gets a main too, which evaluates them in order
+ * and prints each result to stdout, so "cc FILE -lm" makes a program of it. --emit-exe=FILE always
+ * has that main and goes on to do the link itself, statically, and leaves just the executable. Either
+ * way a definition named main is an error then, as the two would clash.
+ *
+ * A top-level expression calls the definitions that were live when it was parsed, as it would have
+ * when run then, so each expression keeps a snapshot of them (one per change to the definitions).
+ * The global symbols are the last definition of each function. A definition as an earlier snapshot
+ * sees it is a local symbol, f.1, f.2 and so on, unless it and everything it can reach are the same
+ * as in a snapshot that already has one; see ObjectLayout. A replaced definition's bytecode is kept
+ * for this (see ReplacedBytecode).
+ *
+ * Object code has no runtime to report errors to, so a call to a function its snapshot doesn't have,
+ * or with the wrong number of arguments, is an error here instead of when the call happens.
+ * Recursion too deep for the stack crashes the way it would in C, and memoization isn't compiled in.
+ */
+
+/// ObjectOutput / ObjectExecutable -- --emit-obj=FILE, or with --emit-exe=FILE the executable to link
+static std::string ObjectOutput;
+static bool ObjectExecutable = false;
+
+/// ObjectMain -- --emit-main, give --emit-obj's object a main that runs the top-level expressions
+static bool ObjectMain = false;
+
+/// ObjectSnapshot -- the definitions and externs (by arity) live when a top-level expression was parsed
+struct ObjectSnapshot {
+    uint64_t Version = 0; // DefinitionsVersion then
+    std::unordered_map<std::string, const BytecodeFunction *> Defs;
+    std::unordered_map<std::string, unsigned> Externs;
+};
+
+/// ObjectExpression -- a top-level expression for the object's main, and the snapshot its calls go to
+struct ObjectExpression {
+    std::unique_ptr<BytecodeFunction> BC;
+    size_t Snapshot;
+};
+
+static std::vector<ObjectSnapshot> ObjectSnapshots;
+static std::vector<ObjectExpression> ObjectExpressions;
+
+static bool ObjectError(const std::string &Msg) {
+    fprintf(stderr, "Error: %s\n", Msg.c_str());
+    ++NumErrors;
+    return false;
+}
+
+/// TakeObjectSnapshot -- the definitions and externs as they are now
+static ObjectSnapshot TakeObjectSnapshot() {
+    ObjectSnapshot S;
+    S.Version = DefinitionsVersion;
+    for (auto &Slot : FunctionTable)
+        if (Slot->BC)
+            S.Defs[Slot->Name] = Slot->BC.get();
+    for (auto &Extern : ExternProtos)
+        S.Externs[Extern.first] = (unsigned)Extern.second->getArgs().size();
+    return S;
+}
+
+/// AddObjectExpression -- keep BC, just compiled, for the object's main
+static void AddObjectExpression(std::unique_ptr<BytecodeFunction> BC) {
+    if (ObjectSnapshots.empty() || ObjectSnapshots.back().Version != DefinitionsVersion)
+        ObjectSnapshots.push_back(TakeObjectSnapshot());
+    ObjectExpressions.push_back({std::move(BC), ObjectSnapshots.size() - 1});
+}
+
+#if LAP_NATIVE
+
+/// ObjectSymbol -- a function in the object's .text
+struct ObjectSymbol {
+    std::string Name;
+    size_t Offset, Size;
+    bool Global;
+};
+
+/// ObjectMainFormat -- what main prints each result with, the object's only data
+static const char ObjectMainFormat[] = "Evaluated to %f\n";
+
+static std::string ExpressionSymbol(size_t i) {
+    return "__anon_expr." + std::to_string(i);
+}
+
+/// CheckObjectCalls -- report the calls in F that the JIT would only fail when they're made, with the
+/// definitions in S
+static bool CheckObjectCalls(const BytecodeFunction &F, const ObjectSnapshot &S) {
+    bool Ok = true;
+    for (const Instr &I : F.Code) {
+        if (I.Op != OP_CALL && I.Op != OP_TCALL)
+            continue;
+        const std::string &Callee = F.Callees[I.B];
+        auto Def = S.Defs.find(Callee);
+        auto Extern = S.Externs.find(Callee);
+        if (Def == S.Defs.end() && Extern == S.Externs.end())
+            Ok = ObjectError("Unknown function referenced: " + Callee + " in " + F.Name);
+        else if ((Def != S.Defs.end() ? Def->second->NumParams : Extern->second) != I.N)
+            Ok = ObjectError("Incorrect # arguments passed to " + Callee + " in " + F.Name);
+    }
+    return Ok;
+}
+
+/// ObjectFunction -- code that goes in the object: a definition as Snapshot sees it, or a top-level
+/// expression
+struct ObjectFunction {
+    const BytecodeFunction *BC;
+    const ObjectSnapshot *Snapshot;
+    std::string Symbol;
+    bool Global;
+};
+
+/// ObjectLayout -- which functions the object needs and their symbols. A definition in a snapshot is
+/// known by its signature: its own version and the versions of everything it can reach. Two with
+/// the same signature compile to the same code calling the same functions, so they share a symbol.
+class ObjectLayout {
+    std::unordered_map<std::string, std::string> BySignature;
+    std::unordered_map<std::string, unsigned> Versions; // local symbols so far, by name
+
+    static std::string signature(const ObjectSnapshot &S, const std::string &Name) {
+        std::vector<std::string> Reached{Name};
+        std::string Sig;
+        for (size_t i = 0; i < Reached.size(); ++i) {
+            auto Def = S.Defs.find(Reached[i]);
+            char Version[32];
+            snprintf(Version, sizeof(Version), "=%p;", Def != S.Defs.end() ? (const void *)Def->second : nullptr);
+            Sig += Reached[i] + Version;
+            if (Def == S.Defs.end())
+                continue;
+            for (auto &Callee : Def->second->Callees)
+                if (std::find(Reached.begin(), Reached.end(), Callee) == Reached.end())
+                    Reached.push_back(Callee);
+        }
+        return Sig;
+    }
+
+public:
+    std::vector<ObjectFunction> Functions;
+
+    /// symbol -- the symbol of what a call to Name in S calls, adding that to Functions the first
+    /// time. The last definitions go first, as the Final snapshot, so that they get the plain names.
+    std::string symbol(const ObjectSnapshot &S, const std::string &Name, bool Final) {
+        auto Def = S.Defs.find(Name);
+        if (Def == S.Defs.end())
+            return Name; // an extern, or an error CheckObjectCalls reports
+        std::string Sig = signature(S, Name);
+        auto It = BySignature.find(Sig);
+        if (It != BySignature.end())
+            return It->second;
+        std::string Symbol = Final ? Name : Name + "." + std::to_string(++Versions[Name]);
+        BySignature.emplace(Sig, Symbol);
+        Functions.push_back({Def->second, &S, Symbol, Final && Name.find('<') == std::string::npos}); // clones are "f<_,3>"
+        return Symbol;
+    }
+};
+
+/// GenerateObjectMain -- int main(): call each top-level expression and printf its result
+static void GenerateObjectMain(X86Emitter &X, std::vector<NativeReloc> &Relocs) {
+    X.prologue(); // rsp is 16 byte aligned from here on, as calls need it
+    for (size_t i = 0; i < ObjectExpressions.size(); ++i) {
+        Relocs.push_back({X.callRel(), ExpressionSymbol(i), R_X86_64_PLT32});
+        X.bytes({0x48, 0x8D, 0x3D}); // lea rdi, [rip + disp32]
+        X.u32(0);
+        Relocs.push_back({X.size() - 4, ".rodata", R_X86_64_PC32});
+        X.bytes({0xB8, 0x01, 0x00, 0x00, 0x00}); // mov eax, 1: the result is printf's one vector argument
+        Relocs.push_back({X.callRel(), "printf", R_X86_64_PLT32});
+    }
+    X.bytes({0x31, 0xC0}); // xor eax, eax
+    X.epilogue();
+}
+
+/// WriteElfObject -- Text holding Symbols, with Relocs against it and Rodata, as an x86-64 ELF64
+/// relocatable object. Every relocation is a rel32 whose target is the symbol itself (addend -4).
+static bool WriteElfObject(const std::string &Path, const std::vector<uint8_t> &Text, const std::string &Rodata,
+                           const std::vector<ObjectSymbol> &Symbols, const std::vector<NativeReloc> &Relocs) {
+    enum { S_Null, S_Text, S_Rodata, S_RelaText, S_Symtab, S_Strtab, S_Shstrtab, S_NoteStack, S_Count };
+    static const char *const SectionNames[S_Count] = {"",        ".text",     ".rodata",   ".rela.text",
+                                                      ".symtab", ".strtab", ".shstrtab", ".note.GNU-stack"};
+
+    // the symbol table starts with the null symbol and the two section symbols, and has all the
+    // locals before the globals
+    std::string Strtab(1, '\0');
+    std::vector<Elf64_Sym> Syms(3);
+    Syms[1].st_info = Syms[2].st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+    Syms[1].st_shndx = S_Text;
+    Syms[2].st_shndx = S_Rodata;
+    std::unordered_map<std::string, uint32_t> Index{{".rodata", 2}};
+    auto AddSymbol = [&](const std::string &Name, unsigned char Info, uint16_t Section, size_t Value, size_t Size) {
+        Elf64_Sym S = {};
+        S.st_name = (uint32_t)Strtab.size();
+        S.st_info = Info;
+        S.st_shndx = Section;
+        S.st_value = Value;
+        S.st_size = Size;
+        Strtab += Name;
+        Strtab += '\0';
+        Index[Name] = (uint32_t)Syms.size();
+        Syms.push_back(S);
+    };
+    uint32_t FirstGlobal = 0;
+    for (bool Global : {false, true}) {
+        if (Global)
+            FirstGlobal = (uint32_t)Syms.size();
+        for (const ObjectSymbol &Sym : Symbols)
+            if (Sym.Global == Global)
+                AddSymbol(Sym.Name, ELF64_ST_INFO(Global ? STB_GLOBAL : STB_LOCAL, STT_FUNC), S_Text, Sym.Offset, Sym.Size);
+    }
+    for (const NativeReloc &R : Relocs)
+        if (!Index.count(R.Symbol))
+            AddSymbol(R.Symbol, ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE), SHN_UNDEF, 0, 0);
+
+    std::vector<Elf64_Rela> Rela;
+    for (const NativeReloc &R : Relocs)
+        Rela.push_back({R.At, ELF64_R_INFO(Index[R.Symbol], R.Type), -4});
+
+    std::string Shstrtab;
+    std::vector<Elf64_Shdr> Headers(S_Count);
+    for (unsigned i = 0; i < S_Count; ++i) {
+        Headers[i].sh_name = (uint32_t)Shstrtab.size();
+        Shstrtab += SectionNames[i];
+        Shstrtab += '\0';
+    }
+    std::vector<uint8_t> File(sizeof(Elf64_Ehdr));
+    auto AddSection = [&](unsigned i, uint32_t Type, uint64_t Flags, const void *Data, size_t Size, uint64_t Align) {
+        Elf64_Shdr &H = Headers[i];
+        H.sh_type = Type;
+        H.sh_flags = Flags;
+        File.resize((File.size() + Align - 1) / Align * Align);
+        H.sh_offset = File.size();
+        H.sh_size = Size;
+        H.sh_addralign = Align;
+        File.insert(File.end(), (const uint8_t *)Data, (const uint8_t *)Data + Size);
+    };
+    AddSection(S_Text, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, Text.data(), Text.size(), 16);
+    AddSection(S_Rodata, SHT_PROGBITS, SHF_ALLOC, Rodata.data(), Rodata.size(), 1);
+    AddSection(S_RelaText, SHT_RELA, SHF_INFO_LINK, Rela.data(), Rela.size() * sizeof(Elf64_Rela), 8);
+    Headers[S_RelaText].sh_link = S_Symtab;
+    Headers[S_RelaText].sh_info = S_Text;
+    Headers[S_RelaText].sh_entsize = sizeof(Elf64_Rela);
+    AddSection(S_Symtab, SHT_SYMTAB, 0, Syms.data(), Syms.size() * sizeof(Elf64_Sym), 8);
+    Headers[S_Symtab].sh_link = S_Strtab;
+    Headers[S_Symtab].sh_info = FirstGlobal;
+    Headers[S_Symtab].sh_entsize = sizeof(Elf64_Sym);
+    AddSection(S_Strtab, SHT_STRTAB, 0, Strtab.data(), Strtab.size(), 1);
+    AddSection(S_Shstrtab, SHT_STRTAB, 0, Shstrtab.data(), Shstrtab.size(), 1);
+    AddSection(S_NoteStack, SHT_PROGBITS, 0, nullptr, 0, 1); // asks for a stack that isn't executable
+
+    Elf64_Ehdr Header = {};
+    memcpy(Header.e_ident, ELFMAG, SELFMAG);
+    Header.e_ident[EI_CLASS] = ELFCLASS64;
+    Header.e_ident[EI_DATA] = ELFDATA2LSB;
+    Header.e_ident[EI_VERSION] = EV_CURRENT;
+    Header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    Header.e_type = ET_REL;
+    Header.e_machine = EM_X86_64;
+    Header.e_version = EV_CURRENT;
+    Header.e_ehsize = sizeof(Elf64_Ehdr);
+    Header.e_shentsize = sizeof(Elf64_Shdr);
+    Header.e_shnum = S_Count;
+    Header.e_shstrndx = S_Shstrtab;
+    File.resize((File.size() + 7) / 8 * 8);
+    Header.e_shoff = File.size();
+    memcpy(File.data(), &Header, sizeof(Header));
+    File.insert(File.end(), (const uint8_t *)Headers.data(), (const uint8_t *)(Headers.data() + S_Count));
+
+    FILE *Out = fopen(Path.c_str(), "wb");
+    if (!Out)
+        return false;
+    bool Ok = fwrite(File.data(), 1, File.size(), Out) == File.size();
+    return fclose(Out) == 0 && Ok;
+}
+
+/// LinkExecutable -- run the system's C compiler driver ($CC, or cc) to link Object statically into Path
+static bool LinkExecutable(const std::string &Object, const std::string &Path) {
+    const char *CC = getenv("CC");
+    std::string Driver = CC && *CC ? CC : "cc";
+    const char *Argv[] = {Driver.c_str(), "-static", "-o", Path.c_str(), Object.c_str(), "-lm", nullptr};
+    pid_t Pid;
+    int Status;
+    if (posix_spawnp(&Pid, Argv[0], nullptr, nullptr, (char *const *)Argv, environ) != 0)
+        return ObjectError("can't run " + Driver + " to link " + Path);
+    if (waitpid(Pid, &Status, 0) != Pid || !WIFEXITED(Status) || WEXITSTATUS(Status) != 0)
+        return ObjectError("linking " + Path + " failed");
+    return true;
+}
+
+/// EmitObjectOutput -- write --emit-obj's object file, or --emit-exe's executable
+static bool EmitObjectOutput() {
+    if (MemoizeAny())
+        fprintf(stderr, "warning: memoization isn't compiled into object files\n");
+    if (ObjectExecutable && ObjectExpressions.empty())
+        return ObjectError("--emit-exe: there are no top-level expressions to run");
+    bool WithMain = (ObjectExecutable || ObjectMain) && !ObjectExpressions.empty();
+    if (!WithMain && !ObjectExpressions.empty())
+        fprintf(stderr, "warning: the top-level expressions aren't in %s; --emit-main puts them in a main\n",
+                ObjectOutput.c_str());
+
+    X86Emitter X;
+    std::vector<NativeReloc> Relocs;
+    std::vector<ObjectSymbol> Symbols;
+    bool Ok = true;
+    auto Align = [&] {
+        while (X.size() % 16)
+            X.byte(0xCC); // int3
+    };
+    {
+        std::lock_guard<std::mutex> Lock(DefinitionsLock);
+        ObjectSnapshot Final = TakeObjectSnapshot();
+        ObjectLayout Layout;
+        for (auto &Slot : FunctionTable) {
+            if (!Slot->BC)
+                continue;
+            if (Slot->Name == "main" && WithMain)
+                Ok = ObjectError("main is defined, so the top-level expressions can't go in a main of their own");
+            Layout.symbol(Final, Slot->Name, true);
+        }
+        for (size_t i = 0; WithMain && i < ObjectExpressions.size(); ++i)
+            Layout.Functions.push_back(
+                {ObjectExpressions[i].BC.get(), &ObjectSnapshots[ObjectExpressions[i].Snapshot], ExpressionSymbol(i), false});
+
+        // Functions grows as the calls in it are given symbols
+        for (size_t i = 0; i < Layout.Functions.size(); ++i) {
+            ObjectFunction F = Layout.Functions[i];
+            Ok &= CheckObjectCalls(*F.BC, *F.Snapshot);
+            Align();
+            size_t Start = X.size(), FirstReloc = Relocs.size();
+            GenerateNative(*F.BC, X, nullptr, nullptr, &Relocs);
+            for (size_t r = FirstReloc; r < Relocs.size(); ++r)
+                Relocs[r].Symbol = Layout.symbol(*F.Snapshot, Relocs[r].Symbol, F.Snapshot == &Final);
+            Symbols.push_back({F.Symbol, Start, X.size() - Start, F.Global});
+        }
+    }
+    if (WithMain) {
+        Align();
+        size_t Start = X.size();
+        GenerateObjectMain(X, Relocs);
+        Symbols.push_back({"main", Start, X.size() - Start, true});
+    }
+    if (!Ok)
+        return false;
+
+    const std::string Rodata(ObjectMainFormat, sizeof(ObjectMainFormat)); // with its terminator
+    if (!ObjectExecutable) {
+        if (!WriteElfObject(ObjectOutput, X.Bytes, Rodata, Symbols, Relocs))
+            return ObjectError("can't write " + ObjectOutput);
+        return true;
+    }
+    char Object[] = "/tmp/lapXXXXXX.o";
+    int Fd = mkstemps(Object, 2);
+    if (Fd < 0)
+        return ObjectError("can't make a temporary object file");
+    close(Fd);
+    Ok = WriteElfObject(Object, X.Bytes, Rodata, Symbols, Relocs) ? LinkExecutable(Object, ObjectOutput)
+                                                                  : ObjectError("can't write " + std::string(Object));
+    unlink(Object);
+    return Ok;
+}
+
+#else
+
+static bool EmitObjectOutput() {
+    return ObjectError("--emit-obj and --emit-exe need x86-64");
+}
+
+#endif // LAP_NATIVE
+
+// -----------------------------------=======
+//            End Object Files
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            Compile Cache
+// -----------------------------------=======
+
+/*
+ * --cache=DIR keeps the bytecode of every definition and top-level expression in DIR between runs,
+ * so what hasn't changed since the last run isn't compiled again (plain --cache uses
+ * $XDG_CACHE_HOME/lap, or ~/.cache/lap). An entry's key is a hash of everything its bytecode depends
+ * on: the function's AST with the parameters numbered instead of named, the flags that change code
+ * generation, and CodegenVersion. With --opt the code has copies of other functions in it (see
+ * Inliner and Specialization), so the key also covers every definition the body can reach through
+ * calls. Without --opt a call is only a name, and the callee can change without the caller's entry
+ * going stale.
+ *
+ * So a hit computes what compiling would, but it may not be the very code this run would compile.
+ * The inliner ignores how often callees have run while there's a cache (see InlineHotCalls), but
+ * whether a call gets a specialized clone still depends on how much of --specialize-budget the run
+ * has spent. Code calling a clone isn't cached, so a hit can only have a plain call where this run
+ * would have had a clone.
+ *
+ * An entry is a file named after its key. It's written to a temporary file and renamed into place,
+ * so processes sharing DIR only ever see whole entries, and one that fails its checksum is just a
+ * miss. A hit touches its file, which makes modification times the order of last use: once DIR holds
+ * more than --cache-size=MB (64 by default), the least recently used entries are deleted until it's
+ * down to three quarters of that. --cache-stats prints the hit rate.
+ *
+ * Bytecode is kept rather than machine code, because machine code is one quick pass over the
+ * bytecode and has the addresses of this process's function table built in. Nothing is cached with
+ * --single-pass (there's no AST to key it by), with --emit-ir or --inline-report (whose output
+ * would go missing on a hit), or for code that calls a specialized clone, which a later run
+ * wouldn't have.
+ */
+
+/// CacheDir / CacheLimit / CacheReport -- --cache[=DIR], --cache-size=MB and --cache-stats
+static std::string CacheDir;
+static uint64_t CacheLimit = 64ull << 20;
+static bool CacheReport = false;
+
+static uint64_t CacheLookups = 0, CacheHits = 0, CacheStored = 0, CacheEvicted = 0, CacheUnreadable = 0;
+
+/// DefaultCacheDir -- where plain --cache keeps its entries
+static std::string DefaultCacheDir() {
+    const char *Xdg = getenv("XDG_CACHE_HOME"), *Home = getenv("HOME");
+    if (Xdg && *Xdg)
+        return std::string(Xdg) + "/lap";
+    if (Home && *Home)
+        return std::string(Home) + "/.cache/lap";
+    return ".lap-cache";
+}
+
+static void PrintCacheStats() {
+    uint64_t Misses = CacheLookups - CacheHits;
+    fprintf(stderr, "cache: %llu lookups, %llu hits (%.1f%%), %llu misses, %llu stored, %llu evicted",
+            (unsigned long long)CacheLookups, (unsigned long long)CacheHits,
+            CacheLookups ? 100.0 * CacheHits / CacheLookups : 0.0, (unsigned long long)Misses,
+            (unsigned long long)CacheStored, (unsigned long long)CacheEvicted);
+    if (CacheUnreadable)
+        fprintf(stderr, ", %llu unreadable", (unsigned long long)CacheUnreadable);
+    fprintf(stderr, "\n");
+}
+
+#if LAP_CACHE
+
+/// CodegenVersion -- part of every key. Bump it whenever the entry format changes, or any compiler
+/// (the bytecode emitter, the SSA IR and its passes, the peephole rules) emits different code for
+/// the same input, so that entries made before are never used.
+static const uint32_t CodegenVersion = 1;
+static const uint32_t CacheMagic = 0x4350414C; // "LAPC"
+
+/// CacheBytes -- what DIR holds as far as this process knows, see CacheEvict
+static uint64_t CacheBytes = 0;
+
+/// CacheHasher -- FNV-1a, as in HashTokens
+struct CacheHasher {
+    uint64_t Hash = 14695981039346656037ull;
+
+    void bytes(const void *Data, size_t Len) {
+        for (size_t i = 0; i < Len; ++i) {
+            Hash ^= ((const unsigned char *)Data)[i];
+            Hash *= 1099511628211ull;
+        }
+    }
+    template <typename T> void mix(T V) { bytes(&V, sizeof(V)); }
+    void mix(const std::string &S) {
+        mix(S.size());
+        bytes(S.data(), S.size());
+    }
+};
+
+/// HashExpr -- mix E into H, a parameter by its number, and add what E calls to Callees if it's given
+static void HashExpr(CacheHasher &H, const ExprAST &E, const std::vector<std::string> &Params,
+                     std::vector<std::string> *Callees) {
+    H.mix(E.getKind());
+    switch (E.getKind()) {
+        case EK_Number:
+            H.mix(static_cast<const NumberExprAST &>(E).getValue());
+            break;
+        case EK_Variable: {
+            auto &Name = static_cast<const VariableExprAST &>(E).getName();
+            auto It = std::find(Params.begin(), Params.end(), Name);
+            if (It != Params.end())
+                H.mix((uint32_t)(It - Params.begin()));
+            else
+                H.mix(Name); // an error, but the same one every time
+            break;
+        }
+        case EK_Unary: {
+            auto &U = static_cast<const UnaryExprAST &>(E);
+            H.mix(U.getOpcode());
+            if (Callees)
+                Callees->push_back(std::string("unary") + U.getOpcode());
+            HashExpr(H, U.getOperand(), Params, Callees);
+            break;
+        }
+        case EK_Binary: {
+            auto &B = static_cast<const BinaryExprAST &>(E);
+            H.mix(B.getOp());
+            if (Callees && !IsBuiltinBinOp(B.getOp()))
+                Callees->push_back(std::string("binary") + B.getOp());
+            HashExpr(H, B.getLHS(), Params, Callees);
+            HashExpr(H, B.getRHS(), Params, Callees);
+            break;
+        }
+        case EK_Call: {
+            auto &C = static_cast<const CallExprAST &>(E);
+            H.mix(C.getCallee());
+            H.mix(C.getArgs().size());
+            if (Callees)
+                Callees->push_back(C.getCallee());
+            for (auto &Arg : C.getArgs())
+                HashExpr(H, *Arg, Params, Callees);
+            break;
+        }
+        case EK_If: {
+            auto &I = static_cast<const IfExprAST &>(E);
+            HashExpr(H, I.getCond(), Params, Callees);
+            HashExpr(H, I.getThen(), Params, Callees);
+            HashExpr(H, I.getElse(), Params, Callees);
+            break;
+        }
+    }
+}
+
+/// HashFunction -- mix a definition into H. Parameter names only matter as far as which are the same.
+static void HashFunction(CacheHasher &H, const PrototypeAST &Proto, const ExprAST &Body,
+                         std::vector<std::string> *Callees) {
+    const std::vector<std::string> &Params = Proto.getArgs();
+    H.mix(Proto.getName());
+    H.mix(Params.size());
+    for (auto &Param : Params)
+        H.mix((uint32_t)(std::find(Params.begin(), Params.end(), Param) - Params.begin()));
+    HashExpr(H, Body, Params, Callees);
+}
+
+/// CacheKey -- the key for the bytecode of Proto and Body as this run would compile it
+static uint64_t CacheKey(const PrototypeAST &Proto, const ExprAST &Body) {
+    CacheHasher H;
+    H.mix(CodegenVersion);
+    for (bool Flag : {Optimize, FoldConstants, FastMath, TailCalls, Peephole})
+        H.mix(Flag);
+    if (Optimize) {
+        H.mix(InlineThreshold);
+        H.mix(SpecializeBudget);
+        H.mix(MemoizeAll);
+        for (auto &Name : MemoizeNames)
+            H.mix(Name);
+    }
+
+    std::vector<std::string> Callees;
+    HashFunction(H, Proto, Body, Optimize ? &Callees : nullptr);
+
+    // every definition the inliner could reach from here, as it would see them
+    std::vector<std::string> Seen{Proto.getName()};
+    for (size_t i = 0; i < Callees.size(); ++i) {
+        std::string Name = Callees[i];
+        if (std::find(Seen.begin(), Seen.end(), Name) != Seen.end())
+            continue;
+        Seen.push_back(Name);
+        auto It = FunctionIndex.find(Name);
+        FunctionSlot *Slot = It != FunctionIndex.end() ? FunctionTable[It->second].get() : nullptr;
+        bool Defined = Slot && Slot->BC && Slot->AST && Slot->AST->getBody();
+        H.mix(Name);
+        H.mix(Defined);
+        if (Defined)
+            HashFunction(H, Slot->AST->getProto(), *Slot->AST->getBody(), &Callees);
+    }
+    return H.Hash;
+}
+
+static std::string CacheEntryPath(uint64_t Key) {
+    char Name[32];
+    snprintf(Name, sizeof(Name), "/%016llx.lbc", (unsigned long long)Key);
+    return CacheDir + Name;
+}
+
+/// SerializeBytecode -- F as a cache entry: its fields in order, then a checksum of them
+static std::string SerializeBytecode(uint64_t Key, const BytecodeFunction &F) {
+    std::string Out;
+    auto Put = [&Out](auto V) { Out.append((const char *)&V, sizeof(V)); };
+    auto PutString = [&](const std::string &S) {
+        Put((uint32_t)S.size());
+        Out += S;
+    };
+    Put(CacheMagic);
+    Put(Key);
+    PutString(F.Name);
+    Put((uint32_t)F.NumParams);
+    Put((uint32_t)F.NumRegs);
+    Put((uint32_t)F.Code.size());
+    for (const Instr &I : F.Code) {
+        Put((uint8_t)I.Op);
+        Put(I.N);
+        Put(I.A);
+        Put(I.B);
+        Put(I.C);
+    }
+    Put((uint32_t)F.Consts.size());
+    for (double K : F.Consts)
+        Put(K);
+    for (auto *Names : {&F.Callees, &F.Inlined}) {
+        Put((uint32_t)Names->size());
+        for (auto &Name : *Names)
+            PutString(Name);
+    }
+    CacheHasher H;
+    H.bytes(Out.data(), Out.size());
+    Put(H.Hash);
+    return Out;
+}
+
+/// IsWellFormedBytecode -- what the VM and the JIT take for granted without checking: every register,
+/// constant, callee and jump target in range, and no way to fall off the end. An entry that passes its
+/// checksum can still break these if it was written by a compiler that CodegenVersion didn't tell apart.
+static bool IsWellFormedBytecode(const BytecodeFunction &F) {
+    size_t NumRegs = F.NumRegs;
+    if (F.NumParams > NumRegs || F.Code.empty() || F.Code.back().Op != OP_RET)
+        return false;
+    for (const Instr &I : F.Code) {
+        bool Ok = true;
+        switch (I.Op) {
+            case OP_LOADK:
+                Ok = I.A < NumRegs && I.B < F.Consts.size();
+                break;
+            case OP_MOV:
+                Ok = I.A < NumRegs && I.B < NumRegs;
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_LT:
+                Ok = I.A < NumRegs && I.B < NumRegs && I.C < NumRegs;
+                break;
+            case OP_CALL:
+            case OP_TCALL:
+                Ok = I.A < NumRegs && I.B < F.Callees.size() && (size_t)I.C + I.N <= NumRegs;
+                break;
+            case OP_RET:
+                Ok = I.A < NumRegs;
+                break;
+            case OP_JMP:
+                Ok = JumpTarget(I) < F.Code.size();
+                break;
+            case OP_JMPF:
+                Ok = I.A < NumRegs && JumpTarget(I) < F.Code.size();
+                break;
+            case OP_JNLT:
+                Ok = I.A < NumRegs && I.B < NumRegs && JumpTarget(I) < F.Code.size();
+                break;
+            default:
+                Ok = false;
+        }
+        if (!Ok)
+            return false;
+    }
+    return true;
+}
+
+/// DeserializeBytecode -- SerializeBytecode the other way round, null unless Data is a whole, well-formed
+/// entry for Key
+static std::unique_ptr<BytecodeFunction> DeserializeBytecode(uint64_t Key, const std::string &Data) {
+    if (Data.size() < sizeof(uint64_t))
+        return nullptr;
+    size_t End = Data.size() - sizeof(uint64_t), Pos = 0;
+    uint64_t Sum;
+    memcpy(&Sum, Data.data() + End, sizeof(Sum));
+    CacheHasher H;
+    H.bytes(Data.data(), End);
+    if (H.Hash != Sum)
+        return nullptr;
+
+    bool Ok = true;
+    auto Get = [&](auto &V) {
+        if (End - Pos < sizeof(V)) {
+            Ok = false;
+            return;
+        }
+        memcpy(&V, Data.data() + Pos, sizeof(V));
+        Pos += sizeof(V);
+    };
+    auto GetString = [&](std::string &S) {
+        uint32_t Len = 0;
+        Get(Len);
+        if (!Ok || End - Pos < Len) {
+            Ok = false;
+            return;
+        }
+        S.assign(Data, Pos, Len);
+        Pos += Len;
+    };
+    uint32_t Magic = 0, NumParams = 0, NumRegs = 0, Count = 0;
+    uint64_t EntryKey = 0;
+    auto F = std::make_unique<BytecodeFunction>();
+    Get(Magic);
+    Get(EntryKey);
+    GetString(F->Name);
+    Get(NumParams);
+    Get(NumRegs);
+    if (!Ok || Magic != CacheMagic || EntryKey != Key)
+        return nullptr;
+    F->NumParams = NumParams;
+    F->NumRegs = NumRegs;
+
+    Get(Count);
+    for (uint32_t i = 0; Ok && i < Count; ++i) {
+        Instr I;
+        uint8_t Op = 0;
+        Get(Op);
+        Get(I.N);
+        Get(I.A);
+        Get(I.B);
+        Get(I.C);
+        I.Op = (Opcode)Op;
+        Ok &= Op <= OP_JNLT;
+        F->Code.push_back(I);
+    }
+    Get(Count);
+    for (uint32_t i = 0; Ok && i < Count; ++i) {
+        double K = 0;
+        Get(K);
+        F->Consts.push_back(K);
+    }
+    for (auto *Names : {&F->Callees, &F->Inlined}) {
+        Get(Count);
+        for (uint32_t i = 0; Ok && i < Count; ++i) {
+            Names->emplace_back();
+            GetString(Names->back());
+        }
+    }
+    if (!Ok || Pos != End || !IsWellFormedBytecode(*F))
+        return nullptr;
+    return F;
+}
+
+/// CacheEvict -- find out how much DIR holds, and if it's more than CacheLimit delete the least
+/// recently used entries until it's down to three quarters of that. Other processes may be adding and
+/// deleting entries at the same time, which can only make this count a little off. Temporary files
+/// left behind by a process that died halfway through a write are deleted once they're an hour old.
+static void CacheEvict() {
+    struct Entry {
+        std::string Path;
+        time_t Used;
+        uint64_t Size;
+    };
+    std::vector<Entry> Entries;
+    uint64_t Total = 0;
+    time_t Now = time(nullptr);
+
+    DIR *D = opendir(CacheDir.c_str());
+    if (!D)
+        return;
+    while (struct dirent *E = readdir(D)) {
+        std::string Name = E->d_name;
+        bool IsEntry = Name.size() > 4 && Name.compare(Name.size() - 4, 4, ".lbc") == 0;
+        bool IsTemp = Name.rfind(".tmp.", 0) == 0;
+        struct stat St;
+        std::string Path = CacheDir + "/" + Name;
+        if ((!IsEntry && !IsTemp) || stat(Path.c_str(), &St) != 0)
+            continue;
+        if (IsTemp) {
+            if (Now - St.st_mtime > 3600)
+                unlink(Path.c_str());
+            continue;
+        }
+        Entries.push_back({Path, St.st_mtime, (uint64_t)St.st_size});
+        Total += St.st_size;
+    }
+    closedir(D);
+
+    if (Total > CacheLimit) {
+        std::sort(Entries.begin(), Entries.end(), [](const Entry &L, const Entry &R) { return L.Used < R.Used; });
+        for (const Entry &E : Entries) {
+            if (Total <= CacheLimit / 4 * 3)
+                break;
+            if (unlink(E.Path.c_str()) == 0)
+                ++CacheEvicted;
+            Total -= E.Size;
+        }
+    }
+    CacheBytes = Total;
+}
+
+/// InitCache -- make DIR (and its parents) if need be and trim it to size. False if it can't be used.
+static bool InitCache() {
+    for (size_t Slash = CacheDir.find('/', 1);; Slash = CacheDir.find('/', Slash + 1)) {
+        std::string Dir = CacheDir.substr(0, Slash);
+        if (mkdir(Dir.c_str(), 0777) != 0 && errno != EEXIST)
+            return false;
+        if (Slash == std::string::npos)
+            break;
+    }
+    if (access(CacheDir.c_str(), R_OK | W_OK | X_OK) != 0)
+        return false;
+    CacheEvict();
+    return true;
+}
+
+/// CacheLookup -- the bytecode in Key's entry, null on a miss
+static std::unique_ptr<BytecodeFunction> CacheLookup(uint64_t Key) {
+    ++CacheLookups;
+    std::string Path = CacheEntryPath(Key);
+    std::ifstream In(Path, std::ios::binary);
+    if (!In)
+        return nullptr;
+    std::string Data((std::istreambuf_iterator<char>(In)), std::istreambuf_iterator<char>());
+    auto F = DeserializeBytecode(Key, Data);
+    if (!F) {
+        ++CacheUnreadable;
+        return nullptr;
+    }
+    ++CacheHits;
+    utimensat(AT_FDCWD, Path.c_str(), nullptr, 0); // last used now
+    return F;
+}
+
+/// CacheStore -- write F to Key's entry. Failing to is never an error, the next run just compiles it again.
+static void CacheStore(uint64_t Key, const BytecodeFunction &F) {
+    static unsigned Written = 0;
+    std::string Data = SerializeBytecode(Key, F);
+    std::string Temp = CacheDir + "/.tmp." + std::to_string(getpid()) + "." + std::to_string(Written++);
+    FILE *Out = fopen(Temp.c_str(), "wb");
+    if (!Out)
+        return;
+    bool Ok = fwrite(Data.data(), 1, Data.size(), Out) == Data.size();
+    if (fclose(Out) != 0 || !Ok || rename(Temp.c_str(), CacheEntryPath(Key).c_str()) != 0) {
+        unlink(Temp.c_str());
+        return;
+    }
+    ++CacheStored;
+    CacheBytes += Data.size();
+    if (CacheBytes > CacheLimit)
+        CacheEvict();
+}
+
+/// CompileCached -- the bytecode for Proto and Body, out of the cache if it's there (see CompileItem)
+static std::unique_ptr<BytecodeFunction> CompileCached(const PrototypeAST &Proto, const ExprAST &Body) {
+    auto Compile = [&] { return Optimize ? CompileThroughIR(Proto, &Body) : CompileFunction(Proto, Body); };
+    if (CacheDir.empty() || EmitIR || InlineReport)
+        return Compile();
+
+    uint64_t Key = CacheKey(Proto, Body);
+    if (auto BC = CacheLookup(Key))
+        return BC;
+    auto BC = Compile();
+    if (BC && std::none_of(BC->Callees.begin(), BC->Callees.end(),
+                           [](const std::string &Name) { return Name.find('<') != std::string::npos; }))
+        CacheStore(Key, *BC);
+    return BC;
+}
+
+#else
+
+static bool InitCache() {
+    return false;
+}
+
+static std::unique_ptr<BytecodeFunction> CompileCached(const PrototypeAST &Proto, const ExprAST &Body) {
+    return Optimize ? CompileThroughIR(Proto, &Body) : CompileFunction(Proto, Body);
+}
+
+#endif // LAP_CACHE
+
+// -----------------------------------=======
+//            End Compile Cache
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            Top Level Parsing
+// -----------------------------------=======
+
+/// InstallBuiltinOperators -- reset the operator tables to the builtin binary operators only
+static void InstallBuiltinOperators() {
+    std::fill(std::begin(BinOpPrecedence), std::end(BinOpPrecedence), 0);
+    std::fill(std::begin(UnaryOperators), std::end(UnaryOperators), false);
+
+    BinOpPrecedence['<'] = 10;
+    BinOpPrecedence['+'] = 20;
+    BinOpPrecedence['-'] = 30;
+    BinOpPrecedence['*'] = 40;
+}
+
+/// InstallOperator -- make a user defined binary operator visible to the expression parser.
+static void InstallOperator(const PrototypeAST &Proto) {
+    if (Proto.isBinaryOp())
+        BinOpPrecedence[(unsigned char)Proto.getOperatorName()] = (int)Proto.getBinaryPrecedence();
+    else if (Proto.isUnaryOp())
+        UnaryOperators[(unsigned char)Proto.getOperatorName()] = true;
+}
+
+/// SynchronizeTopLevel -- panic-mode error recovery. After a syntax error drop every token up to
+/// the next one that can start (or end) a top-level item, so one bad line produces one error and
+/// not one per token that follows it. The parsers always eat at least one token before an error
+/// can happen, so this can't get stuck.
+static void SynchronizeTopLevel() {
+    while (CurTok != ';' && CurTok != tok_def && CurTok != tok_extern && CurTok != tok_eof)
+        getNextToken();
+}
+
+/// Engine -- what runs top-level expressions, --engine=ast (the default), --engine=vm, --engine=jit or
+/// --engine=tiered
+enum EngineKind {
+    Engine_AST,
+    Engine_VM,
+    Engine_JIT,
+    Engine_Tiered,
+    Engine_Object, // --emit-obj and --emit-exe: nothing runs, see Object Files
+};
+static EngineKind Engine = Engine_AST;
+
+/// SinglePass / EmitBytecode -- --single-pass parses straight to bytecode (see the Single-pass Bytecode
+/// Parser section), --emit-bytecode prints the bytecode of every item. --single-pass implies
+/// --engine=vm (unless it's jit) and ignores --lazy.
+static bool SinglePass = false;
+static bool EmitBytecode = false;
+
+/// CompilesItems -- whether items are compiled to bytecode: for every engine but the evaluator, and
+/// for --emit-bytecode and --emit-ir whatever the engine
+static bool CompilesItems() {
+    return Engine != Engine_AST || EmitBytecode || EmitIR;
+}
+
+/// ParsedItem -- the result of parsing one top-level item, kept until it is handled so that items
+/// parsed out of order (see ParseItemsInParallel) can still be reported in source order.
+struct ParsedItem {
+    enum ItemKind { Definition, Extern, TopLevelExpr, Error } Kind = Error;
+    std::unique_ptr<FunctionAST> Fn;      // Definition, TopLevelExpr
+    std::unique_ptr<PrototypeAST> Proto;  // Extern, and Definition with --single-pass
+    std::unique_ptr<BytecodeFunction> BC; // --single-pass, null if the item failed to compile
+    std::vector<std::string> Diags;
+};
+
+/// ParseTopLevelItem -- parse the item starting at CurTok, which must not be ';' or eof.
+static ParsedItem ParseTopLevelItem() {
+    ParsedItem Item;
+    switch (CurTok) {
+        case tok_def:
+            if (SinglePass ? (bool)(Item.Proto = EmitDefinition(Item.BC)) : (bool)(Item.Fn = ParseDefinition()))
+                Item.Kind = ParsedItem::Definition;
+            break;
+        case tok_extern:
+            if ((Item.Proto = ParseExtern()))
+                Item.Kind = ParsedItem::Extern;
+            break;
+        default:
+            // Evaluate a top-level expression into an anonymous function.
+            if (SinglePass ? EmitTopLevelExpr(Item.BC) : (bool)(Item.Fn = ParseTopLevelExpr()))
+                Item.Kind = ParsedItem::TopLevelExpr;
+            break;
+    }
+
+    if (Item.Kind == ParsedItem::Error)
+        SynchronizeTopLevel();
+    Item.Diags = std::move(PendingDiags);
+    PendingDiags.clear();
+    return Item;
+}
+
+/// ParsePendingBodies -- a lazy body has to be parsed with the operators that existed when it was
+/// defined, so all pending bodies are parsed before a new operator is installed. Their errors stay
+/// attached to them and are still reported on first use, or at the end of the run. Operator
+/// definitions are rare, so the walk over every definition doesn't matter in practice.
+static void ParsePendingBodies() {
+    for (auto &Def : FunctionDefs)
+        if (Def.second->isBodyPending())
+            ParseLazyBody(*Def.second);
+}
+
+/// ParseRemainingBodies -- before the run ends, every body nothing needed is parsed after all and its
+/// errors are reported, so --lazy never changes which diagnostics come out or the exit status.
+static void ParseRemainingBodies() {
+    for (auto &Def : FunctionDefs)
+        GetFunctionBody(*Def.second);
+}
+
+/// LoadCallees -- the parse-only driver's notion of "using" a function: a top-level expression needs
+/// the bodies of everything it can reach, so with --lazy those (and only those) get parsed here.
+static void LoadCallees(const ExprAST &E) {
+    const std::string *Callee = nullptr;
+    std::string OpName;
+
+    switch (E.getKind()) {
+        case EK_Number:
+        case EK_Variable:
+            return;
+        case EK_If: {
+            auto &I = static_cast<const IfExprAST &>(E);
+            LoadCallees(I.getCond());
+            LoadCallees(I.getThen());
+            LoadCallees(I.getElse());
+            return;
+        }
+        case EK_Unary: {
+            auto &U = static_cast<const UnaryExprAST &>(E);
+            LoadCallees(U.getOperand());
+            OpName = std::string("unary") + U.getOpcode();
+            Callee = &OpName;
+            break;
+        }
+        case EK_Binary: {
+            auto &B = static_cast<const BinaryExprAST &>(E);
+            LoadCallees(B.getLHS());
+            LoadCallees(B.getRHS());
+            OpName = std::string("binary") + B.getOp();
+            Callee = &OpName;
+            break;
+        }
+        case EK_Call: {
+            auto &C = static_cast<const CallExprAST &>(E);
+            for (auto &Arg : C.getArgs())
+                LoadCallees(*Arg);
+            Callee = &C.getCallee();
+            break;
+        }
+    }
+
+    auto It = FunctionDefs.find(*Callee);
+    if (It == FunctionDefs.end() || It->second->markCalleesLoaded())
+        return;
+    if (ExprAST *Body = GetFunctionBody(*It->second))
+        LoadCallees(*Body);
+}
+
+/// CompileItem -- the bytecode for a parsed definition or top-level expression. With --single-pass
+/// the parser already made it, otherwise the AST is compiled here (through the SSA IR with --opt, and
+/// unless it's in the Compile Cache) and any error goes to PendingDiags.
+/// Either way its callees come back bound to their slots.
+static std::unique_ptr<BytecodeFunction> CompileItem(ParsedItem &Item, FunctionAST *Fn) {
+    std::unique_ptr<BytecodeFunction> BC;
+    if (SinglePass) {
+        BC = std::move(Item.BC);
+    } else if (ExprAST *Body = GetFunctionBody(*Fn)) {
+        BC = CompileCached(Fn->getProto(), *Body);
+    }
+    if (BC) {
+        BindCallees(*BC);
+        NoteInlined(*BC);
+    }
+    return BC;
+}
+
+static void HandleParsedItem(ParsedItem &Item) {
+    switch (Item.Kind) {
+        case ParsedItem::Definition: {
+            FunctionAST *Fn = Item.Fn.get();
+            const PrototypeAST &Proto = Fn ? Fn->getProto() : *Item.Proto;
+            bool DefinesOperator = Proto.isUnaryOp() || Proto.isBinaryOp();
+            if (Fn) {
+                auto &Slot = FunctionDefs[Proto.getName()];
+                if (Slot && LazyBodies)
+                    GetFunctionBody(*Slot); // last chance to report errors in the body being replaced
+                Slot = std::move(Item.Fn);
+                FunctionSlotFor(Proto.getName()).AST = Slot.get();
+                if (DefinesOperator && LazyBodies)
+                    ParsePendingBodies();
+            }
+            if (DefinesOperator)
+                InstallOperator(Proto);
+            ++DefinitionsVersion;
+            fprintf(stderr, "Parsed a function definition.\n");
+
+            if (CompilesItems()) {
+                if (auto BC = CompileItem(Item, Fn)) {
+                    if (EmitBytecode)
+                        DumpBytecode(*BC, stdout);
+                    DefineBytecodeFunction(std::move(BC));
+                    if (Optimize)
+                        RecompileInliners(FunctionSlotFor(Proto.getName()));
+                }
+            }
+            break;
+        }
+        case ParsedItem::Extern:
+            fprintf(stderr, "Parsed an extern.\n");
+            ++DefinitionsVersion;
+            BindExtern(*Item.Proto);
+            {
+                std::lock_guard<std::mutex> Lock(DefinitionsLock);
+                ExternProtos[Item.Proto->getName()] = std::move(Item.Proto);
+            }
+            break;
+        case ParsedItem::TopLevelExpr:
+            fprintf(stderr, "Parsed a top-level expr\n");
+            if (LazyBodies && !SinglePass)
+                LoadCallees(*Item.Fn->getBody());
+            UpdateMemoization();
+
+            if (Engine == Engine_AST) {
+                double Result;
+                FunctionAST &Fn = *Item.Fn;
+                if (EvaluateTopLevel(Fn, Result)) {
+                    fprintf(stderr, "Evaluated to %f\n", Result);
+                    if (BenchRuns)
+                        Benchmark([&](double &R) { return EvaluateTopLevel(Fn, R); });
+                }
+            }
+
+            if (CompilesItems()) {
+                auto BC = CompileItem(Item, Item.Fn.get());
+                if (BC && EmitBytecode)
+                    DumpBytecode(*BC, stdout);
+                if (BC && Engine == Engine_Object) {
+                    AddObjectExpression(std::move(BC));
+                    break;
+                }
+
+                double Result;
+                if (BC && Engine == Engine_VM && RunBytecode(*BC, Result)) {
+                    fprintf(stderr, "Evaluated to %f\n", Result);
+                    if (BenchRuns)
+                        Benchmark([&](double &R) { return RunBytecode(*BC, R); });
+                }
+#if LAP_NATIVE
+                std::unique_ptr<NativeFunction> Code;
+                if (BC && Engine == Engine_JIT)
+                    Code = CompileNative(*BC);
+                if (Code && RunNative(*Code, Result)) {
+                    fprintf(stderr, "Evaluated to %f\n", Result);
+                    if (BenchRuns)
+                        Benchmark([&](double &R) { return RunNative(*Code, R); });
+                }
+
+                if (BC && Engine == Engine_Tiered && RunTiered(*BC, Result)) {
+                    fprintf(stderr, "Evaluated to %f\n", Result);
+                    if (BenchRuns)
+                        Benchmark([&](double &R) { return RunTiered(*BC, R); });
+                }
+#endif
+            }
+            break;
+        case ParsedItem::Error:
+            break;
+    }
+    ReportDiagnostics(Item.Diags);
+    ReportDiagnostics(PendingDiags);
+}
+
+/// top ::= definition | external | expression | ';'
+static void MainLoop() {
+    while (true) {
+        fprintf(stderr, "ready> ");
+        switch(CurTok) {
+            case tok_eof:
+                return;
+            case ';': // ignore top-level semicolons
+                getNextToken();
+                break;
+            default: {
+                ParsedItem Item = ParseTopLevelItem();
+                HandleParsedItem(Item);
+                break;
+            }
+        }
+
+        if (TooManyErrors()) {
+            fprintf(stderr, "Error: too many errors emitted, stopping now (use --max-errors=0 for no limit)\n");
+            return;
+        }
+    }
+}
+
+// -----------------------------------=======
+//            Parallel Parsing
+// -----------------------------------=======
+
+/*
+ * A top-level item never consumes a ';', def or extern other than the def/extern it starts with
+ * (the expression parser stops with an error on any of them), so cutting the token stream in front
+ * of each def/extern and at each ';' gives exactly the token ranges MainLoop would parse one after
+ * another. Each range can then be parsed on its own, with its own CurTok/IdentifierStr/NumVal, and
+ * parsing one range to its end gives the same items and errors as the serial parser.
+ *
+ * The one thing shared between items is the operator tables: a "def binary" changes how everything
+ * after it parses. Ranges are therefore parsed in batches that end with an operator definition, and
+ * the operator is installed (by HandleParsedItem) before the next batch starts.
+ */
+
+/// ItemRange -- the tokens [Begin, End) of one top-level item, found by ScanItemRanges.
+struct ItemRange {
+    size_t Begin, End;
+    bool DefinesOperator;
+};
+
+static std::vector<ItemRange> ScanItemRanges(const std::vector<LexedToken> &Tokens) {
+    std::vector<ItemRange> Ranges;
+    size_t Begin = 0;
+    auto Close = [&](size_t End) {
+        if (End > Begin) {
+            bool DefinesOp = Tokens[Begin].Tok == tok_def && Begin + 1 < End &&
+                             (Tokens[Begin + 1].Tok == tok_binary || Tokens[Begin + 1].Tok == tok_unary);
+            Ranges.push_back({Begin, End, DefinesOp});
+        }
+    };
+
+    for (size_t i = 0; i < Tokens.size(); ++i) {
+        int Tok = Tokens[i].Tok;
+        if (Tok == ';') {
+            Close(i);
+            Begin = i + 1;
+        } else if (Tok == tok_def || Tok == tok_extern) {
+            Close(i);
+            Begin = i;
+        }
+    }
+    Close(Tokens.size());
+    return Ranges;
+}
+
+/// ParseItemRange -- MainLoop over one item range, on whatever thread calls it. A range normally holds
+/// one item, but "def f(x) x 4" is a definition followed by a top-level expression.
+static std::vector<ParsedItem> ParseItemRange(const TokenBuffer &Buf, const ItemRange &R) {
+    TokenRange Range{Buf.Tokens.data() + R.Begin, Buf.Tokens.data() + R.End, Buf.Names.data()};
+    CurRange = &Range;
+
+    std::vector<ParsedItem> Items;
+    getNextToken();
+    while (CurTok != tok_eof)
+        Items.push_back(ParseTopLevelItem());
+
+    CurRange = nullptr;
+    return Items;
+}
+
+/// ParseItemsInParallel -- lex all of the input, then parse the top-level items on NumThreads worker
+/// threads and hand them to HandleParsedItem in source order.
+static void ParseItemsInParallel(unsigned NumThreads) {
+    InputTokens = LexAll();
+    const TokenBuffer &Buf = InputTokens;
+    std::vector<ItemRange> Ranges = ScanItemRanges(Buf.Tokens);
+    std::vector<std::vector<ParsedItem>> Results(Ranges.size());
+
+    // Items are tiny, so workers claim them in chunks of up to ChunkSize. A chunk never crosses the
+    // end of a batch, and the chunks of batch N can't be parsed before batch N-1 has been handled.
+    const size_t ChunkSize = 64;
+    struct Chunk {
+        size_t First, Last;
+        unsigned Batch;
+    };
+    std::vector<Chunk> Chunks;
+    unsigned NumBatches = 0;
+    for (size_t First = 0; First < Ranges.size(); ++NumBatches) {
+        size_t BatchEnd = First;
+        while (BatchEnd < Ranges.size() && !Ranges[BatchEnd].DefinesOperator)
+            ++BatchEnd;
+        if (BatchEnd < Ranges.size())
+            ++BatchEnd; // the operator definition itself is the last item of the batch
+
+        for (; First < BatchEnd; First += std::min(ChunkSize, BatchEnd - First))
+            Chunks.push_back({First, std::min(First + ChunkSize, BatchEnd), NumBatches});
+    }
+
+    std::mutex Lock;
+    std::condition_variable ChunkDone, BatchHandled;
+    std::vector<char> Done(Chunks.size(), 0);
+    unsigned HandledBatches = 0; // batches before this one have been handled
+    bool Stop = false;
+    std::atomic<size_t> NextChunk{0};
+
+    auto Worker = [&]() {
+        while (true) {
+            size_t C = NextChunk.fetch_add(1);
+            if (C >= Chunks.size())
+                return;
+
+            {
+                std::unique_lock<std::mutex> Guard(Lock);
+                BatchHandled.wait(Guard, [&] { return Stop || HandledBatches >= Chunks[C].Batch; });
+                if (Stop)
+                    return;
+            }
+
+            for (size_t i = Chunks[C].First; i < Chunks[C].Last; ++i)
+                Results[i] = ParseItemRange(Buf, Ranges[i]);
+
+            {
+                std::lock_guard<std::mutex> Guard(Lock);
+                Done[C] = 1;
+            }
+            ChunkDone.notify_one();
+        }
+    };
+
+    std::vector<std::thread> Threads;
+    for (unsigned t = 0; t < NumThreads; ++t)
+        Threads.emplace_back(Worker);
+
+    bool GaveUp = false;
+    for (size_t C = 0; C < Chunks.size() && !GaveUp; ++C) {
+        {
+            std::unique_lock<std::mutex> Guard(Lock);
+            ChunkDone.wait(Guard, [&] { return Done[C] != 0; });
+        }
+
+        for (size_t i = Chunks[C].First; i < Chunks[C].Last && !GaveUp; ++i) {
+            for (auto &Item : Results[i]) {
+                HandleParsedItem(Item);
+                if (TooManyErrors()) {
+                    fprintf(stderr, "Error: too many errors emitted, stopping now (use --max-errors=0 for no limit)\n");
+                    GaveUp = true;
+                    break;
+                }
+            }
+            Results[i].clear();
+        }
+
+        if (!GaveUp && (C + 1 == Chunks.size() || Chunks[C + 1].Batch != Chunks[C].Batch)) {
+            {
+                std::lock_guard<std::mutex> Guard(Lock);
+                HandledBatches = Chunks[C].Batch + 1;
+            }
+            BatchHandled.notify_all();
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Stop = true;
+    }
+    BatchHandled.notify_all();
+    for (auto &T : Threads)
+        T.join();
+}
+
+// -----------------------------------=======
+//            End Parallel Parsing
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            Incremental Parsing
+// -----------------------------------=======
+
+/*
+ * IncrementalParser keeps the items of the last version of a source it parsed, keyed by a hash of
+ * their tokens, and on the next version only parses the item ranges (see ScanItemRanges) whose key it
+ * hasn't seen. A range parses the same wherever it is in the file as long as the operators defined
+ * before it are the same, so the key also covers the tokens of every operator definition before it:
+ * editing a "def binary" reparses everything after it, editing anything else reparses just that item.
+ */
+
+/// ParseDelta -- what changed between two versions, by definition name. Top-level expressions have no
+/// name to follow them by, they are only counted in ItemsReparsed / ItemsReused.
+struct ParseDelta {
+    std::vector<std::string> Added, Removed, Changed;
+    size_t ItemsReparsed = 0, ItemsReused = 0;
+    std::vector<std::string> Diags; // errors from the items that were reparsed, in source order
+};
+
+/// HashTokens -- FNV-1a over the kinds and values of the tokens in R
+static uint64_t HashTokens(const TokenBuffer &Buf, const ItemRange &R, uint64_t Hash = 14695981039346656037ull) {
+    auto Mix = [&Hash](const void *Data, size_t Len) {
+        for (size_t i = 0; i < Len; ++i) {
+            Hash ^= ((const unsigned char *)Data)[i];
+            Hash *= 1099511628211ull;
+        }
+    };
+
+    for (size_t i = R.Begin; i < R.End; ++i) {
+        const LexedToken &T = Buf.Tokens[i];
+        Mix(&T.Tok, sizeof(T.Tok));
+        if (T.Tok == tok_number)
+            Mix(&T.NumVal, sizeof(T.NumVal));
+        else if (T.Tok == tok_identifier) {
+            Mix(&T.NameLen, sizeof(T.NameLen));
+            Mix(Buf.Names.data() + T.NameBegin, T.NameLen);
+        }
+    }
+    return Hash;
+}
+
+class IncrementalParser {
+    struct Entry {
+        uint64_t Key;
+        std::vector<ParsedItem> Items;
+    };
+
+    std::vector<Entry> Entries;
+    std::map<std::string, uint64_t> DefKeys; // definition name -> key of the entry that defines it last
+
+    static const PrototypeAST *definitionProto(const ParsedItem &Item) {
+        if (Item.Kind != ParsedItem::Definition)
+            return nullptr;
+        return Item.Fn ? &Item.Fn->getProto() : Item.Proto.get();
+    }
+
+public:
+    /// update -- parse Source as the next version of the input. Leaves the operator tables as Source defines them.
+    ParseDelta update(const std::string &Source) {
+        ParseDelta Delta;
+        TokenBuffer Buf = LexSource(Source);
+        std::vector<ItemRange> Ranges = ScanItemRanges(Buf.Tokens);
+
+        std::unordered_multimap<uint64_t, size_t> OldByKey;
+        for (size_t i = 0; i < Entries.size(); ++i)
+            OldByKey.emplace(Entries[i].Key, i);
+
+        InstallBuiltinOperators();
+        uint64_t OperatorsHash = 14695981039346656037ull;
+        std::vector<Entry> NewEntries;
+        NewEntries.reserve(Ranges.size());
+
+        for (const ItemRange &R : Ranges) {
+            Entry E;
+            E.Key = HashTokens(Buf, R, OperatorsHash);
+
+            auto It = OldByKey.find(E.Key);
+            if (It != OldByKey.end()) {
+                E.Items = std::move(Entries[It->second].Items);
+                OldByKey.erase(It);
+                ++Delta.ItemsReused;
+            } else {
+                E.Items = ParseItemRange(Buf, R);
+                ++Delta.ItemsReparsed;
+                for (auto &Item : E.Items)
+                    for (auto &D : Item.Diags)
+                        Delta.Diags.push_back(std::move(D));
+            }
+
+            for (auto &Item : E.Items)
+                if (const PrototypeAST *Proto = definitionProto(Item))
+                    InstallOperator(*Proto);
+            if (R.DefinesOperator)
+                OperatorsHash = HashTokens(Buf, R, OperatorsHash);
+
+            NewEntries.push_back(std::move(E));
+        }
+
+        std::map<std::string, uint64_t> NewDefKeys;
+        for (const Entry &E : NewEntries)
+            for (const auto &Item : E.Items)
+                if (const PrototypeAST *Proto = definitionProto(Item))
+                    NewDefKeys[Proto->getName()] = E.Key;
+
+        for (const auto &Def : NewDefKeys) {
+            auto Old = DefKeys.find(Def.first);
+            if (Old == DefKeys.end())
+                Delta.Added.push_back(Def.first);
+            else if (Old->second != Def.second)
+                Delta.Changed.push_back(Def.first);
+        }
+        for (const auto &Def : DefKeys)
+            if (!NewDefKeys.count(Def.first))
+                Delta.Removed.push_back(Def.first);
+
+        Entries = std::move(NewEntries);
+        DefKeys = std::move(NewDefKeys);
+        return Delta;
+    }
+
+    /// definition -- the current FunctionAST for Name, null if there is none (or with --single-pass)
+    const FunctionAST *definition(const std::string &Name) const {
+        for (auto E = Entries.rbegin(); E != Entries.rend(); ++E)
+            for (auto Item = E->Items.rbegin(); Item != E->Items.rend(); ++Item)
+                if (const PrototypeAST *Proto = definitionProto(*Item))
+                    if (Proto->getName() == Name)
+                        return Item->Fn.get();
+        return nullptr;
+    }
+};
+
+/// RunIncremental -- --incremental: parse each file as an edit of the one before it and print the deltas
+static void RunIncremental(const std::vector<std::string> &Files) {
+    IncrementalParser Parser;
+    for (const std::string &File : Files) {
+        std::ifstream In(File, std::ios::binary);
+        if (!In) {
+            fprintf(stderr, "Error: can't open %s\n", File.c_str());
+            ++NumErrors;
+            return;
+        }
+        std::string Source((std::istreambuf_iterator<char>(In)), std::istreambuf_iterator<char>());
+
+        ParseDelta Delta = Parser.update(Source);
+        ReportDiagnostics(Delta.Diags);
+
+        fprintf(stderr, "%s: %zu items reparsed, %zu reused\n", File.c_str(), Delta.ItemsReparsed, Delta.ItemsReused);
+        auto Print = [](const char *What, const std::vector<std::string> &Names) {
+            if (Names.empty())
+                return;
+            fprintf(stderr, "  %s:", What);
+            for (const auto &Name : Names)
+                fprintf(stderr, " %s", Name.c_str());
+            fprintf(stderr, "\n");
+        };
+        Print("added", Delta.Added);
+        Print("removed", Delta.Removed);
+        Print("changed", Delta.Changed);
+    }
+}
+
+// -----------------------------------=======
+//            End Incremental Parsing
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            Work-Stealing Pool
+// -----------------------------------=======
+
+/*
+ * WorkStealingPool runs the tasks of one run() call on its worker threads. Each worker has its own
+ * queue and starts out with an even, contiguous share of the tasks, which it takes from the front, in
+ * order. A worker whose queue is empty steals from the back of the others', the tasks their owners
+ * would get to last, so a slow thread (or core) costs its neighbours only the tail of its share.
+ *
+ * Tasks are meant to be big (a chunk of a batch), so a mutex per queue is all the synchronisation
+ * needed. The queues are cache line aligned so that locking one doesn't disturb another.
+ */
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned NumThreads) {
+        for (unsigned i = 0; i < NumThreads; ++i)
+            Queues.push_back(std::make_unique<TaskQueue>());
+        for (unsigned i = 0; i < NumThreads; ++i)
+            Threads.emplace_back([this, i] { work(i); });
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            Stop = true;
+        }
+        Wake.notify_all();
+        for (auto &T : Threads)
+            T.join();
+    }
+
+    unsigned size() const { return (unsigned)Threads.size(); }
+
+    /// run -- Task(0) to Task(NumTasks - 1) on the workers, returns when all of them have finished and
+    /// no worker still holds Task, so a late one can't take the next run's tasks through a dead pointer.
+    /// One run at a time.
+    void run(size_t NumTasks, const std::function<void(size_t)> &Task) {
+        std::unique_lock<std::mutex> Guard(Lock);
+        size_t NumQueues = Queues.size();
+        for (size_t Q = 0; Q < NumQueues; ++Q) {
+            std::lock_guard<std::mutex> QueueGuard(Queues[Q]->Lock);
+            for (size_t T = NumTasks * Q / NumQueues; T < NumTasks * (Q + 1) / NumQueues; ++T)
+                Queues[Q]->Tasks.push_back(T);
+        }
+        Current = &Task;
+        Remaining = NumTasks;
+        ++Generation;
+        Wake.notify_all();
+        Finished.wait(Guard, [&] { return Remaining == 0 && Active == 0; });
+        Current = nullptr;
+    }
+
+    uint64_t steals() const { return Steals.load(std::memory_order_relaxed); }
+
+private:
+    struct alignas(64) TaskQueue {
+        std::mutex Lock;
+        std::deque<size_t> Tasks;
+    };
+
+    std::vector<std::unique_ptr<TaskQueue>> Queues;
+    std::vector<std::thread> Threads;
+    std::mutex Lock;
+    std::condition_variable Wake, Finished;
+    const std::function<void(size_t)> *Current = nullptr;
+    size_t Remaining = 0;
+    unsigned Active = 0; // workers that took Current and haven't reported back
+    uint64_t Generation = 0;
+    bool Stop = false;
+    std::atomic<uint64_t> Steals{0};
+
+    bool next(unsigned Self, size_t &T) {
+        {
+            TaskQueue &Own = *Queues[Self];
+            std::lock_guard<std::mutex> Guard(Own.Lock);
+            if (!Own.Tasks.empty()) {
+                T = Own.Tasks.front();
+                Own.Tasks.pop_front();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < Queues.size(); ++i) {
+            TaskQueue &Victim = *Queues[(Self + i) % Queues.size()];
+            std::lock_guard<std::mutex> Guard(Victim.Lock);
+            if (!Victim.Tasks.empty()) {
+                T = Victim.Tasks.back();
+                Victim.Tasks.pop_back();
+                Steals.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(unsigned Self) {
+        uint64_t Seen = 0;
+        while (true) {
+            const std::function<void(size_t)> *Task;
+            {
+                std::unique_lock<std::mutex> Guard(Lock);
+                Wake.wait(Guard, [&] { return Stop || Generation != Seen; });
+                if (Stop)
+                    return;
+                Seen = Generation;
+                Task = Current;
+                if (!Task)
+                    continue; // woke after that run was over
+                ++Active;
+            }
+
+            size_t T, Done = 0;
+            while (next(Self, T)) {
+                (*Task)(T);
+                ++Done;
+            }
+
+            std::lock_guard<std::mutex> Guard(Lock);
+            Remaining -= Done;
+            --Active;
+            if (!Remaining && !Active)
+                Finished.notify_all();
+        }
+    }
+};
+
+// -----------------------------------=======
+//            End Work-Stealing Pool
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            Batch Evaluation
+// -----------------------------------=======
+
+/*
+ * EvaluateBatch applies one definition to many rows of arguments, given as one column per parameter.
+ * The body (with every user function it calls inlined) is compiled to a BatchKernel, a straight list of
+ * operations over whole blocks of BatchBlockRows rows, so each operation is one loop that does 4 rows
+ * per AVX2 instruction (2 with SSE2) instead of one interpreted node per row. An if computes both of
+ * its branches and selects per row, which is only allowed because a kernel can't have side effects or
+ * fail: it may only call libm externs, and anything it can't take (recursion, other externs, unknown
+ * names) leaves the function to EvaluateRowsScalar, which runs it a row at a time with the engine in use.
+ *
+ * Every operation is the same IEEE operation the scalar engines do, in the same order, so the results
+ * are the same bit for bit.
+ *
+ * Big batches are cut into chunks of about BatchChunkBytes of input and output and run on a
+ * WorkStealingPool with --batch-threads workers (all cores by default). Kernels only read the
+ * BatchKernel and keep their scratch registers per thread, and the chunk edges fall on cache line
+ * boundaries of Out, so threads never write to the same line. The one call per row fallback stays on
+ * the main thread: the evaluator and the native code keep their state in globals.
+ */
+
+/// BatchBlockRows -- rows per block, small enough that a kernel's registers stay in L1/L2
+static const size_t BatchBlockRows = 256;
+
+/// BatchChunkBytes -- the input and output a chunk covers, about what fits in a core's L2
+static const size_t BatchChunkBytes = 256 * 1024;
+
+/// BatchThreads -- --batch-threads=N, 0 for one per core
+static unsigned BatchThreads = 0;
+
+/// BatchMaxOps / BatchMaxRegs -- beyond these (inlining can blow a function up) the kernel isn't worth it
+static const size_t BatchMaxOps = 4096;
+static const unsigned BatchMaxRegs = 1024;
+
+/// BatchISA -- the instruction set the kernels use, the best the CPU has unless --batch-isa= asks for less
+enum BatchISA { ISA_Scalar, ISA_SSE2, ISA_AVX2 };
+static BatchISA BatchISALimit = ISA_AVX2;
+
+static const char *BatchISAName(BatchISA ISA) {
+    return ISA == ISA_AVX2 ? "avx2" : ISA == ISA_SSE2 ? "sse2" : "scalar";
+}
+
+static BatchISA SelectBatchISA() {
+#if LAP_BATCH_X86
+    BatchISA Best = __builtin_cpu_supports("avx2") ? ISA_AVX2 : ISA_SSE2;
+#else
+    BatchISA Best = ISA_Scalar;
+#endif
+    return std::min(Best, BatchISALimit);
+}
+
+enum BatchOpcode : uint8_t {
+    BO_Add,    // Dst = Src[0] + Src[1]
+    BO_Sub,    // Dst = Src[0] - Src[1]
+    BO_Mul,    // Dst = Src[0] * Src[1]
+    BO_Lt,     // Dst = Src[0] < Src[1] ? 1.0 : 0.0
+    BO_Select, // Dst = IsTrue(Src[0]) ? Src[1] : Src[2]
+    BO_Call,   // Dst = Fn(Args...), an extern
+};
+
+struct BatchOp {
+    BatchOpcode Op;
+    unsigned Dst;
+    unsigned Src[3];
+    void *Fn = nullptr;
+    std::vector<unsigned> Args;
+};
+
+/// BatchKernel -- registers are blocks of rows: the parameters' are windows into the input columns, the
+/// others live in scratch and are written by Ops, except the constants' which are filled in once.
+struct BatchKernel {
+    unsigned NumParams = 0;
+    unsigned NumRegs = 0;
+    std::vector<std::pair<unsigned, double>> Consts;
+    std::vector<BatchOp> Ops;
+    unsigned Result = 0;
+};
+
+/// BatchCompiler -- AST to BatchKernel. Registers that hold temporaries are reused as soon as the
+/// operation reading them is emitted, unless they are an inlined call's argument, which is pinned while
+/// the callee's body is compiled.
+class BatchCompiler {
+    BatchKernel &K;
+    std::vector<bool> IsTemp;
+    std::vector<unsigned> Pinned;
+    std::vector<unsigned> Free;
+    std::map<uint64_t, unsigned> ConstRegs;
+    std::vector<const FunctionSlot *> Inlining; // for spotting recursion
+    bool Failed = false;
+
+    unsigned fail() {
+        Failed = true;
+        return 0;
+    }
+
+    unsigned newReg(bool Temp) {
+        if (Temp && !Free.empty()) {
+            unsigned R = Free.back();
+            Free.pop_back();
+            return R;
+        }
+        if (K.NumRegs >= BatchMaxRegs)
+            return fail();
+        IsTemp.push_back(Temp);
+        Pinned.push_back(0);
+        return K.NumRegs++;
+    }
+
+    void release(unsigned R) {
+        if (R < IsTemp.size() && IsTemp[R] && !Pinned[R] && std::find(Free.begin(), Free.end(), R) == Free.end())
+            Free.push_back(R);
+    }
+
+    unsigned constant(double V) {
+        uint64_t Bits;
+        memcpy(&Bits, &V, 8);
+        auto It = ConstRegs.find(Bits);
+        if (It != ConstRegs.end())
+            return It->second;
+        unsigned R = newReg(false);
+        K.Consts.push_back({R, V});
+        return ConstRegs[Bits] = R;
+    }
+
+    unsigned emit(BatchOpcode Op, std::initializer_list<unsigned> Srcs) {
+        BatchOp I{};
+        I.Op = Op;
+        size_t N = 0;
+        for (unsigned R : Srcs)
+            I.Src[N++] = R;
+        for (unsigned R : Srcs)
+            release(R);
+        I.Dst = newReg(true);
+        if (K.Ops.size() >= BatchMaxOps)
+            return fail();
+        K.Ops.push_back(std::move(I));
+        return K.Ops.back().Dst;
+    }
+
+    /// call -- Name applied to Args: an inlined definition, or a libm extern
+    unsigned call(const std::string &Name, std::vector<unsigned> Args) {
+        const FunctionSlot &Slot = FunctionSlotFor(Name);
+        if (Slot.AST) {
+            const PrototypeAST &Proto = Slot.AST->getProto();
+            const ExprAST *Body = GetFunctionBody(*Slot.AST);
+            if (!Body || Proto.getArgs().size() != Args.size() ||
+                std::find(Inlining.begin(), Inlining.end(), &Slot) != Inlining.end())
+                return fail();
+            for (unsigned R : Args)
+                ++Pinned[R];
+            Inlining.push_back(&Slot);
+            unsigned Result = compile(*Body, Proto, Args);
+            Inlining.pop_back();
+            for (unsigned R : Args) {
+                --Pinned[R];
+                if (R != Result)
+                    release(R);
+            }
+            return Result;
+        }
+        if (!Slot.Extern || LibmArity(Name) < 0 || Slot.ExternArity != Args.size())
+            return fail();
+        if (K.Ops.size() >= BatchMaxOps)
+            return fail();
+        for (unsigned R : Args)
+            release(R);
+        BatchOp I{};
+        I.Op = BO_Call;
+        I.Fn = Slot.Extern;
+        I.Args = std::move(Args);
+        I.Dst = newReg(true);
+        K.Ops.push_back(std::move(I));
+        return K.Ops.back().Dst;
+    }
+
+public:
+    explicit BatchCompiler(BatchKernel &K) : K(K), IsTemp(K.NumRegs, false), Pinned(K.NumRegs, 0) {}
+
+    /// compile -- E in a function with prototype Proto whose parameters are in registers Params
+    unsigned compile(const ExprAST &E, const PrototypeAST &Proto, const std::vector<unsigned> &Params) {
+        if (Failed)
+            return 0;
+        switch (E.getKind()) {
+            case EK_Number:
+                return constant(static_cast<const NumberExprAST &>(E).getValue());
+            case EK_Variable: {
+                const auto &Args = Proto.getArgs();
+                const std::string &Name = static_cast<const VariableExprAST &>(E).getName();
+                for (size_t i = Args.size(); i-- > 0;) // the last of two parameters with one name wins
+                    if (Args[i] == Name)
+                        return Params[i];
+                return fail();
+            }
+            case EK_Unary: {
+                auto &U = static_cast<const UnaryExprAST &>(E);
+                unsigned R = compile(U.getOperand(), Proto, Params);
+                return call(std::string("unary") + U.getOpcode(), {R});
+            }
+            case EK_Binary: {
+                auto &B = static_cast<const BinaryExprAST &>(E);
+                unsigned L = compile(B.getLHS(), Proto, Params);
+                unsigned R = compile(B.getRHS(), Proto, Params);
+                switch (B.getOp()) {
+                    case '+': return emit(BO_Add, {L, R});
+                    case '-': return emit(BO_Sub, {L, R});
+                    case '*': return emit(BO_Mul, {L, R});
+                    case '<': return emit(BO_Lt, {L, R});
+                }
+                return call(std::string("binary") + B.getOp(), {L, R});
+            }
+            case EK_Call: {
+                auto &C = static_cast<const CallExprAST &>(E);
+                std::vector<unsigned> Args;
+                for (auto &Arg : C.getArgs())
+                    Args.push_back(compile(*Arg, Proto, Params));
+                return call(C.getCallee(), std::move(Args));
+            }
+            case EK_If: {
+                auto &I = static_cast<const IfExprAST &>(E);
+                unsigned Cond = compile(I.getCond(), Proto, Params);
+                unsigned Then = compile(I.getThen(), Proto, Params);
+                unsigned Else = compile(I.getElse(), Proto, Params);
+                return emit(BO_Select, {Cond, Then, Else});
+            }
+        }
+        return fail();
+    }
+
+    bool failed() const { return Failed; }
+};
+
+/// CompileBatchKernel -- false if Fn can't be run as a kernel, nothing is reported in that case
+static bool CompileBatchKernel(FunctionAST &Fn, BatchKernel &K) {
+    const PrototypeAST &Proto = Fn.getProto();
+    const ExprAST *Body = GetFunctionBody(Fn);
+    if (!Body)
+        return false;
+
+    K = BatchKernel();
+    K.NumParams = (unsigned)Proto.getArgs().size();
+    K.NumRegs = K.NumParams;
+    BatchCompiler C(K);
+    std::vector<unsigned> Params(K.NumParams);
+    for (unsigned i = 0; i < K.NumParams; ++i)
+        Params[i] = i;
+    K.Result = C.compile(*Body, Proto, Params);
+    return !C.failed() && K.NumRegs;
+}
+
+/// RunBatchOp -- Op over rows [Begin, End) of a block without SIMD: everything for the scalar ISA, and
+/// calls and the rows left over after the last full vector for the others
+static void RunBatchOp(const BatchOp &Op, double *const *Regs, size_t Begin, size_t End) {
+    double *D = Regs[Op.Dst];
+    const double *A = Regs[Op.Src[0]], *B = Regs[Op.Src[1]], *C = Regs[Op.Src[2]];
+    switch (Op.Op) {
+        case BO_Add:
+            for (size_t i = Begin; i < End; ++i)
+                D[i] = A[i] + B[i];
+            break;
+        case BO_Sub:
+            for (size_t i = Begin; i < End; ++i)
+                D[i] = A[i] - B[i];
+            break;
+        case BO_Mul:
+            for (size_t i = Begin; i < End; ++i)
+                D[i] = A[i] * B[i];
+            break;
+        case BO_Lt:
+            for (size_t i = Begin; i < End; ++i)
+                D[i] = A[i] < B[i] ? 1.0 : 0.0;
+            break;
+        case BO_Select:
+            for (size_t i = Begin; i < End; ++i)
+                D[i] = IsTrue(A[i]) ? B[i] : C[i];
+            break;
+        case BO_Call: {
+            double Args[MaxExternArgs];
+            unsigned N = (unsigned)Op.Args.size();
+            for (size_t i = Begin; i < End; ++i) {
+                for (unsigned a = 0; a < N; ++a)
+                    Args[a] = Regs[Op.Args[a]][i];
+                D[i] = CallNative(Op.Fn, Args, N);
+            }
+            break;
+        }
+    }
+}
+
+static void RunBatchOpsScalar(const BatchKernel &K, double *const *Regs, size_t Rows) {
+    for (const BatchOp &Op : K.Ops)
+        RunBatchOp(Op, Regs, 0, Rows);
+}
+
+#if LAP_BATCH_X86
+// compares are ordered, so a NaN is neither less than anything nor true, as in the scalar engines
+
+static void RunBatchOpsSSE2(const BatchKernel &K, double *const *Regs, size_t Rows) {
+    const __m128d Zero = _mm_setzero_pd(), One = _mm_set1_pd(1.0);
+    for (const BatchOp &Op : K.Ops) {
+        double *D = Regs[Op.Dst];
+        const double *A = Regs[Op.Src[0]], *B = Regs[Op.Src[1]], *C = Regs[Op.Src[2]];
+        size_t i = 0;
+        switch (Op.Op) {
+            case BO_Add:
+                for (; i + 2 <= Rows; i += 2)
+                    _mm_storeu_pd(D + i, _mm_add_pd(_mm_loadu_pd(A + i), _mm_loadu_pd(B + i)));
+                break;
+            case BO_Sub:
+                for (; i + 2 <= Rows; i += 2)
+                    _mm_storeu_pd(D + i, _mm_sub_pd(_mm_loadu_pd(A + i), _mm_loadu_pd(B + i)));
+                break;
+            case BO_Mul:
+                for (; i + 2 <= Rows; i += 2)
+                    _mm_storeu_pd(D + i, _mm_mul_pd(_mm_loadu_pd(A + i), _mm_loadu_pd(B + i)));
+                break;
+            case BO_Lt:
+                for (; i + 2 <= Rows; i += 2)
+                    _mm_storeu_pd(D + i, _mm_and_pd(_mm_cmplt_pd(_mm_loadu_pd(A + i), _mm_loadu_pd(B + i)), One));
+                break;
+            case BO_Select:
+                // SSE2's cmpneq is unordered, so true is "less or greater" spelled out
+                for (; i + 2 <= Rows; i += 2) {
+                    __m128d V = _mm_loadu_pd(A + i);
+                    __m128d True = _mm_or_pd(_mm_cmplt_pd(V, Zero), _mm_cmpgt_pd(V, Zero));
+                    _mm_storeu_pd(D + i, _mm_or_pd(_mm_and_pd(True, _mm_loadu_pd(B + i)),
+                                                   _mm_andnot_pd(True, _mm_loadu_pd(C + i))));
+                }
+                break;
+            case BO_Call:
+                break;
+        }
+        RunBatchOp(Op, Regs, i, Rows);
+    }
+}
+
+__attribute__((target("avx2"))) static void RunBatchOpsAVX2(const BatchKernel &K, double *const *Regs, size_t Rows) {
+    const __m256d Zero = _mm256_setzero_pd(), One = _mm256_set1_pd(1.0);
+    for (const BatchOp &Op : K.Ops) {
+        double *D = Regs[Op.Dst];
+        const double *A = Regs[Op.Src[0]], *B = Regs[Op.Src[1]], *C = Regs[Op.Src[2]];
+        size_t i = 0;
+        switch (Op.Op) {
+            case BO_Add:
+                for (; i + 4 <= Rows; i += 4)
+                    _mm256_storeu_pd(D + i, _mm256_add_pd(_mm256_loadu_pd(A + i), _mm256_loadu_pd(B + i)));
+                break;
+            case BO_Sub:
+                for (; i + 4 <= Rows; i += 4)
+                    _mm256_storeu_pd(D + i, _mm256_sub_pd(_mm256_loadu_pd(A + i), _mm256_loadu_pd(B + i)));
+                break;
+            case BO_Mul:
+                for (; i + 4 <= Rows; i += 4)
+                    _mm256_storeu_pd(D + i, _mm256_mul_pd(_mm256_loadu_pd(A + i), _mm256_loadu_pd(B + i)));
+                break;
+            case BO_Lt:
+                for (; i + 4 <= Rows; i += 4)
+                    _mm256_storeu_pd(D + i, _mm256_and_pd(_mm256_cmp_pd(_mm256_loadu_pd(A + i), _mm256_loadu_pd(B + i), _CMP_LT_OQ), One));
+                break;
+            case BO_Select:
+                for (; i + 4 <= Rows; i += 4) {
+                    __m256d True = _mm256_cmp_pd(_mm256_loadu_pd(A + i), Zero, _CMP_NEQ_OQ);
+                    _mm256_storeu_pd(D + i, _mm256_blendv_pd(_mm256_loadu_pd(C + i), _mm256_loadu_pd(B + i), True));
+                }
+                break;
+            case BO_Call:
+                break;
+        }
+        RunBatchOp(Op, Regs, i, Rows);
+    }
+}
+#endif
+
+/// RunBatchKernel -- K over rows [Begin, End). Only reads K, so any number of threads can run it at once.
+static void RunBatchKernel(const BatchKernel &K, BatchISA ISA, const double *const *Columns, size_t Begin,
+                           size_t End, double *Out) {
+    static thread_local std::vector<double> Scratch;
+    Scratch.resize((size_t)K.NumRegs * BatchBlockRows);
+    std::vector<double *> Regs(K.NumRegs);
+    for (unsigned R = K.NumParams; R < K.NumRegs; ++R)
+        Regs[R] = Scratch.data() + (size_t)R * BatchBlockRows;
+    for (auto &C : K.Consts)
+        std::fill(Regs[C.first], Regs[C.first] + BatchBlockRows, C.second);
+
+    for (size_t Block = Begin; Block < End; Block += BatchBlockRows) {
+        size_t Rows = std::min(BatchBlockRows, End - Block);
+        for (unsigned P = 0; P < K.NumParams; ++P)
+            Regs[P] = const_cast<double *>(Columns[P] + Block); // parameters are never written
+        switch (ISA) {
+#if LAP_BATCH_X86
+            case ISA_AVX2: RunBatchOpsAVX2(K, Regs.data(), Rows); break;
+            case ISA_SSE2: RunBatchOpsSSE2(K, Regs.data(), Rows); break;
+#endif
+            default:       RunBatchOpsScalar(K, Regs.data(), Rows); break;
+        }
+        std::copy(Regs[K.Result], Regs[K.Result] + Rows, Out + Block);
+    }
+}
+
+/// BatchPool -- the workers for EvaluateBatch, started the first time they're needed. Null with one thread.
+static WorkStealingPool *BatchPool() {
+    static std::unique_ptr<WorkStealingPool> Pool;
+    unsigned Threads = BatchThreads ? BatchThreads : std::max(1u, std::thread::hardware_concurrency());
+    if (Threads < 2)
+        return nullptr;
+    if (!Pool)
+        Pool = std::make_unique<WorkStealingPool>(Threads);
+    return Pool.get();
+}
+
+/// EvaluateRowsScalar -- Fn over rows [Begin, End) one call at a time: natively if the engine compiles
+/// to native code, with the evaluator otherwise. false if a call failed, the error is in PendingDiags.
+static bool EvaluateRowsScalar(FunctionAST &Fn, const double *const *Columns, size_t Begin, size_t End,
+                               double *Out) {
+    size_t NumParams = Fn.getProto().getArgs().size();
+    FunctionSlot &Slot = FunctionSlotFor(Fn.getProto().getName());
+    if (Slot.AST != &Fn) {
+        LogError("batch evaluation of a function that has been redefined");
+        return false;
+    }
+#if LAP_NATIVE
+    if ((Engine == Engine_JIT || Engine == Engine_Tiered) && Slot.BC && NumParams <= MaxExternArgs) {
+        return CatchNativeErrors([&] {
+            void *Code = NativeResolve(Slot.Entry.SlotIndex);
+            double Args[MaxExternArgs];
+            for (size_t i = Begin; i < End; ++i) {
+                for (size_t P = 0; P < NumParams; ++P)
+                    Args[P] = Columns[P][i];
+                Out[i] = CallNative(Code, Args, (unsigned)NumParams);
+            }
+            return true;
+        });
+    }
+#endif
+
+    StartEvaluation();
+    for (size_t i = Begin; i < End; ++i) {
+        for (size_t P = 0; P < NumParams; ++P)
+            EvalStack.push_back(Columns[P][i]);
+        Out[i] = CallFunction(Slot, 0, NumParams);
+        if (EvalFailed)
+            return false;
+    }
+    return true;
+}
+
+/// EvaluateBatch -- Out[i] = Fn(Columns[0][i], ..., Columns[P - 1][i]) for the N rows, as a kernel if Fn
+/// compiles to one (see CompileBatchKernel). false if evaluation failed, the error is in PendingDiags.
+static bool EvaluateBatch(FunctionAST &Fn, const double *const *Columns, size_t N, double *Out) {
+    UpdateMemoization();
+    BatchKernel K;
+    if (!CompileBatchKernel(Fn, K))
+        return EvaluateRowsScalar(Fn, Columns, 0, N, Out);
+    BatchISA ISA = SelectBatchISA();
+
+    // a multiple of BatchBlockRows, which is a multiple of a cache line's worth of doubles
+    size_t RowBytes = sizeof(double) * (K.NumParams + 1);
+    size_t ChunkRows = std::max<size_t>(1, BatchChunkBytes / RowBytes / BatchBlockRows) * BatchBlockRows;
+    WorkStealingPool *Pool = BatchPool();
+    if (!Pool || N <= ChunkRows) {
+        RunBatchKernel(K, ISA, Columns, 0, N, Out);
+        return true;
+    }
+
+    // the first chunk also takes the rows before Out's first cache line boundary
+    size_t Head = (64 - (uintptr_t)Out % 64) % 64 / sizeof(double);
+    size_t NumChunks = (N - Head + ChunkRows - 1) / ChunkRows;
+    auto ChunkBegin = [&](size_t C) { return C ? std::min(N, Head + C * ChunkRows) : 0; };
+    Pool->run(NumChunks, [&](size_t C) { RunBatchKernel(K, ISA, Columns, ChunkBegin(C), ChunkBegin(C + 1), Out); });
+    return true;
+}
+
+/// BenchBatchSpec -- --bench-batch=NAME:ROWS, time EvaluateBatch on NAME over ROWS rows of made up
+/// arguments against one call per row, and check that both give the same results
+static std::string BenchBatchSpec;
+
+static void BenchBatch() {
+    size_t Colon = BenchBatchSpec.rfind(':');
+    std::string Name = BenchBatchSpec.substr(0, Colon);
+    size_t N = Colon == std::string::npos ? 1000000 : strtoul(BenchBatchSpec.c_str() + Colon + 1, nullptr, 10);
+    auto It = FunctionDefs.find(Name);
+    if (It == FunctionDefs.end()) {
+        fprintf(stderr, "Error: --bench-batch: %s is not defined\n", Name.c_str());
+        ++NumErrors;
+        return;
+    }
+    FunctionAST &Fn = *It->second;
+
+    // rows cover negative, zero and positive values, so every branch of an if gets taken
+    size_t NumParams = Fn.getProto().getArgs().size();
+    std::vector<std::vector<double>> Data(NumParams, std::vector<double>(N));
+    std::vector<const double *> Columns(NumParams);
+    for (size_t P = 0; P < NumParams; ++P) {
+        for (size_t i = 0; i < N; ++i)
+            Data[P][i] = (double)((i * (2 * P + 1) + P) % 2001) / 100.0 - 10.0;
+        Columns[P] = Data[P].data();
+    }
+
+    std::vector<double> Batch(N), Scalar(N);
+    BatchKernel K;
+    bool Vector = CompileBatchKernel(Fn, K);
+    auto Start = std::chrono::steady_clock::now();
+    bool Ok = EvaluateBatch(Fn, Columns.data(), N, Batch.data());
+    auto Mid = std::chrono::steady_clock::now();
+    Ok = Ok && EvaluateRowsScalar(Fn, Columns.data(), 0, N, Scalar.data());
+    auto End = std::chrono::steady_clock::now();
+    ReportDiagnostics(PendingDiags);
+    if (!Ok)
+        return;
+
+    size_t Differ = 0;
+    for (size_t i = 0; i < N; ++i)
+        Differ += memcmp(&Batch[i], &Scalar[i], 8) != 0;
+    double BatchNs = std::chrono::duration<double, std::nano>(Mid - Start).count();
+    double ScalarNs = std::chrono::duration<double, std::nano>(End - Mid).count();
+    WorkStealingPool *Pool = BatchPool();
+    fprintf(stderr, "bench-batch: %s over %zu rows: %s, %u threads %.2f ns/row, scalar %.2f ns/row, %zu rows differ\n",
+            Name.c_str(), N, Vector ? BatchISAName(SelectBatchISA()) : "no kernel", Vector && Pool ? Pool->size() : 1,
+            N ? BatchNs / N : 0.0, N ? ScalarNs / N : 0.0, Differ);
+    if (Pool && Pool->steals())
+        fprintf(stderr, "bench-batch: %llu chunks stolen\n", (unsigned long long)Pool->steals());
+}
+
+// -----------------------------------=======
+//            End Batch Evaluation
+// -----------------------------------=======
+
+// -----------------------------------=======
+//            Column Files
+// -----------------------------------=======
+
+/*
+ * --batch=NAME runs NAME over rows read from files instead of a top-level expression, with
+ * EvaluateBatch. The inputs (--input=, any number) are CSV files with a header row, or raw little
+ * endian doubles, one column per file, named after the file ("x.f64" is x) unless given as
+ * --input=x=file. The function's parameters are bound to the columns with their names. Results go to
+ * --output= as CSV if the name ends in .csv and raw doubles otherwise, or as CSV to stdout.
+ *
+ * Input files are mapped, not read. Rows are taken BatchWindowRows at a time: a binary column is used
+ * in place, the CSV columns that are bound get parsed into buffers of that size, results are written
+ * out and the pages that have been consumed are dropped again. So memory use stays the same however
+ * big the files are.
+ *
+ * CSV fields are found 16 bytes at a time with SSE2 compares. Plain decimals with up to 15 or so digits
+ * are converted exactly without strtod (an integer over a power of ten, both exact in a double, is
+ * rounded correctly by the one division), anything else goes to strtod, so the values are always the
+ * ones strtod gives.
+ */
+
+/// BatchWindowRows -- rows taken from the inputs at a time
+static const size_t BatchWindowRows = 1 << 20;
+
+/// BatchFunction / BatchInputs / BatchOutput -- --batch=NAME, --input=[NAME=]PATH and --output=PATH
+static std::string BatchFunction;
+static std::vector<std::string> BatchInputs;
+static std::string BatchOutput;
+
+static bool ColumnError(const std::string &Msg) {
+    fprintf(stderr, "Error: %s\n", Msg.c_str());
+    ++NumErrors;
+    return false;
+}
+
+static bool EndsWith(const std::string &S, const char *Suffix) {
+    size_t N = strlen(Suffix);
+    return S.size() >= N && S.compare(S.size() - N, N, Suffix) == 0;
+}
+
+/// MappedFile -- a whole file, read only. Read into memory where there's no mmap.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+#if LAP_MMAP
+        if (Mapped)
+            munmap(Mapped, Size);
+#endif
+    }
+
+    bool open(const std::string &Path) {
+#if LAP_MMAP
+        int FD = ::open(Path.c_str(), O_RDONLY);
+        struct stat St;
+        if (FD < 0 || fstat(FD, &St) != 0) {
+            if (FD >= 0)
+                close(FD);
+            return ColumnError("can't open " + Path);
+        }
+        Size = (size_t)St.st_size;
+        if (Size) {
+            void *P = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, FD, 0);
+            if (P == MAP_FAILED) {
+                close(FD);
+                return ColumnError("can't map " + Path);
+            }
+            madvise(P, Size, MADV_SEQUENTIAL);
+            Mapped = P;
+            Data = (const char *)P;
+        }
+        close(FD);
+        return true;
+#else
+        std::ifstream In(Path, std::ios::binary);
+        if (!In)
+            return ColumnError("can't open " + Path);
+        Copy.assign(std::istreambuf_iterator<char>(In), std::istreambuf_iterator<char>());
+        Data = Copy.data();
+        Size = Copy.size();
+        return true;
+#endif
+    }
+
+    const char *data() const { return Data; }
+    size_t size() const { return Size; }
+
+    /// release -- nothing before Offset will be read again
+    void release(size_t Offset) {
+#if LAP_MMAP
+        static const size_t Page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t End = Offset / Page * Page;
+        if (Mapped && End > Released) {
+            madvise((char *)Mapped + Released, End - Released, MADV_DONTNEED);
+            Released = End;
+        }
+#else
+        (void)Offset;
+#endif
+    }
+
+private:
+    const char *Data = nullptr;
+    size_t Size = 0;
+#if LAP_MMAP
+    void *Mapped = nullptr;
+    size_t Released = 0;
+#else
+    std::vector<char> Copy;
+#endif
+};
+
+/// FindCsvDelimiter -- the first ',', '\n' or '\r' in [P, End), or End
+static const char *FindCsvDelimiter(const char *P, const char *End) {
+#if LAP_BATCH_X86
+    const __m128i Comma = _mm_set1_epi8(','), LF = _mm_set1_epi8('\n'), CR = _mm_set1_epi8('\r');
+    for (; End - P >= 16; P += 16) {
+        __m128i Bytes = _mm_loadu_si128((const __m128i *)P);
+        __m128i Hits = _mm_or_si128(_mm_cmpeq_epi8(Bytes, Comma),
+                                    _mm_or_si128(_mm_cmpeq_epi8(Bytes, LF), _mm_cmpeq_epi8(Bytes, CR)));
+        if (unsigned Mask = (unsigned)_mm_movemask_epi8(Hits))
+            return P + __builtin_ctz(Mask);
+    }
+#endif
+    while (P < End && *P != ',' && *P != '\n' && *P != '\r')
+        ++P;
+    return P;
+}
+
+/// ParseCsvNumber -- the number in the field [B, E), which may be quoted and padded with blanks
+static bool ParseCsvNumber(const char *B, const char *E, double &V) {
+    while (B < E && (*B == ' ' || *B == '\t'))
+        ++B;
+    while (E > B && (E[-1] == ' ' || E[-1] == '\t'))
+        --E;
+    if (E - B >= 2 && *B == '"' && E[-1] == '"') {
+        ++B;
+        --E;
+    }
+
+    static const double Pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const char *P = B;
+    bool Negative = P < E && *P == '-';
+    if (P < E && (*P == '-' || *P == '+'))
+        ++P;
+    uint64_t Mantissa = 0;
+    int Digits = 0, Fraction = 0;
+    bool Point = false;
+    for (; P < E && Digits <= 19; ++P) {
+        if (*P >= '0' && *P <= '9') {
+            Mantissa = Mantissa * 10 + (uint64_t)(*P - '0');
+            ++Digits;
+            Fraction += Point;
+        } else if (*P == '.' && !Point) {
+            Point = true;
+        } else {
+            break;
+        }
+    }
+    if (P == E && Digits && Digits <= 19 && Mantissa <= (1ull << 53) && Fraction <= 22) {
+        V = (double)Mantissa / Pow10[Fraction];
+        if (Negative)
+            V = -V;
+        return true;
+    }
+
+    char Buf[64];
+    size_t Len = (size_t)(E - B);
+    if (!Len || Len >= sizeof(Buf))
+        return false;
+    memcpy(Buf, B, Len);
+    Buf[Len] = 0;
+    char *Stop;
+    V = strtod(Buf, &Stop);
+    return Stop == Buf + Len;
+}
+
+/// ColumnSource -- one --input file: a binary column, or a CSV file with any number of columns
+struct ColumnSource {
+    std::string Path;
+    MappedFile File;
+    bool Csv = false;
+    std::vector<std::string> Names; // the column names, one for a binary column
+    size_t Rows = 0;                // binary: all of them
+
+    // CSV: where parsing is, and the bound columns' buffers (Slot[i] is column i's, -1 if unbound)
+    const char *Pos = nullptr;
+    size_t Line = 1;
+    std::vector<int> Slot;
+    std::vector<std::vector<double>> Buffers;
+
+};
+
+/// NextCsvField -- the field starting at P, which ends at the returned pointer (a delimiter or End)
+static const char *NextCsvField(const char *P, const char *End) {
+    if (P < End && *P == '"') {
+        for (++P; P < End; ++P)
+            if (*P == '"' && !(P + 1 < End && P[1] == '"'))
+                return FindCsvDelimiter(P + 1, End);
+            else if (*P == '"')
+                ++P; // "" inside quotes
+        return End;
+    }
+    return FindCsvDelimiter(P, End);
+}
+
+/// SkipCsvLineEnd -- past the end of the line at P, and past blank lines after it
+static const char *SkipCsvLineEnd(const char *P, const char *End, size_t &Line) {
+    while (P < End && (*P == '\r' || *P == '\n'))
+        Line += *P++ == '\n';
+    return P;
+}
+
+static bool OpenColumnSource(ColumnSource &Src, const std::string &Spec) {
+    size_t Eq = Spec.find('=');
+    Src.Path = Eq == std::string::npos ? Spec : Spec.substr(Eq + 1);
+    if (!Src.File.open(Src.Path))
+        return false;
+    const char *Data = Src.File.data(), *End = Data + Src.File.size();
+
+    Src.Csv = EndsWith(Src.Path, ".csv");
+    if (!Src.Csv) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return ColumnError(Src.Path + ": binary columns are little endian, which this machine isn't");
+#endif
+        if (Src.File.size() % sizeof(double))
+            return ColumnError(Src.Path + " is not a whole number of doubles");
+        Src.Rows = Src.File.size() / sizeof(double);
+        std::string Name = Src.Path.substr(Src.Path.find_last_of('/') + 1);
+        Src.Names.push_back(Eq == std::string::npos ? Name.substr(0, Name.find('.')) : Spec.substr(0, Eq));
+        Src.Pos = End;
+        return true;
+    }
+    if (Eq != std::string::npos)
+        return ColumnError("--input=" + Spec + ": CSV columns are named by the header row");
+
+    const char *P = Data;
+    while (true) {
+        const char *FieldEnd = NextCsvField(P, End);
+        const char *B = P, *E = FieldEnd;
+        while (B < E && (*B == ' ' || *B == '\t' || *B == '"'))
+            ++B;
+        while (E > B && (E[-1] == ' ' || E[-1] == '\t' || E[-1] == '"'))
+            --E;
+        Src.Names.emplace_back(B, E);
+        P = FieldEnd;
+        if (P == End || *P != ',')
+            break;
+        ++P;
+    }
+    Src.Pos = SkipCsvLineEnd(P, End, Src.Line);
+    Src.Slot.assign(Src.Names.size(), -1);
+    return true;
+}
+
+/// ParseCsvRows -- up to Max more rows of Src's bound columns into its buffers. The number of rows, or
+/// SIZE_MAX after an error.
+static size_t ParseCsvRows(ColumnSource &Src, size_t Max) {
+    const char *P = Src.Pos, *End = Src.File.data() + Src.File.size();
+    size_t Columns = Src.Names.size(), Row = 0;
+    for (; Row < Max && P < End; ++Row) {
+        size_t Col = 0;
+        while (true) {
+            const char *FieldEnd = NextCsvField(P, End);
+            if (Col < Columns && Src.Slot[Col] >= 0 &&
+                !ParseCsvNumber(P, FieldEnd, Src.Buffers[(size_t)Src.Slot[Col]][Row]))
+                return ColumnError(Src.Path + ":" + std::to_string(Src.Line) + ": \"" + std::string(P, FieldEnd) +
+                                   "\" in column " + Src.Names[Col] + " is not a number"),
+                       SIZE_MAX;
+            ++Col;
+            P = FieldEnd;
+            if (P == End || *P != ',')
+                break;
+            ++P;
+        }
+        if (Col != Columns)
+            return ColumnError(Src.Path + ":" + std::to_string(Src.Line) + ": " + std::to_string(Col) +
+                               " fields, the header has " + std::to_string(Columns)),
+                   SIZE_MAX;
+        P = SkipCsvLineEnd(P, End, Src.Line);
+    }
+    Src.Pos = P;
+    return Row;
+}
+
+/// WriteResults -- Rows results to Out, as CSV lines or raw doubles
+static bool WriteResults(FILE *Out, bool Csv, const double *Values, size_t Rows) {
+    if (!Csv)
+        return fwrite(Values, sizeof(double), Rows, Out) == Rows;
+    char Buf[32];
+    for (size_t i = 0; i < Rows; ++i) {
+        int Len = snprintf(Buf, sizeof(Buf), "%.17g\n", Values[i]);
+        if (fwrite(Buf, 1, (size_t)Len, Out) != (size_t)Len)
+            return false;
+    }
+    return true;
+}
+
+/// RunBatchFiles -- --batch: BatchFunction over the rows of BatchInputs into BatchOutput
+static bool RunBatchFiles() {
+    auto It = FunctionDefs.find(BatchFunction);
+    if (It == FunctionDefs.end())
+        return ColumnError("--batch: " + BatchFunction + " is not defined");
+    FunctionAST &Fn = *It->second;
+
+    std::vector<std::unique_ptr<ColumnSource>> Sources;
+    for (const auto &Spec : BatchInputs) {
+        Sources.push_back(std::make_unique<ColumnSource>());
+        if (!OpenColumnSource(*Sources.back(), Spec))
+            return false;
+    }
+
+    // Params[i] is parameter i's column: the source and the column in it. The first input that has a
+    // column of the right name wins.
+    const auto &Args = Fn.getProto().getArgs();
+    std::vector<std::pair<ColumnSource *, size_t>> Params;
+    for (const auto &Arg : Args) {
+        ColumnSource *Found = nullptr;
+        size_t Col = 0;
+        for (auto &Src : Sources) {
+            auto NameIt = std::find(Src->Names.begin(), Src->Names.end(), Arg);
+            if (NameIt != Src->Names.end()) {
+                Found = Src.get();
+                Col = (size_t)(NameIt - Src->Names.begin());
+                break;
+            }
+        }
+        if (!Found)
+            return ColumnError("--batch: no input has a column named " + Arg);
+        if (Found->Csv && Found->Slot[Col] < 0) {
+            Found->Slot[Col] = (int)Found->Buffers.size();
+            Found->Buffers.emplace_back(BatchWindowRows);
+        }
+        Params.push_back({Found, Col});
+    }
+
+    FILE *Out = stdout;
+    bool CsvOut = BatchOutput.empty() || EndsWith(BatchOutput, ".csv");
+    if (!BatchOutput.empty() && !(Out = fopen(BatchOutput.c_str(), CsvOut ? "w" : "wb")))
+        return ColumnError("can't write " + BatchOutput);
+    if (CsvOut)
+        fprintf(Out, "%s\n", BatchFunction.c_str());
+
+    std::vector<double> Results(BatchWindowRows);
+    std::vector<const double *> Columns(Args.size());
+    std::vector<size_t> Avail(Sources.size());
+    bool Ok = true;
+    for (size_t Row = 0; Ok;) {
+        // each input gives what it has of the next window, which is the same for all of them unless
+        // one runs out before the others
+        size_t Want = BatchWindowRows;
+        for (size_t i = 0; i < Sources.size(); ++i)
+            if (!Sources[i]->Csv)
+                Want = std::min(Want, Avail[i] = std::min(BatchWindowRows, Sources[i]->Rows - Row));
+        for (size_t i = 0; i < Sources.size() && Ok; ++i)
+            if (Sources[i]->Csv)
+                Ok = (Avail[i] = ParseCsvRows(*Sources[i], Want)) != SIZE_MAX;
+        if (!Ok)
+            break;
+        size_t Rows = Sources.empty() ? 0 : *std::min_element(Avail.begin(), Avail.end());
+        bool CsvLeft = std::any_of(Sources.begin(), Sources.end(), [](const std::unique_ptr<ColumnSource> &Src) {
+            return Src->Csv && Src->Pos != Src->File.data() + Src->File.size();
+        });
+        if (std::any_of(Avail.begin(), Avail.end(), [&](size_t A) { return A != Rows; }) || (!Rows && CsvLeft)) {
+            Ok = ColumnError("--batch: the inputs don't all have the same number of rows");
+            break;
+        }
+        if (!Rows)
+            break;
+
+        for (size_t i = 0; i < Params.size(); ++i) {
+            ColumnSource &Src = *Params[i].first;
+            Columns[i] = Src.Csv ? Src.Buffers[(size_t)Src.Slot[Params[i].second]].data()
+                                 : (const double *)Src.File.data() + Row;
+        }
+        if (!EvaluateBatch(Fn, Columns.data(), Rows, Results.data())) {
+            ReportDiagnostics(PendingDiags);
+            Ok = false;
+            break;
+        }
+        if (!WriteResults(Out, CsvOut, Results.data(), Rows)) {
+            Ok = ColumnError("can't write " + (BatchOutput.empty() ? std::string("stdout") : BatchOutput));
+            break;
+        }
+
+        Row += Rows;
+        for (auto &Src : Sources)
+            Src->File.release(Src->Csv ? (size_t)(Src->Pos - Src->File.data()) : Row * sizeof(double));
+    }
+
+    if (Out != stdout && fclose(Out) != 0 && Ok)
+        Ok = ColumnError("can't write " + BatchOutput);
+    else if (Out == stdout)
+        fflush(Out);
+    return Ok;
+}
+
+// -----------------------------------=======
+//            End Column Files
+// -----------------------------------=======
+
+/// ParseThreads -- 0 runs the interactive MainLoop, otherwise the number of threads for ParseItemsInParallel
+static unsigned ParseThreads = 0;
+
+/// Incremental / InputFiles -- --incremental and the files it reads, in order
+static bool Incremental = false;
+static std::vector<std::string> InputFiles;
+
+/// FinishRun -- what happens once the whole input has been handled, however it was parsed: the lazy
+/// bodies nothing used, the batch runs, the reports asked for and the object file. Returns the exit status.
+static int FinishRun() {
+    if (LazyBodies)
+        ParseRemainingBodies();
+    if (!BenchBatchSpec.empty())
+        BenchBatch();
+    if (!BatchFunction.empty())
+        RunBatchFiles();
+    if (MemoizeAny())
+        PrintMemoStats();
+    if (TimePasses)
+        PrintPassTimes();
+    if (InlineReport) {
+        PrintInlineStats();
+        PrintSpecializeStats();
+    }
+    if (RegAllocReport)
+        PrintRegAllocStats();
+    if (PeepholeReport)
+        PrintPeepholeStats();
+    if (CacheReport)
+        PrintCacheStats();
+    if (Engine == Engine_Object && !NumErrors)
+        EmitObjectOutput();
+    return NumErrors ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        std::string Arg = argv[i];
+        if (Arg.rfind("--max-errors=", 0) == 0) {
+            MaxErrors = (unsigned)strtoul(Arg.c_str() + 13, nullptr, 10);
+        } else if (Arg == "--fold") {
+            FoldConstants = true;
+        } else if (Arg == "--fast-math") {
+            FoldConstants = FastMath = true;
+        } else if (Arg == "--emit-bytecode") {
+            EmitBytecode = true;
+        } else if (Arg == "--single-pass") {
+            SinglePass = true;
+        } else if (Arg == "--engine=ast") {
+            Engine = Engine_AST;
+        } else if (Arg == "--engine=vm") {
+            Engine = Engine_VM;
+        } else if (Arg == "--engine=jit") {
+#if LAP_NATIVE
+            Engine = Engine_JIT;
+#else
+            fprintf(stderr, "warning: --engine=jit needs x86-64, using --engine=vm\n");
+            Engine = Engine_VM;
+#endif
+        } else if (Arg == "--engine=tiered") {
+#if LAP_NATIVE
+            Engine = Engine_Tiered;
+#else
+            fprintf(stderr, "warning: --engine=tiered needs x86-64, using --engine=vm\n");
+            Engine = Engine_VM;
+#endif
+        } else if (Arg == "--regalloc=linear") {
+            XmmAllocate = true;
+        } else if (Arg == "--regalloc=spill") {
+            XmmAllocate = false;
+        } else if (Arg == "--regalloc-stats") {
+            RegAllocReport = true;
+        } else if (Arg.rfind("--emit-obj=", 0) == 0) {
+            ObjectOutput = Arg.substr(11);
+            ObjectExecutable = false;
+        } else if (Arg.rfind("--emit-exe=", 0) == 0) {
+            ObjectOutput = Arg.substr(11);
+            ObjectExecutable = true;
+        } else if (Arg == "--emit-main") {
+            ObjectMain = true;
+        } else if (Arg == "--cache") {
+            CacheDir = DefaultCacheDir();
+        } else if (Arg.rfind("--cache=", 0) == 0) {
+            CacheDir = Arg.substr(8);
+        } else if (Arg.rfind("--cache-size=", 0) == 0) {
+            CacheLimit = strtoull(Arg.c_str() + 13, nullptr, 10) << 20;
+        } else if (Arg == "--cache-stats") {
+            CacheReport = true;
+        } else if (Arg == "--no-peephole") {
+            Peephole = false;
+        } else if (Arg == "--peephole-stats") {
+            PeepholeReport = true;
+        } else if (Arg.rfind("--tier-threshold=", 0) == 0) {
+            TierThreshold = std::max(1ul, strtoul(Arg.c_str() + 17, nullptr, 10));
+        } else if (Arg == "--lazy") {
+            LazyBodies = true;
+        } else if (Arg.rfind("--bench=", 0) == 0) {
+            BenchRuns = (unsigned)strtoul(Arg.c_str() + 8, nullptr, 10);
+        } else if (Arg == "--incremental") {
+            Incremental = true;
+        } else if (Arg.rfind("--", 0) != 0) {
+            InputFiles.push_back(Arg);
+        } else if (Arg == "--parallel") {
+            ParseThreads = std::max(1u, std::thread::hardware_concurrency());
+        } else if (Arg.rfind("--parallel=", 0) == 0) {
+            ParseThreads = std::max(1ul, strtoul(Arg.c_str() + 11, nullptr, 10));
+        } else if (Arg == "--memoize") {
+            MemoizeAll = true;
+        } else if (Arg.rfind("--memoize=", 0) == 0) {
+            for (size_t Begin = 10, End; Begin <= Arg.size(); Begin = End + 1) {
+                End = std::min(Arg.find(',', Begin), Arg.size());
+                if (End > Begin)
+                    MemoizeNames.push_back(Arg.substr(Begin, End - Begin));
+            }
+        } else if (Arg.rfind("--memo-size=", 0) == 0) {
+            MemoSize = std::max(1ul, strtoul(Arg.c_str() + 12, nullptr, 10));
+        } else if (Arg.rfind("--bench-batch=", 0) == 0) {
+            BenchBatchSpec = Arg.substr(14);
+        } else if (Arg.rfind("--batch=", 0) == 0) {
+            BatchFunction = Arg.substr(8);
+        } else if (Arg.rfind("--input=", 0) == 0) {
+            BatchInputs.push_back(Arg.substr(8));
+        } else if (Arg.rfind("--output=", 0) == 0) {
+            BatchOutput = Arg.substr(9);
+        } else if (Arg.rfind("--batch-threads=", 0) == 0) {
+            BatchThreads = std::max(1ul, strtoul(Arg.c_str() + 16, nullptr, 10));
+        } else if (Arg == "--batch-isa=scalar") {
+            BatchISALimit = ISA_Scalar;
+        } else if (Arg == "--batch-isa=sse2") {
+            BatchISALimit = ISA_SSE2;
+        } else if (Arg == "--batch-isa=avx2") {
+            BatchISALimit = ISA_AVX2;
+        } else if (Arg == "--no-tail-calls") {
+            TailCalls = false;
+        } else if (Arg == "--opt") {
+            Optimize = true;
+        } else if (Arg == "--emit-ir") {
+            Optimize = EmitIR = true;
+        } else if (Arg == "--time-passes") {
+            TimePasses = true;
+        } else if (Arg.rfind("--inline-threshold=", 0) == 0) {
+            InlineThreshold = (unsigned)strtoul(Arg.c_str() + 19, nullptr, 10);
+        } else if (Arg == "--inline-report") {
+            InlineReport = true;
+        } else if (Arg.rfind("--specialize-budget=", 0) == 0) {
+            SpecializeBudget = (unsigned)strtoul(Arg.c_str() + 20, nullptr, 10);
+        } else if (Arg.rfind("--load=", 0) == 0) {
+#if LAP_DLOPEN
+            if (!LoadExternLibrary(Arg.substr(7)))
+                return 1;
+#else
+            fprintf(stderr, "warning: --load needs dlopen, ignoring %s\n", Arg.c_str());
+#endif
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", Arg.c_str());
+            return 1;
+        }
+    }
+
+    InstallBuiltinOperators();
+
+    if (Incremental) {
+        if (InputFiles.empty()) {
+            fprintf(stderr, "Error: --incremental needs at least one input file\n");
+            return 1;
+        }
+        // lazy bodies would point into the token buffer of a version that is gone by the next update
+        LazyBodies = false;
+        RunIncremental(InputFiles);
+        return NumErrors ? 1 : 0;
+    }
+    if (!InputFiles.empty()) {
+        fprintf(stderr, "Error: input files are only read with --incremental, otherwise the input is stdin\n");
+        return 1;
+    }
+
+    // lazy bodies need the whole input in a token buffer, which only the parallel parser has
+    if (SinglePass) {
+        if (Optimize)
+            fprintf(stderr, "warning: --opt needs the AST, which --single-pass doesn't build; not optimizing\n");
+        Optimize = EmitIR = false;
+        LazyBodies = false;
+        if (Engine == Engine_AST)
+            Engine = Engine_VM;
+    }
+    if (LazyBodies && !ParseThreads)
+        ParseThreads = 1;
+    if (!ObjectOutput.empty())
+        Engine = Engine_Object;
+    KeepReplacedBytecode = Engine == Engine_Object;
+    if (Optimize && !CompilesItems()) {
+        fprintf(stderr, "warning: --opt only changes compiled code, which --engine=ast doesn't use; not optimizing\n");
+        Optimize = false;
+    }
+    if (!CacheDir.empty() && !SinglePass && !InitCache()) {
+        fprintf(stderr, "warning: can't keep a cache in %s; not caching\n", CacheDir.c_str());
+        CacheDir.clear();
+    }
+    InlineHotBonus = CacheDir.empty();
+    if (Engine != Engine_Tiered)
+        TierThreshold = 0;
+    else if (!TierThreshold)
+        TierThreshold = 1000;
+#if LAP_NATIVE
+    if ((Engine == Engine_JIT || Engine == Engine_Tiered) && !InitNativeCode()) {
+        fprintf(stderr, "Error: could not allocate executable memory\n");
+        return 1;
+    }
+#endif
+
+    if (ParseThreads) {
+        ParseItemsInParallel(ParseThreads);
+    } else {
+        // Prime the first token
+        fprintf(stderr, "ready> ");
+        getNextToken();
+
+        // Run the main "interpreter loop" now.
+        MainLoop();
+    }
 
-    return 0;
+    return FinishRun();
 }